@@ -56,22 +56,60 @@ void gen_hash(const unsigned char *data, unsigned int len, unsigned char *hash)
 #define CL_NEXTKERNEL_SET_ARG_0(var) CL_NEXTKERNEL_SET_ARG_N(0, var)
 #define CL_NEXTKERNEL_SET_ARG(var) CL_NEXTKERNEL_SET_ARG_N(num++, var)
 
-// Placeholder - I may use it later.
-static void whirlpoolx_set_compile_options(build_kernel_data *build_data, struct cgpu_info *gpu, algorithm_settings_t *settings)
+// Each kernel mode adds its own -D define to the compiler options, and its own short tag to the
+// binary name, so a cached binary built for one mode is never loaded for another.
+static void whirlpoolx_set_compile_options(build_kernel_data *build_data, struct cgpu_info *gpu, algorithm_t *algorithm)
 {
-	return;
+	if(gpu->hostkeys)
+	{
+		strcat(build_data->compiler_options, " -D WHIRLPOOLX_HOSTKEYS");
+		strcat(build_data->binary_filename, "hk");
+	}
+	
+	if(gpu->bitsliced)
+	{
+		strcat(build_data->compiler_options, " -D WHIRLPOOLX_BITSLICED");
+		strcat(build_data->binary_filename, "bs");
+	}
+	
+	if(gpu->round1pre)
+	{
+		strcat(build_data->compiler_options, " -D WHIRLPOOLX_ROUND1");
+		strcat(build_data->binary_filename, "r1");
+	}
+	
+	// How many nonces each work-item hashes side by side, and how many times it loops over that - one
+	// is the plain kernel, and gets no define at all.
+	if(gpu->vwidth > 1)
+	{
+		char buf[32];
+		
+		sprintf(buf, " -D WHIRLPOOLX_VECTORS=%d", (int)gpu->vwidth);
+		strcat(build_data->compiler_options, buf);
+		sprintf(buf, "v%d", (int)gpu->vwidth);
+		strcat(build_data->binary_filename, buf);
+	}
+	
+	if(gpu->kernel_nonces > 1)
+	{
+		char buf[32];
+		
+		sprintf(buf, " -D WHIRLPOOLX_NONCES=%d", gpu->kernel_nonces);
+		strcat(build_data->compiler_options, buf);
+		sprintf(buf, "n%d", gpu->kernel_nonces);
+		strcat(build_data->binary_filename, buf);
+	}
 }
 
-static cl_int queue_whirlpoolx_kernel(struct __clState *clState, struct _dev_blk_ctx *blk, __maybe_unused cl_uint threads)
+// Everything the kernel needs that depends on the work, but not on the nonce, gets worked out here,
+// once per work - it used to be redone on every single scanhash call, for no reason at all.
+static void whirlpoolx_prepare_work(struct _dev_blk_ctx *blk)
 {
-	uint64_t midblock[8], key[8] = { 0 };
-	cl_ulong le_target;
-	cl_int status;
+	uint64_t midblock[8], key[8] = { 0 }, data[10];
 	
-	le_target = *(cl_ulong *)(blk->work->device_target + 24);
-	flip80(clState->cldata, blk->work->data);
+	flip80(data, blk->work->data);
 	
-	memcpy(midblock, clState->cldata, 64);
+	memcpy(midblock, data, 64);
 	
 	// midblock = n, key = h
 	for(int i = 0; i < 10; ++i)
@@ -82,22 +120,104 @@ static cl_int queue_whirlpoolx_kernel(struct __clState *clState, struct _dev_blk
 		for(int x = 0; x < 8; ++x) midblock[x] ^= key[x];
 	}
 	
-	for(int i = 0; i < 8; ++i) midblock[i] ^= ((uint64_t *)(clState->cldata))[i];
+	for(int i = 0; i < 8; ++i) blk->midstate64[i] = midblock[i] ^ data[i];
+	
+	// The second block's key schedule only depends on the midstate, so host keys mode uploads this
+	// copy - it's part of the work, so it lives at least as long as the launch that reads it.
+	whirlpool_key_schedule((uint64_t (*)[8])blk->roundkeys64, (const uint64_t *)blk->midstate64);
 	
-	status = clSetKernelArg(clState->kernel, 0, sizeof(cl_ulong8), (cl_ulong8 *)&midblock);
-	status |= clSetKernelArg(clState->kernel, 1, sizeof(cl_ulong), (void *)(((uint64_t *)clState->cldata) + 8));
-	status |= clSetKernelArg(clState->kernel, 2, sizeof(cl_ulong), (void *)(((uint64_t *)clState->cldata) + 9));
-	status |= clSetKernelArg(clState->kernel, 3, sizeof(cl_mem), (void *)&clState->outputBuffer);
-	status |= clSetKernelArg(clState->kernel, 4, sizeof(cl_ulong), (void *)&le_target);
+	blk->input0 = data[8];
+	blk->input1 = data[9];
+	blk->le_target = *(cl_ulong *)(blk->work->device_target + 24);
+}
 
+static cl_int queue_whirlpoolx_kernel(struct __clState *clState, struct _dev_blk_ctx *blk, __maybe_unused cl_uint threads)
+{
+	cl_int status = CL_SUCCESS;
+	bool round1_stale = false;
+	
+	// Kernel arguments stick around between launches, so only the ones that actually changed since
+	// the last call get set again. Most of the time, that's none of them.
+	if(!clState->args_set)
+	{
+		status |= clSetKernelArg(clState->kernel, 5, sizeof(cl_mem), (void *)&clState->AbortBuf);
+		if(clState->hostkeys) status |= clSetKernelArg(clState->kernel, 7, sizeof(cl_mem), (void *)&clState->KeyScheduleBuf);
+	}
+	
+	// Every launch carries the abort generation it was made under - the kernel quits as soon as it
+	// sees a newer one in AbortBuf. The driver takes it under the same lock the restart thread bumps
+	// it under, so a launch is either aborted along with its stale work or not at all.
+	cl_uint gen = clState->launch_gen;
+	
+	if(!clState->args_set || clState->arg_gen != gen)
+	{
+		clState->arg_gen = gen;
+		status |= clSetKernelArg(clState->kernel, 6, sizeof(cl_uint), (void *)&clState->arg_gen);
+	}
+	
+	// In pipelined mode, the output buffer changes from launch to launch.
+	if(!clState->args_set || clState->arg_output != clState->outputBuffer)
+	{
+		clState->arg_output = clState->outputBuffer;
+		status |= clSetKernelArg(clState->kernel, 3, sizeof(cl_mem), (void *)&clState->arg_output);
+	}
+	
+	if(!clState->args_set || memcmp(clState->arg_midstate, blk->midstate64, sizeof(clState->arg_midstate)))
+	{
+		memcpy(clState->arg_midstate, blk->midstate64, sizeof(clState->arg_midstate));
+		round1_stale = true;
+		status |= clSetKernelArg(clState->kernel, 0, sizeof(cl_ulong8), (void *)clState->arg_midstate);
+		
+		// In host keys mode, the kernel gets the key schedule prepare_work already expanded. The write
+		// isn't blocking, and reads straight from the work, which the scan keeps a reference to - or
+		// finishes - before it can be freed, so nothing shared gets overwritten under it.
+		if(clState->hostkeys)
+			status |= clEnqueueWriteBuffer(clState->commandQueue, clState->KeyScheduleBuf, CL_FALSE, 0, sizeof(blk->roundkeys64), blk->roundkeys64, 0, NULL, NULL);
+	}
+	
+	if(!clState->args_set || clState->arg_input0 != blk->input0)
+	{
+		clState->arg_input0 = blk->input0;
+		round1_stale = true;
+		status |= clSetKernelArg(clState->kernel, 1, sizeof(cl_ulong), (void *)&clState->arg_input0);
+	}
+	
+	if(!clState->args_set || clState->arg_input1 != blk->input1)
+	{
+		clState->arg_input1 = blk->input1;
+		round1_stale = true;
+		status |= clSetKernelArg(clState->kernel, 2, sizeof(cl_ulong), (void *)&clState->arg_input1);
+	}
+	
+	if(!clState->args_set || clState->arg_target != blk->le_target)
+	{
+		clState->arg_target = blk->le_target;
+		status |= clSetKernelArg(clState->kernel, 4, sizeof(cl_ulong), (void *)&clState->arg_target);
+	}
+	
+	// The first round of the state depends on all three of the above, but not the nonce - so in round 1
+	// precompute mode, it's redone here whenever one of them changes. It goes after the host keys buffer,
+	// if there is one, and the first round key alone follows it when there isn't.
+	if(clState->round1pre && round1_stale)
+	{
+		cl_uint idx = clState->hostkeys ? 8 : 7;
+		
+		whirlpoolx_round1_partial((uint64_t *)clState->arg_round1, (uint64_t *)clState->arg_key1, (const uint64_t *)clState->arg_midstate, clState->arg_input0, clState->arg_input1);
+		status |= clSetKernelArg(clState->kernel, idx, sizeof(cl_ulong8), (void *)clState->arg_round1);
+		if(!clState->hostkeys) status |= clSetKernelArg(clState->kernel, idx + 1, sizeof(cl_ulong8), (void *)clState->arg_key1);
+	}
+	
+	// If anything went wrong, don't trust the cache - set everything again next time.
+	clState->args_set = (status == CL_SUCCESS);
+	
 	return status;
 }
 
 static algorithm_settings_t algos[] = 
 {  
-	{ "whirlpoolx", ALGO_WHIRLPOOLX, "", 1, 1, 1, 0, 0, 0xFFU, 0xFFFFULL, 0x0000FFFFUL, 0, 0, 0, whirlpoolx_regenhash, queue_whirlpoolx_kernel, gen_hash, NULL },
+	{ "whirlpoolx", ALGO_WHIRLPOOLX, "", 1, 1, 1, 0, 0, 0xFFU, 0xFFFFULL, 0x0000FFFFUL, 0, 0, 0, whirlpoolx_regenhash, queue_whirlpoolx_kernel, gen_hash, whirlpoolx_set_compile_options, whirlpoolx_prepare_work, whirlpoolx_regenhash_many },
 	// Terminator (do not remove)
-	{ NULL, ALGO_UNK, "", 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL}
+	{ NULL, ALGO_UNK, "", 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL }
 };
 
 // I really hope you've defined strcasecmp() if it didn't exist, because I saw it used
@@ -129,6 +249,8 @@ void set_algorithm(algorithm_t *algo, const char *newname_alias)
 		algo->queue_kernel = algos[0].queue_kernel;
 		algo->gen_hash = algos[0].gen_hash;
 		algo->set_compile_options = algos[0].set_compile_options;
+		algo->prepare_work = algos[0].prepare_work;
+		algo->regenhash_many = algos[0].regenhash_many;
 	}
 }
 
@@ -64,6 +64,8 @@ typedef struct _algorithm_t {
   cl_int   (*queue_kernel)(struct __clState *, struct _dev_blk_ctx *, cl_uint);
   void     (*gen_hash)(const unsigned char *, unsigned int, unsigned char *);
   void     (*set_compile_options)(struct _build_kernel_data *, struct cgpu_info *, struct _algorithm_t *);
+  void     (*prepare_work)(struct _dev_blk_ctx *);
+  void     (*regenhash_many)(struct work *, const uint32_t *, uint32_t [][8], int, bool);
 } algorithm_t;
 
 // A structure called algorithm_t was here - but it was superseded by algorithm_settings_t,
@@ -91,6 +93,8 @@ typedef struct _algorithm_settings_t
 	cl_int   (*queue_kernel)(struct __clState *, struct _dev_blk_ctx *, cl_uint);
 	void     (*gen_hash)(const unsigned char *, unsigned int, unsigned char *);
 	void     (*set_compile_options)(build_kernel_data *, struct cgpu_info *, algorithm_t *);
+	void     (*prepare_work)(struct _dev_blk_ctx *);
+	void     (*regenhash_many)(struct work *, const uint32_t *, uint32_t [][8], int, bool);
 } algorithm_settings_t;
 
 /* Set default parameters based on name. */
@@ -34,6 +34,11 @@
 #include <stdint.h>
 #include <string.h>
 
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define WHIRLPOOLX_SIMD_X86
+#include <immintrin.h>
+#endif
+
 #include "whirlpoolx.h"
 
 /*
@@ -129,6 +134,25 @@ void whirlpool_round(uint64_t block[8], const uint64_t key[8]) {
 	DOROW(7, h, g, f, e, d, c, b, a)
 }
 
+/*
+ * Expand the ten round keys Whirlpool uses when compressing a block under the
+ * chaining value chain[]. The key schedule never sees the message, so for
+ * WhirlpoolX it's the same for every nonce of a work item.
+ */
+void whirlpool_key_schedule(uint64_t keys[10][8], const uint64_t chain[8])
+{
+	uint64_t rcon[8] = { 0 };
+	const uint64_t *prev = chain;
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		memcpy(keys[i], prev, sizeof(keys[i]));
+		rcon[0] = WHIRLPOOL_ROUND_CONSTANTS[i];
+		whirlpool_round(keys[i], rcon);
+		prev = keys[i];
+	}
+}
+
 void whirlpool_hash(const uint8_t *message, uint32_t len, uint8_t hash[64]) {
 	memset(hash, 0, 64);
 	
@@ -184,6 +208,699 @@ void whirlpoolx_hash(void *state, const void *input)
 static const uint32_t diff1targ = 0x0000ffff;
 
 
+/* Used externally as confirmation of correct OCL code */
+void whirlpoolx_regenhash(struct work *work)
+{
+    uint32_t data[20];
+    uint32_t *nonce = (uint32_t *)(work->data + 76);
+    uint32_t *ohash = (uint32_t *)(work->hash);
+
+    be32enc_vect(data, (const uint32_t *)work->data, 19);
+    data[19] = htobe32(*nonce);
+    whirlpoolx_hash(ohash, data);
+}
+
+// With full set, the lanes functions store the whole hash. Without it, they
+// stop short in the last round, computing only the two rows the target check
+// needs - rows 3 and 5 fold into the final 64-bit word - and only words 6 and
+// 7 of each hash are written.
+typedef void (*whirlpoolx_lanes_fn)(uint32_t hashes[][8], const uint64_t *words, int count, const whirlpoolx_mid *mid, bool full);
+
+void whirlpoolx_init_mid(whirlpoolx_mid *mid, const uint8_t *header)
+{
+	uint64_t zero[8] = { 0 }, keys[10][8], data[10], s[8];
+	
+	be32enc_vect((uint32_t *)data, (const uint32_t *)header, 19);
+	
+	// First block, under an all zero chaining value
+	whirlpool_key_schedule(keys, zero);
+	memcpy(s, data, 64);
+	for(int i = 0; i < 10; ++i) whirlpool_round(s, keys[i]);
+	for(int i = 0; i < 8; ++i) mid->chain[i] = data[i] ^ s[i];
+	
+	whirlpool_key_schedule(mid->keys, mid->chain);
+	
+	// Second block: the tail of the header, the 0x80 padding byte, and the bit
+	// length (640) stored big endian in the last 8 bytes. The nonce half of
+	// block[1] is filled in per lane.
+	memset(mid->block, 0, sizeof(mid->block));
+	mid->block[0] = data[8];
+	mid->block[1] = data[9] & 0xFFFFFFFFULL;
+	mid->block[2] = 0x80ULL;
+	mid->block[7] = 0x8002000000000000ULL;
+}
+
+static inline uint64_t whirlpoolx_lane_word(const whirlpoolx_mid *mid, uint32_t nonce)
+{
+	return(mid->block[1] | ((uint64_t)htobe32(htole32(nonce)) << 32));
+}
+
+// WhirlpoolX folds the 64 byte digest in half, so only four words come out.
+static inline void whirlpoolx_store(uint32_t hash[8], const uint64_t d[8])
+{
+	uint64_t out[4];
+	
+	for(int i = 0; i < 4; ++i) out[i] = d[i] ^ d[i + 2];
+	memcpy(hash, out, sizeof(out));
+}
+
+// One row of whirlpool_round(), without the key. The rotate after every lookup
+// there, unrolled, is the same as rotating lookup k left by 8 * k bits.
+static inline uint64_t whirlpool_row(const uint64_t s[8], int i)
+{
+	uint64_t r = MAGIC_TABLE[(uint8_t)s[i]];
+	
+	for(int k = 1; k < 8; ++k)
+	{
+		uint64_t v = MAGIC_TABLE[(uint8_t)(s[(i - k) & 7] >> (k << 3))];
+		r ^= (v << (k << 3)) | (v >> (64 - (k << 3)));
+	}
+	
+	return(r);
+}
+
+/*
+ * The first round of the second block, for the kernel's round 1 precompute mode.
+ * Only the top half of the second message word holds the nonce, and in W, each
+ * byte of a word only feeds one row - so rows 1 to 4 come out the same for every
+ * nonce, and rows 5, 6, 7 and 0 each miss exactly one lookup, the one on byte 4,
+ * 5, 6 and 7 of that word, respectively. Everything else, plus the round key, is
+ * put in round1. key1 gets the first round key, for kernels that expand the
+ * rest of the schedule themselves.
+ */
+void whirlpoolx_round1_partial(uint64_t round1[8], uint64_t key1[8], const uint64_t midstate[8], uint64_t input0, uint64_t input1)
+{
+	uint64_t s[8] = { input0, input1 & 0xFFFFFFFFULL, 0x80ULL, 0, 0, 0, 0, 0x8002000000000000ULL };
+	uint64_t rcon[8] = { WHIRLPOOL_ROUND_CONSTANTS[0], 0, 0, 0, 0, 0, 0, 0 };
+	
+	memcpy(key1, midstate, sizeof(uint64_t) * 8);
+	whirlpool_round(key1, rcon);
+	
+	for(int i = 0; i < 8; ++i) s[i] ^= midstate[i];
+	
+	for(int i = 0; i < 8; ++i)
+	{
+		uint64_t r = key1[i];
+		
+		for(int k = 0; k < 8; ++k)
+		{
+			uint64_t v;
+			
+			if(((i - k) & 7) == 1 && k >= 4) continue;
+			
+			v = MAGIC_TABLE[(uint8_t)(s[(i - k) & 7] >> (k << 3))];
+			r ^= k ? (v << (k << 3)) | (v >> (64 - (k << 3))) : v;
+		}
+		
+		round1[i] = r;
+	}
+}
+
+static void whirlpoolx_lanes_scalar(uint32_t hashes[][8], const uint64_t *words, int count, const whirlpoolx_mid *mid, bool full)
+{
+	for(int n = 0; n < count; ++n)
+	{
+		uint64_t m[8], s[8], tail;
+		
+		memcpy(m, mid->block, sizeof(m));
+		m[1] = words[n];
+		
+		for(int i = 0; i < 8; ++i) s[i] = m[i] ^ mid->chain[i];
+		for(int i = 0; i < 9; ++i) whirlpool_round(s, mid->keys[i]);
+		
+		if(full)
+		{
+			whirlpool_round(s, mid->keys[9]);
+			for(int i = 0; i < 8; ++i) s[i] ^= m[i] ^ mid->chain[i];
+			whirlpoolx_store(hashes[n], s);
+			continue;
+		}
+		
+		tail = whirlpool_row(s, 3) ^ mid->keys[9][3] ^ m[3] ^ mid->chain[3];
+		tail ^= whirlpool_row(s, 5) ^ mid->keys[9][5] ^ m[5] ^ mid->chain[5];
+		memcpy(hashes[n] + 6, &tail, sizeof(tail));
+	}
+}
+
+#ifdef WHIRLPOOLX_SIMD_X86
+
+// The vector versions work like whirlpool_row(), with one table gather per byte
+// for every lane at once.
+
+__attribute__((target("avx2")))
+static void whirlpoolx_lanes_avx2(uint32_t hashes[][8], const uint64_t *words, int count, const whirlpoolx_mid *mid, bool full)
+{
+	const __m256i bytemask = _mm256_set1_epi64x(0xFF);
+	int n;
+	
+	for(n = 0; n + 4 <= count; n += 4)
+	{
+		__m256i s[8], t[8], m1 = _mm256_loadu_si256((const __m256i *)(words + n));
+		uint64_t d[4][8], lanes[4];
+		
+		for(int i = 0; i < 8; ++i) s[i] = _mm256_set1_epi64x(mid->block[i] ^ mid->chain[i]);
+		s[1] = _mm256_xor_si256(m1, _mm256_set1_epi64x(mid->chain[1]));
+		
+		for(int r = 0; r < 10; ++r)
+		{
+			for(int i = 0; i < 8; ++i)
+			{
+				__m256i acc = _mm256_set1_epi64x(mid->keys[r][i]);
+				
+				if(r == 9 && !full && i != 3 && i != 5) continue;
+				
+				for(int k = 0; k < 8; ++k)
+				{
+					__m256i idx = _mm256_and_si256(_mm256_srli_epi64(s[(i - k) & 7], k << 3), bytemask);
+					__m256i v = _mm256_i64gather_epi64((const long long *)MAGIC_TABLE, idx, 8);
+					
+					if(k) v = _mm256_or_si256(_mm256_slli_epi64(v, k << 3), _mm256_srli_epi64(v, 64 - (k << 3)));
+					acc = _mm256_xor_si256(acc, v);
+				}
+				
+				t[i] = acc;
+			}
+			
+			memcpy(s, t, sizeof(s));
+		}
+		
+		if(!full)
+		{
+			__m256i x = _mm256_xor_si256(_mm256_xor_si256(s[3], s[5]),
+				_mm256_set1_epi64x(mid->block[3] ^ mid->chain[3] ^ mid->block[5] ^ mid->chain[5]));
+			
+			_mm256_storeu_si256((__m256i *)lanes, x);
+			for(int l = 0; l < 4; ++l) memcpy(hashes[n + l] + 6, lanes + l, sizeof(lanes[l]));
+			continue;
+		}
+		
+		for(int i = 0; i < 8; ++i)
+		{
+			__m256i x = _mm256_xor_si256(s[i], _mm256_set1_epi64x(mid->block[i] ^ mid->chain[i]));
+			
+			if(i == 1) x = _mm256_xor_si256(_mm256_xor_si256(s[1], m1), _mm256_set1_epi64x(mid->chain[1]));
+			
+			_mm256_storeu_si256((__m256i *)lanes, x);
+			for(int l = 0; l < 4; ++l) d[l][i] = lanes[l];
+		}
+		
+		for(int l = 0; l < 4; ++l) whirlpoolx_store(hashes[n + l], d[l]);
+	}
+	
+	whirlpoolx_lanes_scalar(hashes + n, words + n, count - n, mid, full);
+}
+
+__attribute__((target("avx512f")))
+static void whirlpoolx_lanes_avx512(uint32_t hashes[][8], const uint64_t *words, int count, const whirlpoolx_mid *mid, bool full)
+{
+	const __m512i bytemask = _mm512_set1_epi64(0xFF);
+	int n;
+	
+	for(n = 0; n + 8 <= count; n += 8)
+	{
+		__m512i s[8], t[8], m1 = _mm512_loadu_si512((const void *)(words + n));
+		uint64_t d[8][8], lanes[8];
+		
+		for(int i = 0; i < 8; ++i) s[i] = _mm512_set1_epi64(mid->block[i] ^ mid->chain[i]);
+		s[1] = _mm512_xor_si512(m1, _mm512_set1_epi64(mid->chain[1]));
+		
+		for(int r = 0; r < 10; ++r)
+		{
+			for(int i = 0; i < 8; ++i)
+			{
+				__m512i acc = _mm512_set1_epi64(mid->keys[r][i]);
+				
+				if(r == 9 && !full && i != 3 && i != 5) continue;
+				
+				// Unrolled by hand, as the rotate count has to be an immediate.
+				#define AVX512_LOOKUP(k) \
+					acc = _mm512_xor_si512(acc, _mm512_rol_epi64(_mm512_i64gather_epi64( \
+						_mm512_and_si512(_mm512_srli_epi64(s[(i - k) & 7], (k) << 3), bytemask), \
+						(const void *)MAGIC_TABLE, 8), ((k) << 3) & 63));
+				
+				AVX512_LOOKUP(0) AVX512_LOOKUP(1) AVX512_LOOKUP(2) AVX512_LOOKUP(3)
+				AVX512_LOOKUP(4) AVX512_LOOKUP(5) AVX512_LOOKUP(6) AVX512_LOOKUP(7)
+				
+				#undef AVX512_LOOKUP
+				
+				t[i] = acc;
+			}
+			
+			memcpy(s, t, sizeof(s));
+		}
+		
+		if(!full)
+		{
+			__m512i x = _mm512_xor_si512(_mm512_xor_si512(s[3], s[5]),
+				_mm512_set1_epi64(mid->block[3] ^ mid->chain[3] ^ mid->block[5] ^ mid->chain[5]));
+			
+			_mm512_storeu_si512((void *)lanes, x);
+			for(int l = 0; l < 8; ++l) memcpy(hashes[n + l] + 6, lanes + l, sizeof(lanes[l]));
+			continue;
+		}
+		
+		for(int i = 0; i < 8; ++i)
+		{
+			__m512i x = _mm512_xor_si512(s[i], _mm512_set1_epi64(mid->block[i] ^ mid->chain[i]));
+			
+			if(i == 1) x = _mm512_xor_si512(_mm512_xor_si512(s[1], m1), _mm512_set1_epi64(mid->chain[1]));
+			
+			_mm512_storeu_si512((void *)lanes, x);
+			for(int l = 0; l < 8; ++l) d[l][i] = lanes[l];
+		}
+		
+		for(int l = 0; l < 8; ++l) whirlpoolx_store(hashes[n + l], d[l]);
+	}
+	
+	whirlpoolx_lanes_avx2(hashes + n, words + n, count - n, mid, full);
+}
+
+#endif
+
+/*
+ * The bitsliced hasher - no tables at all. 64 nonces go through side by side,
+ * one per bit: every bit of the state is a uint64_t, with bit l of it belonging
+ * to lane l, and the whole round is ANDs and XORs. Nothing is ever indexed by
+ * the data, so it runs in constant time, and there are no gathers for it to
+ * wait on - whether that beats the tables depends on the CPU, which is what
+ * --whirlpoolx-bench is for.
+ *
+ * The S-box is built the way the Whirlpool spec builds it, out of the 4-bit
+ * mini-boxes E, E^-1 and R. Each of those is written out in algebraic normal
+ * form, and between them they only ever need the same ten products of their
+ * input bits. MixRows is a multiply by the circulant (1, 1, 4, 1, 8, 5, 2, 9),
+ * and in bit planes, xtime is nothing but renaming planes and three XORs.
+ *
+ * The state is [row][column][bit], column c being byte c of the row's word,
+ * the same way whirlpool_row() reads it.
+ */
+
+#define BS_MONOMIALS(x) \
+	const uint64_t m3 = x[0] & x[1], m5 = x[0] & x[2], m6 = x[1] & x[2], m7 = m3 & x[2], m9 = x[0] & x[3]; \
+	const uint64_t m10 = x[1] & x[3], m11 = m3 & x[3], m12 = x[2] & x[3], m13 = m5 & x[3], m14 = m6 & x[3];
+
+static inline void bs_E(uint64_t y[4], const uint64_t x[4])
+{
+	BS_MONOMIALS(x)
+	
+	y[0] = ~(m3 ^ m5 ^ x[3] ^ m10 ^ m13);
+	y[1] = x[0] ^ m3 ^ m6 ^ x[3] ^ m11 ^ m13;
+	y[2] = m3 ^ x[2] ^ x[3] ^ m9 ^ m13 ^ m14;
+	y[3] = x[0] ^ x[1] ^ m3 ^ x[2] ^ m6 ^ m7 ^ x[3] ^ m9 ^ m11 ^ m12 ^ m13 ^ m14;
+}
+
+static inline void bs_Einv(uint64_t y[4], const uint64_t x[4])
+{
+	BS_MONOMIALS(x)
+	
+	y[0] = ~(x[0] ^ m3 ^ m7 ^ m10 ^ m11);
+	y[1] = ~(x[0] ^ x[1] ^ m5 ^ m7 ^ x[3] ^ m10 ^ m11 ^ m12 ^ m13 ^ m14);
+	y[2] = ~(x[0] ^ m3 ^ x[2] ^ m6 ^ m7 ^ x[3] ^ m9 ^ m10 ^ m12 ^ m13);
+	y[3] = ~(x[0] ^ m5 ^ m6 ^ m7 ^ m12);
+}
+
+static inline void bs_R(uint64_t y[4], const uint64_t x[4])
+{
+	BS_MONOMIALS(x)
+	
+	y[0] = ~(x[0] ^ m3 ^ x[2] ^ m5 ^ m6 ^ m7 ^ x[3] ^ m12 ^ m13);
+	y[1] = ~(x[0] ^ m6 ^ m9 ^ m10 ^ m11 ^ m13 ^ m14);
+	y[2] = ~(x[1] ^ m3 ^ m9 ^ m12 ^ m14);
+	y[3] = x[0] ^ x[1] ^ m3 ^ x[2] ^ m6 ^ m9 ^ m11 ^ m12;
+}
+
+#undef BS_MONOMIALS
+
+// High nibble through E, low through E^-1, R on the XOR of the two, and then
+// the same again, crossed over.
+static inline void bs_sbox(uint64_t y[8], const uint64_t x[8])
+{
+	uint64_t a[4], b[4], c[4], r[4];
+	
+	bs_E(a, x + 4);
+	bs_Einv(b, x);
+	for(int i = 0; i < 4; ++i) c[i] = a[i] ^ b[i];
+	bs_R(r, c);
+	
+	for(int i = 0; i < 4; ++i) c[i] = a[i] ^ r[i];
+	bs_E(y + 4, c);
+	for(int i = 0; i < 4; ++i) c[i] = b[i] ^ r[i];
+	bs_Einv(y, c);
+}
+
+// Multiply by x, modulo x^8 + x^4 + x^3 + x^2 + 1
+static inline void bs_xtime(uint64_t x[8])
+{
+	uint64_t t = x[7];
+	
+	x[7] = x[6]; x[6] = x[5]; x[5] = x[4];
+	x[4] = x[3] ^ t; x[3] = x[2] ^ t; x[2] = x[1] ^ t;
+	x[1] = x[0]; x[0] = t;
+}
+
+// Row i of a round, key included, like whirlpool_row(). Column c of the output
+// takes column k's S-box output times the circulant's entry c - k, so sorting
+// the columns by which bits of that entry are set, the whole row is three
+// xtimes of the partial sums, Horner style.
+static void bs_row(uint64_t out[8][8], uint64_t s[8][8][8], int i, uint64_t key)
+{
+	uint64_t t[8][8];
+	
+	for(int k = 0; k < 8; ++k) bs_sbox(t[k], s[(i - k) & 7][k]);
+	
+	for(int c = 0; c < 8; ++c)
+	{
+		#define T(j)	t[(c - (j)) & 7][b]
+		
+		for(int b = 0; b < 8; ++b) out[c][b] = T(4) ^ T(7);
+		bs_xtime(out[c]);
+		for(int b = 0; b < 8; ++b) out[c][b] ^= T(2) ^ T(5);
+		bs_xtime(out[c]);
+		for(int b = 0; b < 8; ++b) out[c][b] ^= T(6);
+		bs_xtime(out[c]);
+		for(int b = 0; b < 8; ++b) out[c][b] ^= T(0) ^ T(1) ^ T(3) ^ T(5) ^ T(7) ^ (0 - ((key >> ((c << 3) + b)) & 1));
+		
+		#undef T
+	}
+}
+
+static void bs_round(uint64_t s[8][8][8], const uint64_t key[8])
+{
+	uint64_t t[8][8][8];
+	
+	for(int i = 0; i < 8; ++i) bs_row(t[i], s, i, key[i]);
+	memcpy(s, t, sizeof(t));
+}
+
+// A word that's the same in every lane, as planes of all ones or all zeros.
+static inline void bs_splat(uint64_t p[64], uint64_t v)
+{
+	for(int j = 0; j < 64; ++j) p[j] = 0 - ((v >> j) & 1);
+}
+
+// 64x64 bit matrix transpose, in place: bit j of a[l] ends up as bit l of
+// a[j]. Takes words in and out of planes both ways.
+static void bs_transpose(uint64_t a[64])
+{
+	uint64_t m = 0x00000000FFFFFFFFULL;
+	
+	for(int j = 32; j; j >>= 1, m ^= m << j)
+	{
+		for(int k = 0; k < 64; k = ((k | j) + 1) & ~j)
+		{
+			uint64_t t = ((a[k] >> j) ^ a[k | j]) & m;
+			
+			a[k] ^= t << j;
+			a[k | j] ^= t;
+		}
+	}
+}
+
+static void whirlpoolx_lanes_bitsliced(uint32_t hashes[][8], const uint64_t *words, int count, const whirlpoolx_mid *mid, bool full)
+{
+	for(int n = 0; n < count; n += 64)
+	{
+		int batch = (count - n < 64) ? count - n : 64;
+		uint64_t s[8][8][8], a[64];
+		
+		// Only the nonce's row differs from lane to lane. Lanes past the end
+		// get hashed too, but never stored.
+		for(int i = 0; i < 8; ++i) bs_splat((uint64_t *)s[i], mid->block[i] ^ mid->chain[i]);
+		
+		for(int l = 0; l < 64; ++l) a[l] = ((l < batch) ? words[n + l] : 0) ^ mid->chain[1];
+		bs_transpose(a);
+		memcpy(s[1], a, sizeof(a));
+		
+		for(int r = 0; r < 9; ++r) bs_round(s, mid->keys[r]);
+		
+		if(full)
+		{
+			uint64_t d[64][8];
+			
+			bs_round(s, mid->keys[9]);
+			
+			for(int i = 0; i < 8; ++i)
+			{
+				memcpy(a, s[i], sizeof(a));
+				bs_transpose(a);
+				for(int l = 0; l < batch; ++l) d[l][i] = a[l] ^ ((i == 1) ? words[n + l] : mid->block[i]) ^ mid->chain[i];
+			}
+			
+			for(int l = 0; l < batch; ++l) whirlpoolx_store(hashes[n + l], d[l]);
+			continue;
+		}
+		
+		// Rows 3 and 5 of the last round, folded together while still in planes,
+		// so only one transpose comes back out.
+		{
+			uint64_t r3[8][8], r5[8][8], tail;
+			
+			bs_row(r3, s, 3, mid->keys[9][3]);
+			bs_row(r5, s, 5, mid->keys[9][5]);
+			
+			for(int j = 0; j < 64; ++j) a[j] = r3[j >> 3][j & 7] ^ r5[j >> 3][j & 7];
+			bs_transpose(a);
+			
+			for(int l = 0; l < batch; ++l)
+			{
+				tail = a[l] ^ mid->block[3] ^ mid->chain[3] ^ mid->block[5] ^ mid->chain[5];
+				memcpy(hashes[n + l] + 6, &tail, sizeof(tail));
+			}
+		}
+	}
+}
+
+// Every CPU hasher, under the name --whirlpoolx-hasher takes, and the one the logs use.
+static const struct
+{
+	const char *opt, *name;
+	whirlpoolx_lanes_fn fn;
+} whirlpoolx_hashers[] =
+{
+	{ "scalar", "scalar", whirlpoolx_lanes_scalar },
+	{ "bitsliced", "bitsliced", whirlpoolx_lanes_bitsliced },
+	#ifdef WHIRLPOOLX_SIMD_X86
+	{ "avx2", "AVX2", whirlpoolx_lanes_avx2 },
+	{ "avx512", "AVX-512", whirlpoolx_lanes_avx512 },
+	#endif
+};
+
+#define WHIRLPOOLX_HASHERS		(int)(sizeof(whirlpoolx_hashers) / sizeof(whirlpoolx_hashers[0]))
+
+static whirlpoolx_lanes_fn whirlpoolx_lanes = NULL;
+static pthread_once_t whirlpoolx_lanes_once = PTHREAD_ONCE_INIT;
+static int whirlpoolx_hasher_forced = -1;
+
+static bool whirlpoolx_hasher_usable(int idx)
+{
+	#ifdef WHIRLPOOLX_SIMD_X86
+	__builtin_cpu_init();
+	if(whirlpoolx_hashers[idx].fn == whirlpoolx_lanes_avx512) return(__builtin_cpu_supports("avx512f"));
+	if(whirlpoolx_hashers[idx].fn == whirlpoolx_lanes_avx2) return(__builtin_cpu_supports("avx2"));
+	#endif
+	
+	return(true);
+}
+
+// For --whirlpoolx-hasher; "auto", or no call at all, leaves the pick to
+// whirlpoolx_select_lanes(). Whether the CPU can run it is checked there.
+bool whirlpoolx_set_hasher(const char *name)
+{
+	if(!strcasecmp(name, "auto"))
+	{
+		whirlpoolx_hasher_forced = -1;
+		return(true);
+	}
+	
+	for(int i = 0; i < WHIRLPOOLX_HASHERS; ++i)
+	{
+		if(!strcasecmp(name, whirlpoolx_hashers[i].opt))
+		{
+			whirlpoolx_hasher_forced = i;
+			return(true);
+		}
+	}
+	
+	return(false);
+}
+
+// How long the automatic pick times each hasher for, in seconds.
+#define WHIRLPOOLX_PICK_SECONDS		0.02
+
+// Runs hasher idx on one thread for about seconds, doing exactly what the CPU
+// miner does - the shortened scan, 64 nonces at a time - and returns its rate
+// in hashes per second.
+static double whirlpoolx_hasher_rate(int idx, double seconds)
+{
+	struct timeval tv_start, tv_now;
+	uint8_t header[80];
+	uint32_t hashes[64][8];
+	uint64_t words[64], done = 0;
+	whirlpoolx_mid mid;
+	double elapsed;
+	
+	for(int i = 0; i < 80; ++i) header[i] = (uint8_t)(i * 0x9D + 0x3B);
+	whirlpoolx_init_mid(&mid, header);
+	
+	cgtime(&tv_start);
+	
+	do
+	{
+		for(int rep = 0; rep < 64; ++rep, done += 64)
+		{
+			for(int i = 0; i < 64; ++i) words[i] = whirlpoolx_lane_word(&mid, (uint32_t)done + i);
+			whirlpoolx_hashers[idx].fn(hashes, words, 64, &mid, false);
+		}
+		
+		cgtime(&tv_now);
+	} while((elapsed = tdiff(&tv_now, &tv_start)) < seconds);
+	
+	return((double)done / elapsed);
+}
+
+// Picks the fastest table implementation the CPU has, by timing each one
+// briefly - a wider one isn't always quicker, AVX2 has no gather fast enough
+// to beat the scalar lookups on most chips - or the one asked for with
+// --whirlpoolx-hasher. Before trusting it, checks it against the plain
+// reference hash on a handful of nonces. A broken path just costs speed this
+// way, instead of making every share a HW error.
+static void whirlpoolx_select_lanes(void)
+{
+	whirlpoolx_lanes_fn fn = whirlpoolx_lanes_scalar;
+	const char *name = "scalar";
+	
+	if(whirlpoolx_hasher_forced >= 0 && !whirlpoolx_hasher_usable(whirlpoolx_hasher_forced))
+	{
+		applog(LOG_WARNING, "WhirlpoolX %s hasher needs instructions this CPU doesn't have, picking one instead.", whirlpoolx_hashers[whirlpoolx_hasher_forced].name);
+		whirlpoolx_hasher_forced = -1;
+	}
+	
+	if(whirlpoolx_hasher_forced >= 0)
+	{
+		fn = whirlpoolx_hashers[whirlpoolx_hasher_forced].fn;
+		name = whirlpoolx_hashers[whirlpoolx_hasher_forced].name;
+	}
+	else
+	{
+		double best = 0.0;
+		
+		for(int i = 0; i < WHIRLPOOLX_HASHERS; ++i)
+		{
+			double rate;
+			
+			if(whirlpoolx_hashers[i].fn == whirlpoolx_lanes_bitsliced || !whirlpoolx_hasher_usable(i)) continue;
+			
+			rate = whirlpoolx_hasher_rate(i, WHIRLPOOLX_PICK_SECONDS);
+			applog(LOG_DEBUG, "WhirlpoolX %s hasher: %.1f kH/s", whirlpoolx_hashers[i].name, rate / 1e3);
+			
+			if(rate > best)
+			{
+				best = rate;
+				fn = whirlpoolx_hashers[i].fn;
+				name = whirlpoolx_hashers[i].name;
+			}
+		}
+	}
+	
+	if(fn != whirlpoolx_lanes_scalar)
+	{
+		uint8_t header[80];
+		uint32_t nonces[13], hashes[13][8], tails[13][8], data[20], ref[8];
+		uint64_t words[13];
+		whirlpoolx_mid mid;
+		
+		for(int i = 0; i < 80; ++i) header[i] = (uint8_t)(i * 0x9D + 0x3B);
+		whirlpoolx_init_mid(&mid, header);
+		be32enc_vect(data, (const uint32_t *)header, 19);
+		
+		for(int i = 0; i < 13; ++i)
+		{
+			nonces[i] = 0x9E3779B9U * (i + 1);
+			words[i] = whirlpoolx_lane_word(&mid, nonces[i]);
+		}
+		
+		fn(hashes, words, 13, &mid, true);
+		fn(tails, words, 13, &mid, false);
+		
+		for(int i = 0; i < 13; ++i)
+		{
+			data[19] = htobe32(htole32(nonces[i]));
+			whirlpoolx_hash(ref, data);
+			
+			if(memcmp(ref, hashes[i], sizeof(ref)) || memcmp(ref + 6, tails[i] + 6, 8))
+			{
+				applog(LOG_WARNING, "WhirlpoolX %s hasher failed its self-test, verifying shares with the scalar one.", name);
+				fn = whirlpoolx_lanes_scalar;
+				name = "scalar";
+				break;
+			}
+		}
+	}
+	
+	applog(LOG_DEBUG, "WhirlpoolX CPU verification uses the %s hasher.", name);
+	whirlpoolx_lanes = fn;
+}
+
+/*
+ * Hashes count nonces of the same header in one go: header is the 80 byte block
+ * header as found in work->data (only the first 76 bytes are used), and nonces
+ * are what submit_nonce() takes. With full set, hashes[i] gets exactly what
+ * whirlpoolx_regenhash() would leave in work->hash for nonces[i]; without it,
+ * only the last two words are, which is all a diff 1 check needs.
+ */
+void whirlpoolx_hash_many(uint32_t hashes[][8], const uint8_t *header, const uint32_t *nonces, int count, bool full)
+{
+	uint64_t words[64];
+	whirlpoolx_mid mid;
+	
+	pthread_once(&whirlpoolx_lanes_once, whirlpoolx_select_lanes);
+	whirlpoolx_init_mid(&mid, header);
+	
+	for(int done = 0; done < count; done += 64)
+	{
+		int batch = (count - done < 64) ? count - done : 64;
+		
+		for(int i = 0; i < batch; ++i) words[i] = whirlpoolx_lane_word(&mid, nonces[done + i]);
+		whirlpoolx_lanes(hashes + done, words, batch, &mid, full);
+	}
+}
+
+void whirlpoolx_regenhash_many(struct work *work, const uint32_t *nonces, uint32_t hashes[][8], int count, bool full)
+{
+	whirlpoolx_hash_many(hashes, work->data, nonces, count, full);
+}
+
+/*
+ * The CPU miner's inner loop: hashes count nonces starting at first, under a
+ * midstate from whirlpoolx_init_mid(), and puts every nonce whose hash ends in a
+ * 64-bit value no greater than target - the same test the kernel makes - into
+ * found[]. Returns how many there were. Batches are capped at 64 nonces, so the
+ * caller gets to look at its restart flag often.
+ */
+int whirlpoolx_scan(const whirlpoolx_mid *mid, uint64_t target, uint32_t first, int count, uint32_t *found)
+{
+	uint32_t hashes[64][8];
+	uint64_t words[64];
+	int nfound = 0;
+	
+	pthread_once(&whirlpoolx_lanes_once, whirlpoolx_select_lanes);
+	
+	count = (count < 64) ? count : 64;
+	for(int i = 0; i < count; ++i) words[i] = whirlpoolx_lane_word(mid, first + i);
+	
+	whirlpoolx_lanes(hashes, words, count, mid, false);
+	
+	for(int i = 0; i < count; ++i)
+	{
+		uint64_t v;
+		
+		memcpy(&v, hashes[i] + 6, sizeof(v));
+		if(unlikely(v <= target)) found[nfound++] = first + i;
+	}
+	
+	return(nfound);
+}
+
 /* Used externally as confirmation of correct OCL code */
 int whirlcoin_test(unsigned char *pdata, const unsigned char *ptarget, uint32_t nonce)
 {
@@ -207,53 +924,91 @@ int whirlcoin_test(unsigned char *pdata, const unsigned char *ptarget, uint32_t
 	return 1;
 }
 
-void whirlpoolx_regenhash(struct work *work)
+/*
+ * Checks the shortened last round against the reference hash: count random
+ * headers, 64 random nonces each, through every hasher this CPU runs - scalar,
+ * bitsliced, and whatever vector ones it has - comparing the final word each
+ * produces with what whirlpoolx_hash() gives. Returns the number of mismatches,
+ * so 0 is a pass.
+ */
+int whirlpoolx_check_pruned(int count)
 {
-    uint32_t data[20];
-    uint32_t *nonce = (uint32_t *)(work->data + 76);
-    uint32_t *ohash = (uint32_t *)(work->hash);
-
-    be32enc_vect(data, (const uint32_t *)work->data, 19);
-    data[19] = htobe32(*nonce);
-    whirlpoolx_hash(ohash, data);
+	uint64_t rng = 0x243F6A8885A308D3ULL;
+	int bad = 0;
+	
+	for(int h = 0; h < count; ++h)
+	{
+		uint8_t header[80];
+		uint32_t nonces[64], hashes[64][8], data[20], ref[8];
+		uint64_t words[64];
+		whirlpoolx_mid mid;
+		
+		// xorshift64, plenty for test vectors
+		for(int i = 0; i < 80; ++i)
+		{
+			rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+			header[i] = (uint8_t)rng;
+		}
+		
+		whirlpoolx_init_mid(&mid, header);
+		be32enc_vect(data, (const uint32_t *)header, 19);
+		
+		for(int i = 0; i < 64; ++i)
+		{
+			rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+			nonces[i] = (uint32_t)rng;
+			words[i] = whirlpoolx_lane_word(&mid, nonces[i]);
+		}
+		
+		for(int f = 0; f < WHIRLPOOLX_HASHERS; ++f)
+		{
+			if(!whirlpoolx_hasher_usable(f)) continue;
+			
+			whirlpoolx_hashers[f].fn(hashes, words, 64, &mid, false);
+			
+			for(int i = 0; i < 64; ++i)
+			{
+				data[19] = htobe32(htole32(nonces[i]));
+				whirlpoolx_hash(ref, data);
+				
+				if(memcmp(ref + 6, hashes[i] + 6, 8))
+				{
+					applog(LOG_ERR, "WhirlpoolX %s pruned hash mismatch: header %d nonce %08x got %08x%08x want %08x%08x",
+						whirlpoolx_hashers[f].name, h, nonces[i], hashes[i][7], hashes[i][6], ref[7], ref[6]);
+					++bad;
+				}
+			}
+		}
+	}
+	
+	return(bad);
 }
 
-bool scanhash_whirlcoin(struct thr_info *thr, const unsigned char __maybe_unused *pmidstate,
-		     unsigned char *pdata, unsigned char __maybe_unused *phash1,
-		     unsigned char __maybe_unused *phash, const unsigned char *ptarget,
-		     uint32_t max_nonce, uint32_t *last_nonce, uint32_t n)
+/*
+ * Times every hasher this CPU runs, on one thread, for about seconds each,
+ * and logs the rate of each, and which came out on top. The bitsliced one
+ * never gets picked on its own, so this is how to find out if it should be.
+ */
+void whirlpoolx_bench(double seconds)
 {
-	uint32_t *nonce = (uint32_t *)(pdata + 76);
-	uint32_t data[20];
-	uint32_t tmp_hash7;
-	uint32_t Htarg = le32toh(((const uint32_t *)ptarget)[7]);
-	bool ret = false;
-
-	be32enc_vect(data, (const uint32_t *)pdata, 19);
-
-	while(1) {
-		uint32_t ostate[8];
-
-		*nonce = ++n;
-		data[19] = (n);
-		whirlpoolx_hash(ostate, data);
-		tmp_hash7 = (ostate[7]);
-
-		applog(LOG_INFO, "data7 %08lx",
-					(long unsigned int)data[7]);
-
-		if (unlikely(tmp_hash7 <= Htarg)) {
-			((uint32_t *)pdata)[19] = htobe32(n);
-			*last_nonce = n;
-			ret = true;
-			break;
-		}
-
-		if (unlikely((n >= max_nonce) || thr->work_restart)) {
-			*last_nonce = n;
-			break;
+	double best = 0.0;
+	int fastest = 0;
+	
+	for(int f = 0; f < WHIRLPOOLX_HASHERS; ++f)
+	{
+		double rate;
+		
+		if(!whirlpoolx_hasher_usable(f)) continue;
+		
+		rate = whirlpoolx_hasher_rate(f, seconds);
+		applog(LOG_NOTICE, "WhirlpoolX %s hasher: %.1f kH/s", whirlpoolx_hashers[f].name, rate / 1e3);
+		
+		if(rate > best)
+		{
+			best = rate;
+			fastest = f;
 		}
 	}
-
-	return ret;
+	
+	applog(LOG_NOTICE, "WhirlpoolX fastest CPU hasher: %s (--whirlpoolx-hasher %s)", whirlpoolx_hashers[fastest].name, whirlpoolx_hashers[fastest].opt);
 }
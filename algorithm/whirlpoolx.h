@@ -51,8 +51,30 @@ static uint64_t WHIRLPOOL_ROUND_CONSTANTS[32] = {
 	UINT64_C(0x6C9D0BDC53C1BB2A), UINT64_C(0xE11489AC46F67431), UINT64_C(0xEDD0B67009693A16), UINT64_C(0x86F85C28A49842CC),
 };
 
+/*
+ * Everything about a header that doesn't depend on the nonce. The first 64 bytes
+ * of the 80 byte message don't contain it, so the chaining value after the first
+ * compression - and with it the key schedule of the second - is shared by all
+ * of them. Only the second word of the second block differs from nonce to nonce.
+ */
+typedef struct _whirlpoolx_mid
+{
+	uint64_t chain[8];
+	uint64_t keys[10][8];
+	uint64_t block[8];
+} whirlpoolx_mid;
+
 extern int whirlpoolx_test(unsigned char *pdata, const unsigned char *ptarget, uint32_t nonce);
 extern void whirlpoolx_regenhash(struct work *work);
+extern void whirlpoolx_hash_many(uint32_t hashes[][8], const uint8_t *header, const uint32_t *nonces, int count, bool full);
+extern void whirlpoolx_init_mid(whirlpoolx_mid *mid, const uint8_t *header);
+extern int whirlpoolx_scan(const whirlpoolx_mid *mid, uint64_t target, uint32_t first, int count, uint32_t *found);
+extern int whirlpoolx_check_pruned(int count);
+extern void whirlpoolx_bench(double seconds);
+extern bool whirlpoolx_set_hasher(const char *name);
+extern void whirlpoolx_round1_partial(uint64_t round1[8], uint64_t key1[8], const uint64_t midstate[8], uint64_t input0, uint64_t input1);
+extern void whirlpoolx_regenhash_many(struct work *work, const uint32_t *nonces, uint32_t hashes[][8], int count, bool full);
 extern void whirlpool_round(uint64_t block[8], const uint64_t key[8]);
+extern void whirlpool_key_schedule(uint64_t keys[10][8], const uint64_t chain[8]);
 
 #endif /* W_H */
@@ -34,6 +34,9 @@
 #include "algorithm.h"
 
 #include "config_parser.h"
+#include "driver-opencl.h"
+#include "findnonce.h"
+#include "ocl/event_profile.h"
 
 #ifdef WIN32
 static char WSAbuf[1024];
@@ -218,6 +221,10 @@ struct CODES codes[] = {
 
  { SEVERITY_SUCC,  MSG_CHPOOLPR, PARAM_BOTH, "Changed pool %d to profile '%s'" },
 
+ { SEVERITY_SUCC,  MSG_VERIFY, PARAM_NONE, "Nonce verification" },
+ { SEVERITY_SUCC,  MSG_GPUPROFILE, PARAM_NONE, "GPU profiling" },
+ { SEVERITY_ERR,   MSG_NOGPUPROF, PARAM_NONE, "GPU profiling not enabled, start with --gpu-profile" },
+
  { SEVERITY_SUCC,  MSG_BYE,   PARAM_STR,  "%s" },
  { SEVERITY_FAIL, 0, (enum code_parameters)0, NULL }
 };
@@ -230,7 +237,7 @@ static const char *BLANK = "";
 static const char *COMMA = ",";
 static const char SEPARATOR = '|';
 static const char GPUSEP = ',';
-static const char *APIVERSION = "4.0";
+static const char *APIVERSION = "4.3";
 static const char *DEAD = "Dead";
 static const char *SICK = "Sick";
 static const char *NOSTART = "NoStart";
@@ -1468,6 +1475,7 @@ static void gpustatus(struct io_data *io_data, int gpu, bool isjson, bool precom
     root = api_add_int(root, "Accepted", &(cgpu->accepted), false);
     root = api_add_int(root, "Rejected", &(cgpu->rejected), false);
     root = api_add_int(root, "Hardware Errors", &(cgpu->hw_errors), false);
+    root = api_add_uint64(root, "Ring Overflows", &(cgpu->ring_overflows), false);
     root = api_add_utility(root, "Utility", &(cgpu->utility), false);
     root = api_add_string(root, "Intensity", intensity, false);
     root = api_add_int(root, "XIntensity", &(cgpu->xintensity), false);
@@ -1698,6 +1706,7 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
   root = api_add_int(root, "Accepted", &(total_accepted), true);
   root = api_add_int(root, "Rejected", &(total_rejected), true);
   root = api_add_int(root, "Hardware Errors", &(hw_errors), true);
+  root = api_add_uint64(root, "Ring Overflows", &(ring_overflows), true);
   root = api_add_utility(root, "Utility", &(utility), false);
   root = api_add_int(root, "Discarded", &(total_discarded), true);
   root = api_add_int(root, "Stale", &(total_stale), true);
@@ -2321,7 +2330,7 @@ static void gpuintensity(struct io_data *io_data, __maybe_unused SOCKETTYPE c, c
     return;
 
   if (!strncasecmp(value, DYNAMIC, 1)) {
-    gpus[id].dynamic = true;
+    enable_dynamic_intensity(&gpus[id]);
     strcpy(intensitystr, DYNAMIC);
   }
   else {
@@ -2798,6 +2807,116 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
     io_close(io_data);
 }
 
+static void verifystats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+  struct api_data *root = NULL;
+  struct verify_stats stats;
+  char buf[TMPBUFSIZ];
+  double avg_latency;
+  bool io_open;
+
+  get_verify_stats(&stats);
+  avg_latency = stats.verified ? stats.total_latency / stats.verified : 0;
+
+  message(io_data, MSG_VERIFY, 0, NULL, isjson);
+  io_open = io_add(io_data, isjson ? COMSTR JSON_VERIFY : _VERIFY COMSTR);
+
+  root = api_add_int(root, "Threads", &stats.threads, true);
+  root = api_add_int(root, "Queue Size", &stats.size, true);
+  root = api_add_int(root, "Queue Depth", &stats.depth, true);
+  root = api_add_int(root, "Max Queue Depth", &stats.max_depth, true);
+  root = api_add_uint64(root, "Queue Full Waits", &stats.full_waits, true);
+  root = api_add_uint64(root, "Verified", &stats.verified, true);
+  root = api_add_double(root, "Avg Latency ms", &avg_latency, true);
+  root = api_add_double(root, "Max Latency ms", &stats.max_latency, true);
+
+  root = print_data(root, buf, isjson, false);
+  io_add(io_data, buf);
+  if (isjson && io_open)
+    io_close(io_data);
+}
+
+static void gpuprofilestatus(struct io_data *io_data, int gpu, bool isjson, bool precom)
+{
+  struct api_data *root = NULL;
+  event_histogram hists[EVENT_HISTS];
+  struct cgpu_info *cgpu = &gpus[gpu];
+  char buf[TMPBUFSIZ], name[64], counts[EVENT_HIST_BUCKETS * 21];
+  bool profiling = cgpu->event_profile != NULL;
+  int i, j;
+
+  if (profiling)
+    event_profile_snapshot(cgpu->event_profile, hists);
+  else
+    memset(hists, 0, sizeof(hists));
+
+  root = api_add_int(root, "GPU", &gpu, false);
+  root = api_add_bool(root, "Profiling", &profiling, false);
+
+  for (i = 0; i < EVENT_HISTS; i++) {
+    event_histogram *hist = &hists[i];
+    double avg = hist->count ? hist->total_us / hist->count : 0;
+
+    snprintf(name, sizeof(name), "%s Count", event_hist_name((enum event_hist)i));
+    root = api_add_uint64(root, name, &hist->count, true);
+    snprintf(name, sizeof(name), "%s Avg us", event_hist_name((enum event_hist)i));
+    root = api_add_double(root, name, &avg, true);
+    snprintf(name, sizeof(name), "%s Min us", event_hist_name((enum event_hist)i));
+    root = api_add_double(root, name, &hist->min_us, true);
+    snprintf(name, sizeof(name), "%s Max us", event_hist_name((enum event_hist)i));
+    root = api_add_double(root, name, &hist->max_us, true);
+
+    counts[0] = '\0';
+    for (j = 0; j < EVENT_HIST_BUCKETS; j++)
+      sprintf(counts + strlen(counts), "%s%"PRIu64, j ? ":" : "", hist->buckets[j]);
+    snprintf(name, sizeof(name), "%s Histogram", event_hist_name((enum event_hist)i));
+    root = api_add_string(root, name, counts, true);
+  }
+
+  root = print_data(root, buf, isjson, precom);
+  io_add(io_data, buf);
+}
+
+static void gpuprofile(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+  bool io_open = false;
+  int id, i;
+
+  if (nDevs == 0) {
+    message(io_data, MSG_GPUNON, 0, NULL, isjson);
+    return;
+  }
+
+  if (!opt_gpu_profile) {
+    message(io_data, MSG_NOGPUPROF, 0, NULL, isjson);
+    return;
+  }
+
+  id = -1;
+  if (param != NULL && *param != '\0') {
+    id = atoi(param);
+    if (id < 0 || id >= nDevs) {
+      message(io_data, MSG_INVGPU, id, NULL, isjson);
+      return;
+    }
+  }
+
+  message(io_data, MSG_GPUPROFILE, 0, NULL, isjson);
+
+  if (isjson)
+    io_open = io_add(io_data, COMSTR JSON_GPUPROFILE);
+
+  if (id >= 0)
+    gpuprofilestatus(io_data, id, isjson, false);
+  else {
+    for (i = 0; i < nDevs; i++)
+      gpuprofilestatus(io_data, i, isjson, isjson && i > 0);
+  }
+
+  if (isjson && io_open)
+    io_close(io_data);
+}
+
 static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
   struct api_data *root = NULL;
@@ -3010,6 +3129,8 @@ struct CMDS {
   { "check",    checkcommand, false,  false },
   { "failover-only",  failoveronly, true, false },
   { "coin",   minecoin, false,  true },
+  { "verify",   verifystats,  false,  true },
+  { "gpuprofile",   gpuprofile,  false,  true },
   { "debug",    debugstate, true, false },
   { "setconfig",    setconfig,  true, false },
   { "zero",   dozero,   true, false },
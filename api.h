@@ -38,6 +38,8 @@
 #define _MINECOIN "COIN"
 #define _DEBUGSET "DEBUG"
 #define _SETCONFIG  "SETCONFIG"
+#define _VERIFY   "VERIFY"
+#define _GPUPROFILE "GPUPROFILE"
 
 #define JSON0   "{"
 #define JSON1   "\""
@@ -67,6 +69,8 @@
 #define JSON_MINECOIN JSON1 _MINECOIN JSON2
 #define JSON_DEBUGSET JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG  JSON1 _SETCONFIG JSON2
+#define JSON_VERIFY JSON1 _VERIFY JSON2
+#define JSON_GPUPROFILE JSON1 _GPUPROFILE JSON2
 
 #define JSON_END  JSON4 JSON5
 #define JSON_END_TRUNCATED  JSON4_TRUNCATED JSON5
@@ -186,6 +190,11 @@
 #define MSG_INVRAWINT 142
 #define MSG_GPURAWINT 143
 
+#define MSG_VERIFY 144
+
+#define MSG_GPUPROFILE 145
+#define MSG_NOGPUPROF 146
+
 enum code_severity {
   SEVERITY_ERR,
   SEVERITY_WARN,
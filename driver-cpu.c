@@ -0,0 +1,226 @@
+/*
+ * Copyright 2014 sgminer developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+#ifdef __linux
+#include <sched.h>
+#endif
+
+#include "compat.h"
+#include "miner.h"
+#include "config_parser.h"
+#include "driver-cpu.h"
+#include "algorithm/whirlpoolx.h"
+#include "util.h"
+
+/* 0 means no CPU device is created */
+int opt_cpu_threads;
+
+/* Nonces hashed per scanhash call before hash_sole_work tunes it to the
+ * actual hashrate */
+#define CPU_INITIAL_NONCES 0x10000
+
+static struct cgpu_info cpus[1];
+
+struct cpu_thread_data {
+  whirlpoolx_mid mid;
+  uint64_t target;
+};
+
+static int num_processors(void)
+{
+#ifdef WIN32
+  SYSTEM_INFO sysinfo;
+
+  GetSystemInfo(&sysinfo);
+  return sysinfo.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n > 0 ? (int)n : 1;
+#endif
+}
+
+char *set_cpu_threads(const char *arg)
+{
+  int val;
+
+  if (!strcasecmp(arg, "auto")) {
+    opt_cpu_threads = num_processors();
+    return NULL;
+  }
+
+  val = atoi(arg);
+  if (val < 0 || val > MAX_CPU_THREADS)
+    return "Invalid value passed to set_cpu_threads";
+
+  opt_cpu_threads = val;
+  return NULL;
+}
+
+/* Pin a mining thread to one core, so threads don't get shuffled around
+ * and fight over the same caches */
+static void affine_to_cpu(int id, int cpu)
+{
+#if defined(__linux)
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+    applog(LOG_INFO, "CPU thread %d: failed to set affinity to core %d", id, cpu);
+#elif defined(WIN32)
+  if (!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu))
+    applog(LOG_INFO, "CPU thread %d: failed to set affinity to core %d", id, cpu);
+#else
+  applog(LOG_DEBUG, "CPU thread %d: affinity not supported, not binding to core %d", id, cpu);
+#endif
+}
+
+static void cpu_detect(void)
+{
+  struct cgpu_info *cgpu = &cpus[0];
+
+  if (!opt_cpu_threads)
+    return;
+
+  cgpu->deven = DEV_ENABLED;
+  cgpu->drv = &cpu_drv;
+  cgpu->thr = NULL;
+  cgpu->threads = opt_cpu_threads;
+  cgpu->algorithm = default_profile.algorithm;
+  add_cgpu(cgpu);
+}
+
+static bool cpu_thread_init(struct thr_info *thr)
+{
+  struct cpu_thread_data *thrdata;
+
+  thrdata = (struct cpu_thread_data *)calloc(1, sizeof(*thrdata));
+  if (!thrdata) {
+    applog(LOG_ERR, "Failed to calloc in cpu_thread_init");
+    return false;
+  }
+  thr->cgpu_data = thrdata;
+
+  /* The GPU host threads and the verify pool tend to run on the first
+   * cores, so CPU threads are pinned from the last core down */
+  affine_to_cpu(thr->id, num_processors() - 1 - thr->device_thread % num_processors());
+
+#ifdef __linux
+  /* Only mine on otherwise idle cycles, the GPU threads come first. On
+   * linux this only affects the calling thread. */
+  setpriority(PRIO_PROCESS, 0, 19);
+#endif
+
+  return true;
+}
+
+static uint64_t cpu_can_limit_work(struct thr_info __maybe_unused *thr)
+{
+  return CPU_INITIAL_NONCES;
+}
+
+/* The midstate and key schedule only depend on the work, so they're made
+ * once here and every scanhash call only hashes the second block */
+static bool cpu_prepare_work(struct thr_info *thr, struct work *work)
+{
+  struct cpu_thread_data *thrdata = (struct cpu_thread_data *)thr->cgpu_data;
+
+  if (work->pool->algorithm.type != ALGO_WHIRLPOOLX) {
+    applog(LOG_ERR, "CPU %d: algorithm %s is not supported", thr->cgpu->device_id,
+           work->pool->algorithm.name);
+    return false;
+  }
+
+  thr->pool_no = work->pool->pool_no;
+  whirlpoolx_init_mid(&thrdata->mid, work->data);
+  memcpy(&thrdata->target, work->device_target + 24, sizeof(thrdata->target));
+  thrdata->target = le64toh(thrdata->target);
+
+  return true;
+}
+
+static int64_t cpu_scanhash(struct thr_info *thr, struct work *work, int64_t max_nonce)
+{
+  struct cpu_thread_data *thrdata = (struct cpu_thread_data *)thr->cgpu_data;
+  uint64_t first = work->blk.nonce, n = first, end;
+  uint32_t found[64];
+  int i, nfound;
+
+  /* hash_sole_work adds the nonce count to blk.nonce in 32 bits, so a
+   * limit at or below the start means it wrapped. Either way, or at the
+   * top of the range, scan up to and including nonce 0xffffffff. */
+  end = (uint64_t)max_nonce;
+  if (end >= 0xffffffffULL || end <= first)
+    end = 0x100000000ULL;
+
+  while (n < end && !thr->work_restart) {
+    int count = (int)MIN(end - n, 64);
+
+    nfound = whirlpoolx_scan(&thrdata->mid, thrdata->target, (uint32_t)n, count, found);
+    for (i = 0; i < nfound; i++) {
+      applog(LOG_DEBUG, "[THR%d] CPU NONCE %08x found", thr->id, found[i]);
+      submit_nonce(thr, work, found[i]);
+    }
+
+    n += count;
+  }
+
+  /* Left at 0xffffffff once the whole range is done, so it's abandoned */
+  work->blk.nonce = (uint32_t)MIN(n, 0xffffffffULL);
+  return (int64_t)(n - first);
+}
+
+static void cpu_thread_shutdown(struct thr_info *thr)
+{
+  free(thr->cgpu_data);
+  thr->cgpu_data = NULL;
+}
+
+struct device_drv cpu_drv = {
+  /*.drv_id = */      DRIVER_cpu,
+  /*.dname = */     "cpu",
+  /*.name = */      "CPU",
+  /*.drv_detect = */    cpu_detect,
+  /*.reinit_device = */   NULL,
+  /*.get_statline_before = */ NULL,
+  /*.get_statline = */    NULL,
+  /*.api_data = */    NULL,
+  /*.get_stats = */   NULL,
+  /*.identify_device = */   NULL,
+  /*.set_device = */    NULL,
+
+  /*.thread_prepare = */    NULL,
+  /*.can_limit_work = */    cpu_can_limit_work,
+  /*.thread_init = */   cpu_thread_init,
+  /*.prepare_work = */    cpu_prepare_work,
+  /*.hash_work = */   NULL,
+  /*.scanhash = */    cpu_scanhash,
+  /*.scanwork = */    NULL,
+  /*.queue_full = */    NULL,
+  /*.flush_work = */    NULL,
+  /*.update_work = */   NULL,
+  /*.hw_error = */    NULL,
+  /*.thread_shutdown = */   cpu_thread_shutdown,
+  /*.thread_enable =*/    NULL,
+          false,
+          0,
+          0
+};
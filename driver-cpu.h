@@ -0,0 +1,15 @@
+#ifndef DEVICE_CPU_H
+#define DEVICE_CPU_H
+
+#include "miner.h"
+
+/* Most CPU mining threads --cpu-threads accepts */
+#define MAX_CPU_THREADS 256
+
+extern char *set_cpu_threads(const char *arg);
+
+extern int opt_cpu_threads;
+
+extern struct device_drv cpu_drv;
+
+#endif /* DEVICE_CPU_H */
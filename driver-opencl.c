@@ -17,6 +17,7 @@
 
 #include <string.h>
 #include <stdbool.h>
+#include <math.h>
 #include <stdint.h>
 #include <signal.h>
 #include <sys/types.h>
@@ -32,6 +33,7 @@
 #include "driver-opencl.h"
 #include "findnonce.h"
 #include "ocl.h"
+#include "ocl/event_profile.h"
 #include "adl.h"
 #include "util.h"
 
@@ -126,6 +128,192 @@ char *set_worksize(const char *arg)
   return NULL;
 }
 
+char *set_hostkeys(const char *arg)
+{
+  int i, val = 0, device = 0;
+  char *tmpstr = strdup(arg);
+  char *nextptr;
+
+  if ((nextptr = strtok(tmpstr, ",")) == NULL) {
+    free(tmpstr);
+    return "Invalid parameters for set host keys";
+  }
+
+  do {
+    val = atoi(nextptr);
+
+    if (val != 0 && val != 1) {
+      free(tmpstr);
+      return "Invalid value passed to set_hostkeys";
+    }
+
+    gpus[device++].hostkeys = val;
+  } while ((nextptr = strtok(NULL, ",")) != NULL);
+
+  if (device == 1) {
+    for (i = device; i < MAX_GPUDEVICES; i++)
+      gpus[i].hostkeys = gpus[0].hostkeys;
+  }
+
+  free(tmpstr);
+  return NULL;
+}
+
+char *set_round1_precompute(const char *arg)
+{
+  int i, val = 0, device = 0;
+  char *tmpstr = strdup(arg);
+  char *nextptr;
+
+  if ((nextptr = strtok(tmpstr, ",")) == NULL) {
+    free(tmpstr);
+    return "Invalid parameters for set round1 precompute";
+  }
+
+  do {
+    val = atoi(nextptr);
+
+    if (val != 0 && val != 1) {
+      free(tmpstr);
+      return "Invalid value passed to set_round1_precompute";
+    }
+
+    gpus[device++].round1pre = val;
+  } while ((nextptr = strtok(NULL, ",")) != NULL);
+
+  if (device == 1) {
+    for (i = device; i < MAX_GPUDEVICES; i++)
+      gpus[i].round1pre = gpus[0].round1pre;
+  }
+
+  free(tmpstr);
+  return NULL;
+}
+
+char *set_bitsliced(const char *arg)
+{
+  int i, val = 0, device = 0;
+  char *tmpstr = strdup(arg);
+  char *nextptr;
+
+  if ((nextptr = strtok(tmpstr, ",")) == NULL) {
+    free(tmpstr);
+    return "Invalid parameters for set bitsliced";
+  }
+
+  do {
+    val = atoi(nextptr);
+
+    if (val != 0 && val != 1) {
+      free(tmpstr);
+      return "Invalid value passed to set_bitsliced";
+    }
+
+    gpus[device++].bitsliced = val;
+  } while ((nextptr = strtok(NULL, ",")) != NULL);
+
+  if (device == 1) {
+    for (i = device; i < MAX_GPUDEVICES; i++)
+      gpus[i].bitsliced = gpus[0].bitsliced;
+  }
+
+  free(tmpstr);
+  return NULL;
+}
+
+char *set_kernel_nonces(const char *arg)
+{
+  int i, val = 0, device = 0;
+  char *tmpstr = strdup(arg);
+  char *nextptr;
+
+  if ((nextptr = strtok(tmpstr, ",")) == NULL) {
+    free(tmpstr);
+    return "Invalid parameters for set kernel nonces";
+  }
+
+  do {
+    val = atoi(nextptr);
+
+    if (val < 1 || val > MAX_KERNEL_NONCES) {
+      free(tmpstr);
+      return "Invalid value passed to set_kernel_nonces";
+    }
+
+    gpus[device++].kernel_nonces = val;
+  } while ((nextptr = strtok(NULL, ",")) != NULL);
+
+  if (device == 1) {
+    for (i = device; i < MAX_GPUDEVICES; i++)
+      gpus[i].kernel_nonces = gpus[0].kernel_nonces;
+  }
+
+  free(tmpstr);
+  return NULL;
+}
+
+char *set_gpu_pipeline(const char *arg)
+{
+  int i, val = 0, device = 0;
+  char *tmpstr = strdup(arg);
+  char *nextptr;
+
+  if ((nextptr = strtok(tmpstr, ",")) == NULL) {
+    free(tmpstr);
+    return "Invalid parameters for set gpu pipeline";
+  }
+
+  do {
+    val = atoi(nextptr);
+
+    if (val < 1 || val > MAX_GPU_PIPELINE) {
+      free(tmpstr);
+      return "Invalid value passed to set_gpu_pipeline";
+    }
+
+    gpus[device++].pipeline = val;
+  } while ((nextptr = strtok(NULL, ",")) != NULL);
+
+  if (device == 1) {
+    for (i = device; i < MAX_GPUDEVICES; i++)
+      gpus[i].pipeline = gpus[0].pipeline;
+  }
+
+  free(tmpstr);
+  return NULL;
+}
+
+char *set_gpu_prepared(const char *arg)
+{
+  int i, val = 0, device = 0;
+  char *tmpstr = strdup(arg);
+  char *nextptr;
+
+  if ((nextptr = strtok(tmpstr, ",")) == NULL) {
+    free(tmpstr);
+    return "Invalid parameters for set gpu prepared";
+  }
+
+  do {
+    val = atoi(nextptr);
+
+    if (val < 0 || val > MAX_PREPARED_WORKS) {
+      free(tmpstr);
+      return "Invalid value passed to set_gpu_prepared";
+    }
+
+    gpus[device++].prepared_works = val;
+  } while ((nextptr = strtok(NULL, ",")) != NULL);
+
+  if (device == 1) {
+    for (i = device; i < MAX_GPUDEVICES; i++)
+      gpus[i].prepared_works = gpus[0].prepared_works;
+  }
+
+  free(tmpstr);
+  return NULL;
+}
+
 char *set_shaders(char *arg)
 {
   int i, val = 0, device = 0;
@@ -553,7 +741,7 @@ char *set_intensity(const char *_arg)
   if (nextptr == NULL)
     return "Invalid parameters for set intensity";
   if (!strncasecmp(nextptr, "d", 1))
-    gpus[device].dynamic = true;
+    enable_dynamic_intensity(&gpus[device]);
   else {
     gpus[device].dynamic = false;
     val = atoi(nextptr);
@@ -570,7 +758,7 @@ char *set_intensity(const char *_arg)
 
   while ((nextptr = strtok(NULL, ",")) != NULL) {
     if (!strncasecmp(nextptr, "d", 1))
-      gpus[device].dynamic = true;
+      enable_dynamic_intensity(&gpus[device]);
     else {
       gpus[device].dynamic = false;
       val = atoi(nextptr);
@@ -694,6 +882,16 @@ void print_ndevs(int *ndevs)
 struct cgpu_info gpus[MAX_GPUDEVICES]; /* Maximum number apparently possible */
 struct cgpu_info *cpus;
 
+/* Switches a GPU to dynamic intensity. The controller state left over from
+ * an earlier spell in dynamic mode is dropped, so it starts again from the
+ * size launched next instead of wherever it was when it was turned off. */
+void enable_dynamic_intensity(struct cgpu_info *gpu)
+{
+  gpu->dynamic = true;
+  gpu->dyn_log_threads = 0;
+  gpu->dyn_last_err = 0;
+}
+
 /* In dynamic mode, only the first thread of each device will be in use.
  * This potentially could start a thread that was stopped with the start-stop
  * options if one were to disable dynamic from the menu on a paused GPU */
@@ -901,7 +1099,7 @@ retry: // TODO: refactor
     }
     if (!strncasecmp(intvar, "d", 1)) {
       wlogprint("Dynamic mode enabled on gpu %d\n", selected);
-      gpus[selected].dynamic = true;
+      enable_dynamic_intensity(&gpus[selected]);
 
       // fix config with new settings so that we can save them
       update_config_intensity(get_gpu_profile(selected));
@@ -1026,7 +1224,7 @@ void manage_gpu(void)
 
 static _clState *clStates[MAX_GPUDEVICES];
 
-static void set_threads_hashes(unsigned int vectors, unsigned int compute_shaders, int64_t *hashes, size_t *globalThreads,
+static void set_threads_hashes(unsigned int vectors, unsigned int nonces, unsigned int compute_shaders, int64_t *hashes, size_t *globalThreads,
              unsigned int minthreads, __maybe_unused int *intensity, __maybe_unused int *xintensity,
              __maybe_unused int *rawintensity, algorithm_t *algorithm)
 {
@@ -1053,8 +1251,17 @@ static void set_threads_hashes(unsigned int vectors, unsigned int compute_shader
     }
   }
 
+  /* The intensity is in nonces per launch, and each work-item hashes
+   * vectors lanes of nonces, nonces times over */
+  if (vectors * nonces > 1)
+    threads = MAX(threads / (vectors * nonces), minthreads);
+
+  /* The kernel's reqd_work_group_size fails any launch whose global size
+   * isn't a whole number of work-groups, as with a nonce count of 3 */
+  threads -= threads % minthreads;
+
   *globalThreads = threads;
-  *hashes = threads * vectors;
+  *hashes = (int64_t)threads * vectors * nonces;
 }
 
 /* We have only one thread that ever re-initialises GPUs, thus if any GPU
@@ -1249,13 +1456,203 @@ static void get_opencl_statline(char *buf, size_t bufsiz, struct cgpu_info *gpu)
     tailsprintf(buf, bufsiz, " I:%2d", gpu->intensity);
 }
 
+/* One launch in flight in pipelined mode: its output buffer, the host copy
+ * it gets read into, the read's completion event and the work it scanned. */
+struct opencl_slot {
+  cl_mem output;
+  cl_mem pinned;
+  uint32_t *res;
+  cl_event event;
+  cl_event kernel_event;
+  size_t threads;  /* nonces launched */
+  cl_uint gen;  /* abort generation it was launched under */
+  struct work *work;
+  bool pending;
+};
+
 struct opencl_thread_data {
   cl_int (*queue_kernel_parameters)(_clState *, dev_blk_ctx *, cl_uint);
   uint32_t *res;
+  cl_mem pinned;
+
+  int pipeline;
+  int cur_slot;
+  struct opencl_slot *slots;
+
+  /* --gpu-profile state for this thread's queue */
+  cl_ulong last_kernel_end;
+  cl_event write_event;
+
+  /* When the last pipelined launch was drained, to time launches by when
+   * there are no kernel events */
+  struct timeval tv_last_drain;
 };
 
 static uint32_t *blank_res;
 
+/* Host copies of the output buffer live in a CL_MEM_ALLOC_HOST_PTR buffer that
+ * is mapped once, so reads land straight in pinned memory. If the runtime
+ * won't give us one, plain heap memory still works, just slower. */
+static uint32_t *opencl_alloc_res(_clState *clState, cl_mem *pinned)
+{
+  cl_int status;
+  void *res;
+
+  *pinned = clCreateBuffer(clState->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, BUFFERSIZE, NULL, &status);
+  if (status == CL_SUCCESS) {
+    res = clEnqueueMapBuffer(clState->commandQueue, *pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0,
+               BUFFERSIZE, 0, NULL, NULL, &status);
+    if (status == CL_SUCCESS) {
+      memset(res, 0, BUFFERSIZE);
+      return (uint32_t *)res;
+    }
+    clReleaseMemObject(*pinned);
+  }
+
+  applog(LOG_INFO, "Pinned result buffer unavailable (error %d), using host memory", status);
+  *pinned = NULL;
+  return (uint32_t *)calloc(BUFFERSIZE, 1);
+}
+
+static void opencl_free_res(_clState *clState, cl_mem pinned, uint32_t *res)
+{
+  if (!pinned) {
+    free(res);
+    return;
+  }
+  if (clState) {
+    clEnqueueUnmapMemObject(clState->commandQueue, pinned, res, 0, NULL, NULL);
+    clFinish(clState->commandQueue);
+  }
+  clReleaseMemObject(pinned);
+}
+
+/* Only the ring's header is read back after a launch. The slots in use are
+ * read, and the header reset, only when its count says something is in them -
+ * stale slot contents never need resetting, so nothing else is ever written. */
+static cl_int opencl_read_count(_clState *clState, cl_mem output, uint32_t *res, cl_event *event)
+{
+  return clEnqueueReadBuffer(clState->commandQueue, output, CL_FALSE, 0,
+             RING_SLOTS * sizeof(uint32_t), res, 0, NULL, event);
+}
+
+static cl_int opencl_read_found(_clState *clState, cl_mem output, uint32_t *res, cl_event *write_event)
+{
+  static const uint32_t header[RING_OVERFLOW + 1] = { 0, RING_SIZE, 0 };
+  uint32_t count = MIN(res[RING_COUNT], RING_SIZE);
+  cl_int status;
+
+  status = clEnqueueReadBuffer(clState->commandQueue, output, CL_TRUE, 0,
+             (RING_SLOTS + count) * sizeof(uint32_t), res, 0, NULL, NULL);
+  status |= clEnqueueWriteBuffer(clState->commandQueue, output, CL_FALSE, 0,
+              sizeof(header), header, 0, NULL, write_event);
+  return status;
+}
+
+/* The events of a launch that has finished go into the device's histograms
+ * with --gpu-profile, and are released. Returns the kernel time in us, or
+ * -1 without a kernel event. */
+static double opencl_profile_launch(struct thr_info *thr, cl_event kernel, cl_event read)
+{
+  struct opencl_thread_data *thrdata = (struct opencl_thread_data *)thr->cgpu_data;
+  event_profile *profile = thr->cgpu->event_profile;
+  double kernel_us = -1;
+
+  if (kernel) {
+    kernel_us = event_profile_kernel(profile, kernel, &thrdata->last_kernel_end);
+    clReleaseEvent(kernel);
+  }
+  if (read) {
+    event_profile_transfer(profile, EVENT_HIST_READ, read);
+    clReleaseEvent(read);
+  }
+
+  return kernel_us;
+}
+
+/* The counter reset is never waited for, so its event is only recorded
+ * once it has completed, or waited for when another one is about to be
+ * queued */
+static void opencl_profile_write(struct thr_info *thr, bool wait)
+{
+  struct opencl_thread_data *thrdata = (struct opencl_thread_data *)thr->cgpu_data;
+  cl_int exec = CL_COMPLETE;
+
+  if (!thrdata->write_event)
+    return;
+
+  if (wait)
+    clWaitForEvents(1, &thrdata->write_event);
+  else if (clGetEventInfo(thrdata->write_event, CL_EVENT_COMMAND_EXECUTION_STATUS,
+        sizeof(exec), &exec, NULL) != CL_SUCCESS || exec != CL_COMPLETE)
+    return;
+
+  event_profile_transfer(thr->cgpu->event_profile, EVENT_HIST_WRITE, thrdata->write_event);
+  clReleaseEvent(thrdata->write_event);
+  thrdata->write_event = NULL;
+}
+
+/* Launches get events for --gpu-profile, and for dynamic intensity to time
+ * the kernel with, if the queue can profile */
+static bool opencl_events(struct thr_info *thr)
+{
+  return clStates[thr->id]->profiling && (thr->cgpu->event_profile || thr->cgpu->dynamic);
+}
+
+/* Where the next counter reset's event goes, NULL when not profiling */
+static cl_event *opencl_write_event(struct thr_info *thr)
+{
+  struct opencl_thread_data *thrdata = (struct opencl_thread_data *)thr->cgpu_data;
+
+  if (!clStates[thr->id]->profiling || !thr->cgpu->event_profile)
+    return NULL;
+  opencl_profile_write(thr, true);
+  return &thrdata->write_event;
+}
+
+extern int opt_dynamic_interval;
+
+/* Dynamic intensity is a PI controller on the global work size. It holds
+ * the kernel time of every launch at --gpu-dyninterval ms, so a job switch
+ * never waits long behind launches already queued. Kernel time is about
+ * proportional to the work size, so it works on log2 of the size, and each
+ * measured launch says what size would have hit the target. threads and
+ * wsize are in nonces, as rawintensity is. */
+#define DYN_KP 0.2
+#define DYN_KI 0.5
+
+static void dynamic_intensity_update(struct cgpu_info *gpu, size_t threads, double kernel_us, size_t wsize)
+{
+  const double target_us = opt_dynamic_interval * 1000.0;
+  double ideal, err, min_log = log2((double)wsize), max_log = log2((double)MAX_RAWINTENSITY);
+  size_t raw;
+
+  if (!gpu->dynamic || kernel_us <= 0 || !threads)
+    return;
+
+  /* Entering dynamic mode, start from the size last launched */
+  if (gpu->dyn_log_threads <= 0) {
+    gpu->dyn_log_threads = log2((double)threads);
+    gpu->dyn_last_err = 0;
+  }
+
+  ideal = log2((double)threads * target_us / kernel_us);
+  err = ideal - gpu->dyn_log_threads;
+  gpu->dyn_log_threads += DYN_KP * (err - gpu->dyn_last_err) + DYN_KI * err;
+  gpu->dyn_last_err = err;
+
+  if (gpu->dyn_log_threads < min_log)
+    gpu->dyn_log_threads = min_log;
+  else if (gpu->dyn_log_threads > max_log)
+    gpu->dyn_log_threads = max_log;
+
+  raw = (size_t)exp2(gpu->dyn_log_threads);
+  raw -= raw % wsize;
+  if (raw < wsize)
+    raw = wsize;
+  gpu->rawintensity = (int)MIN(raw, (size_t)MAX_RAWINTENSITY);
+}
+
 static bool opencl_thread_prepare(struct thr_info *thr)
 {
   char name[256];
@@ -1265,10 +1662,17 @@ static bool opencl_thread_prepare(struct thr_info *thr)
   int virtual_gpu = cgpu->virtual_gpu;
   int i = thr->id;
   static bool failmessage = false;
+  static pthread_mutex_t prepare_lock = PTHREAD_MUTEX_INITIALIZER;
   int buffersize = BUFFERSIZE;
 
-  if (!blank_res)
+  /* Devices are prepared in parallel */
+  mutex_lock(&prepare_lock);
+  if (!blank_res) {
     blank_res = (uint32_t *)calloc(buffersize, 1);
+    if (blank_res)
+      ring_clear(blank_res);
+  }
+  mutex_unlock(&prepare_lock);
   if (!blank_res) {
     applog(LOG_ERR, "Failed to calloc in opencl_thread_init");
     return false;
@@ -1284,6 +1688,7 @@ static bool opencl_thread_prepare(struct thr_info *thr)
       enable_curses();
 #endif
     applog(LOG_ERR, "Failed to init GPU thread %d, disabling device %d", i, gpu);
+    mutex_lock(&prepare_lock);
     if (!failmessage) {
       applog(LOG_ERR, "Restarting the GPU from the menu will not fix this.");
       applog(LOG_ERR, "Re-check your configuration and try restarting.");
@@ -1297,6 +1702,7 @@ static bool opencl_thread_prepare(struct thr_info *thr)
       }
 #endif
     }
+    mutex_unlock(&prepare_lock);
     cgpu->deven = DEV_DISABLED;
     cgpu->status = LIFE_NOSTART;
 
@@ -1307,6 +1713,11 @@ static bool opencl_thread_prepare(struct thr_info *thr)
   if (!cgpu->name)
     cgpu->name = strdup(name);
 
+  /* A device's threads are prepared one after another, so this is only
+   * made once */
+  if (opt_gpu_profile && clStates[i]->profiling && !cgpu->event_profile)
+    cgpu->event_profile = event_profile_new();
+
   applog(LOG_INFO, "initCl() finished. Found %s", name);
   cgtime(&now);
   get_datestamp(cgpu->init, sizeof(cgpu->init), &now);
@@ -1331,7 +1742,7 @@ static bool opencl_thread_init(struct thr_info *thr)
   }
 
   thrdata->queue_kernel_parameters = gpu->algorithm.queue_kernel;
-  thrdata->res = (uint32_t *)calloc(buffersize, 1);
+  thrdata->res = opencl_alloc_res(clState, &thrdata->pinned);
 
   if (!thrdata->res) {
     free(thrdata);
@@ -1342,12 +1753,46 @@ static bool opencl_thread_init(struct thr_info *thr)
   status |= clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffer, CL_TRUE, 0,
                buffersize, blank_res, 0, NULL, NULL);
   if (unlikely(status != CL_SUCCESS)) {
-    free(thrdata->res);
+    opencl_free_res(clState, thrdata->pinned, thrdata->res);
     free(thrdata);
     applog(LOG_ERR, "Error: clEnqueueWriteBuffer failed.");
     return false;
   }
 
+  /* Prepared works are topped up after scanhash returns, so without a
+   * launch still in flight the GPU would sit idle while that happens */
+  thrdata->pipeline = gpu->pipeline > 1 ? gpu->pipeline : (gpu->prepared_works ? 2 : 1);
+  if (gpu->prepared_works && gpu->pipeline <= 1 && !thr->device_thread)
+    applog(LOG_INFO, "GPU %d: --gpu-prepared keeps 2 launches in flight", gpu->device_id);
+  if (thrdata->pipeline > 1) {
+    int i;
+
+    thrdata->slots = (struct opencl_slot *)calloc(thrdata->pipeline, sizeof(struct opencl_slot));
+    if (unlikely(!thrdata->slots)) {
+      applog(LOG_ERR, "Failed to calloc in opencl_thread_init");
+      return false;
+    }
+
+    /* Slot 0 uses the output buffer initCl made, the rest get their own */
+    for (i = 0; i < thrdata->pipeline; i++) {
+      struct opencl_slot *slot = &thrdata->slots[i];
+
+      if (i)
+        slot->output = clCreateBuffer(clState->context, CL_MEM_READ_WRITE, buffersize, NULL, &status);
+      else
+        slot->output = clState->outputBuffer;
+      if (status == CL_SUCCESS)
+        status = clEnqueueWriteBuffer(clState->commandQueue, slot->output, CL_TRUE, 0,
+                   buffersize, blank_res, 0, NULL, NULL);
+      slot->res = opencl_alloc_res(clState, &slot->pinned);
+      if (unlikely(status != CL_SUCCESS || !slot->res)) {
+        applog(LOG_ERR, "Error: failed to set up pipeline slot %d for GPU %d.", i, gpu->device_id);
+        return false;
+      }
+    }
+    applog(LOG_INFO, "GPU %d thread %d: %d launches in flight", gpu->device_id, thr_id, thrdata->pipeline);
+  }
+
   gpu->status = LIFE_WELL;
 
   gpu->device_last_well = time(NULL);
@@ -1359,10 +1804,172 @@ static bool opencl_prepare_work(struct thr_info __maybe_unused *thr, struct work
 {
   work->blk.work = work;
   thr->pool_no = work->pool->pool_no;
+
+  /* Per-work kernel arguments are computed here once, not on every scan */
+  if (thr->cgpu->algorithm.prepare_work)
+    thr->cgpu->algorithm.prepare_work(&work->blk);
   return true;
 }
 
-extern int opt_dynamic_interval;
+/* Wait for the launch last made with this slot, and pass anything it found
+ * on. The launches enqueued after it keep the GPU busy in the meantime.
+ * hashes gets the nonces it hashed, none if a restart aborted it. */
+static bool opencl_slot_drain(struct thr_info *thr, struct opencl_slot *slot, int64_t *hashes)
+{
+  struct opencl_thread_data *thrdata = (struct opencl_thread_data *)thr->cgpu_data;
+  _clState *clState = clStates[thr->id];
+  double kernel_us = -1;
+  struct timeval now;
+  cl_int status;
+
+  *hashes = 0;
+  if (!slot->pending)
+    return true;
+
+  status = clWaitForEvents(1, &slot->event);
+  if (slot->kernel_event)
+    kernel_us = opencl_profile_launch(thr, slot->kernel_event, slot->event);
+  else
+    clReleaseEvent(slot->event);
+  slot->kernel_event = NULL;
+  slot->pending = false;
+
+  /* With launches queued back to back the GPU finishes one about every
+   * kernel time, so that's the fallback without a kernel event */
+  cgtime(&now);
+  if (kernel_us < 0 && thrdata->tv_last_drain.tv_sec)
+    kernel_us = us_tdiff(&now, &thrdata->tv_last_drain);
+  thrdata->tv_last_drain = now;
+  if (unlikely(status != CL_SUCCESS)) {
+    applog(LOG_ERR, "Error %d: waiting for pipelined launch. (clWaitForEvents)", status);
+    return false;
+  }
+
+  /* An aborted launch quit early, so its time says nothing about the
+   * intensity and its range wasn't hashed */
+  if (slot->res[RING_ABORTED] != slot->gen) {
+    dynamic_intensity_update(thr->cgpu, slot->threads, kernel_us, clState->wsize * clState->vwidth * clState->nonces);
+    *hashes = slot->threads;
+  }
+
+  if (slot->res[RING_COUNT]) {
+    /* In-order queue, so the counter reset lands before the slot's next launch */
+    status = opencl_read_found(clState, slot->output, slot->res, opencl_write_event(thr));
+    if (unlikely(status != CL_SUCCESS)) {
+      applog(LOG_ERR, "Error %d: reading found nonces failed.", status);
+      return false;
+    }
+    applog(LOG_DEBUG, "GPU %d found something?", thr->cgpu->device_id);
+    postcalc_hash_async(thr, slot->work, slot->res);
+    slot->res[RING_COUNT] = 0;
+  }
+
+  return true;
+}
+
+static pthread_mutex_t abort_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Takes the abort generation for a launch of work. It's read under
+ * abort_lock, together with which work it was taken for, so a restart
+ * either sees that work and bumps past the launch, or bumps first and the
+ * launch gets the new generation. */
+static void opencl_launch_gen(_clState *clState, struct work *work)
+{
+  struct work *old = NULL;
+
+  mutex_lock(&abort_lock);
+  clState->launch_gen = clState->abort_gen;
+  if (clState->gen_work != work) {
+    old = clState->gen_work;
+    clState->gen_work = ref_work(work);
+  }
+  mutex_unlock(&abort_lock);
+
+  if (old)
+    free_work(old);
+}
+
+/* Pipelined mode: launches go round robin through the slots and are only
+ * flushed, never finished, so launch N+1 is queued up before the results of
+ * launch N are looked at. Returns the hashes of the launch that was drained
+ * to make room, or -1 on error. */
+static int64_t opencl_scanhash_pipelined(struct thr_info *thr, struct work *work,
+        size_t *globalThreads, size_t *localThreads)
+{
+  struct opencl_thread_data *thrdata = (struct opencl_thread_data *)thr->cgpu_data;
+  struct opencl_slot *slot = &thrdata->slots[thrdata->cur_slot];
+  _clState *clState = clStates[thr->id];
+  size_t offset = work->blk.nonce;
+  int64_t hashes;
+  cl_int status;
+
+  if (!opencl_slot_drain(thr, slot, &hashes))
+    return -1;
+
+  /* The work may be freed before this launch's results are read, so the
+   * slot holds its own reference to it */
+  if (slot->work != work) {
+    if (slot->work)
+      free_work(slot->work);
+    slot->work = ref_work(work);
+  }
+
+  clState->outputBuffer = slot->output;
+  opencl_launch_gen(clState, work);
+  status = thrdata->queue_kernel_parameters(clState, &work->blk, globalThreads[0]);
+  if (unlikely(status != CL_SUCCESS)) {
+    applog(LOG_ERR, "Error: clSetKernelArg of all params failed.");
+    return -1;
+  }
+
+  status = clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel, 1, &offset,
+                  globalThreads, localThreads, 0, NULL, opencl_events(thr) ? &slot->kernel_event : NULL);
+  if (unlikely(status != CL_SUCCESS)) {
+    applog(LOG_ERR, "Error %d: Enqueueing kernel onto command queue. (clEnqueueNDRangeKernel)", status);
+    return -1;
+  }
+
+  status = opencl_read_count(clState, slot->output, slot->res, &slot->event);
+  if (unlikely(status != CL_SUCCESS)) {
+    applog(LOG_ERR, "Error: clEnqueueReadBuffer failed error %d. (clEnqueueReadBuffer)", status);
+    return -1;
+  }
+  slot->pending = true;
+  slot->threads = globalThreads[0] * clState->vwidth * clState->nonces;
+  slot->gen = clState->arg_gen;
+  clFlush(clState->commandQueue);
+
+  thrdata->cur_slot = (thrdata->cur_slot + 1) % thrdata->pipeline;
+  return hashes;
+}
+
+/* restart_thread calls this for every thread of a device once it's set
+ * their work_restart. Bumping the abort generation makes the kernels
+ * already queued for stale work quit at their next check instead of
+ * hashing out the whole launch. The write goes on the second queue so it
+ * doesn't wait behind them. A thread whose last launch was already for
+ * fresh work is left alone, so that launch isn't aborted along with them. */
+static void opencl_flush_work(struct cgpu_info *gpu)
+{
+  int i;
+
+  mutex_lock(&abort_lock);
+  for (i = 0; i < gpu->threads; i++) {
+    struct thr_info *thr = gpu->thr[i];
+    _clState *clState = clStates[thr->id];
+
+    if (!thr->work_restart || !clState || !clState->abortQueue || !clState->gen_work ||
+        !stale_work(clState->gen_work, false))
+      continue;
+
+    clState->abort_gen++;
+    if (clEnqueueWriteBuffer(clState->abortQueue, clState->AbortBuf, CL_FALSE, 0,
+                 sizeof(clState->abort_gen), &clState->abort_gen, 0, NULL, NULL) != CL_SUCCESS)
+      applog(LOG_DEBUG, "GPU %d: failed to write the abort generation", gpu->device_id);
+    clFlush(clState->abortQueue);
+  }
+  mutex_unlock(&abort_lock);
+}
 
 static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
         int64_t __maybe_unused max_nonce)
@@ -1371,40 +1978,32 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
   struct opencl_thread_data *thrdata = (struct opencl_thread_data *)thr->cgpu_data;
   struct cgpu_info *gpu = thr->cgpu;
   _clState *clState = clStates[thr_id];
-  const int dynamic_us = opt_dynamic_interval * 1000;
 
   cl_int status;
   size_t globalThreads[1];
   size_t localThreads[1] = { clState->wsize };
     size_t *p_global_work_offset = NULL;
   int64_t hashes;
-  int found = gpu->algorithm.found_idx;
-  int buffersize = BUFFERSIZE;
     unsigned int i;
+  bool events = opencl_events(thr);
+  cl_event kernel_event = NULL, read_event = NULL;
+  struct timeval tv_launch, tv_done;
+  double kernel_us;
 
-  /* Windows' timer resolution is only 15ms so oversample 5x */
-  if (gpu->dynamic && (++gpu->intervals * dynamic_us) > 70000) {
-    struct timeval tv_gpuend;
-    double gpu_us;
-
-    cgtime(&tv_gpuend);
-    gpu_us = us_tdiff(&tv_gpuend, &gpu->tv_gpustart) / gpu->intervals;
-    if (gpu_us > dynamic_us) {
-      if (gpu->intensity > MIN_INTENSITY)
-        --gpu->intensity;
-    } else if (gpu_us < dynamic_us / 2) {
-      if (gpu->intensity < MAX_INTENSITY)
-        ++gpu->intensity;
-    }
-    memcpy(&(gpu->tv_gpustart), &tv_gpuend, sizeof(struct timeval));
-    gpu->intervals = 0;
-  }
-
-  set_threads_hashes(clState->vwidth, clState->compute_shaders, &hashes, globalThreads, localThreads[0],
+  set_threads_hashes(clState->vwidth, clState->nonces, clState->compute_shaders, &hashes, globalThreads, localThreads[0],
          &gpu->intensity, &gpu->xintensity, &gpu->rawintensity, &gpu->algorithm);
   if (hashes > gpu->max_hashes)
     gpu->max_hashes = hashes;
 
+  /* Launches are counted once they're drained, so aborted ones aren't */
+  if (thrdata->pipeline > 1) {
+    hashes = opencl_scanhash_pipelined(thr, work, globalThreads, localThreads);
+    if (hashes >= 0)
+      work->blk.nonce += gpu->max_hashes;
+    return hashes;
+  }
+
+  opencl_launch_gen(clState, work);
   status = thrdata->queue_kernel_parameters(clState, &work->blk, globalThreads[0]);
   if (unlikely(status != CL_SUCCESS)) {
     applog(LOG_ERR, "Error: clSetKernelArg of all params failed.");
@@ -1414,8 +2013,9 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
     if (clState->goffset)
         p_global_work_offset = (size_t *)&work->blk.nonce;
 
+    cgtime(&tv_launch);
     status = clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel, 1, p_global_work_offset,
-                    globalThreads, localThreads, 0,  NULL, NULL);
+                    globalThreads, localThreads, 0,  NULL, events ? &kernel_event : NULL);
   if (unlikely(status != CL_SUCCESS)) {
     applog(LOG_ERR, "Error %d: Enqueueing kernel onto command queue. (clEnqueueNDRangeKernel)", status);
     return -1;
@@ -1430,8 +2030,7 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
       }
   }
 
-  status = clEnqueueReadBuffer(clState->commandQueue, clState->outputBuffer, CL_FALSE, 0,
-             buffersize, thrdata->res, 0, NULL, NULL);
+  status = opencl_read_count(clState, clState->outputBuffer, thrdata->res, events ? &read_event : NULL);
   if (unlikely(status != CL_SUCCESS)) {
     applog(LOG_ERR, "Error: clEnqueueReadBuffer failed error %d. (clEnqueueReadBuffer)", status);
     return -1;
@@ -1445,20 +2044,33 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
   /* This finish flushes the readbuffer set with CL_FALSE in clEnqueueReadBuffer */
   clFinish(clState->commandQueue);
 
-  /* found entry is used as a counter to say how many nonces exist */
-  if (thrdata->res[found]) {
-    /* Clear the buffer again */
-    status = clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffer, CL_FALSE, 0,
-                buffersize, blank_res, 0, NULL, NULL);
+  /* Without a kernel event the launch is timed on the host, which counts
+   * the read and the queueing too */
+  cgtime(&tv_done);
+  kernel_us = events ? opencl_profile_launch(thr, kernel_event, read_event) : -1;
+  if (kernel_us < 0)
+    kernel_us = us_tdiff(&tv_done, &tv_launch);
+  opencl_profile_write(thr, false);
+
+  /* A launch a restart aborted quit early: its range wasn't hashed, and its
+   * short kernel time would only push the intensity up */
+  if (thrdata->res[RING_ABORTED] == clState->arg_gen)
+    hashes = 0;
+  else
+    dynamic_intensity_update(gpu, globalThreads[0] * clState->vwidth * clState->nonces, kernel_us,
+                 clState->wsize * clState->vwidth * clState->nonces);
+
+  /* The ring's count says how many nonces exist */
+  if (thrdata->res[RING_COUNT]) {
+    /* Read the populated slots and clear the counter again */
+    status = opencl_read_found(clState, clState->outputBuffer, thrdata->res, opencl_write_event(thr));
     if (unlikely(status != CL_SUCCESS)) {
-      applog(LOG_ERR, "Error: clEnqueueWriteBuffer failed.");
+      applog(LOG_ERR, "Error %d: reading found nonces failed.", status);
       return -1;
     }
     applog(LOG_DEBUG, "GPU %d found something?", gpu->device_id);
     postcalc_hash_async(thr, work, thrdata->res);
-    memset(thrdata->res, 0, buffersize);
-    /* This finish flushes the writebuffer set with CL_FALSE in clEnqueueWriteBuffer */
-    clFinish(clState->commandQueue);
+    thrdata->res[RING_COUNT] = 0;
   }
 
   return hashes;
@@ -1470,26 +2082,61 @@ static void opencl_thread_shutdown(struct thr_info *thr)
 {
   const int thr_id = thr->id;
   _clState *clState = clStates[thr_id];
+  struct opencl_thread_data *thrdata = (struct opencl_thread_data *)thr->cgpu_data;
   clStates[thr_id] = NULL;
     unsigned int i;
 
-  if (clState) {
+  if (clState)
     clFinish(clState->commandQueue);
+
+  if (thrdata && thrdata->slots) {
+    int j;
+
+    for (j = 0; j < thrdata->pipeline; j++) {
+      struct opencl_slot *slot = &thrdata->slots[j];
+
+      if (slot->pending)
+        clReleaseEvent(slot->event);
+      if (slot->kernel_event)
+        clReleaseEvent(slot->kernel_event);
+      if (j && slot->output)
+        clReleaseMemObject(slot->output);
+      if (slot->work)
+        free_work(slot->work);
+      opencl_free_res(clState, slot->pinned, slot->res);
+    }
+    if (clState)
+      clState->outputBuffer = thrdata->slots[0].output;
+    free(thrdata->slots);
+  }
+  if (thrdata && thrdata->write_event)
+    clReleaseEvent(thrdata->write_event);
+  if (thrdata)
+    opencl_free_res(clState, thrdata->pinned, thrdata->res);
+
+  if (clState) {
     clReleaseMemObject(clState->outputBuffer);
     clReleaseMemObject(clState->CLbuffer0);
     if (clState->padbuffer8)
       clReleaseMemObject(clState->padbuffer8);
+    if (clState->KeyScheduleBuf)
+      clReleaseMemObject(clState->KeyScheduleBuf);
+    if (clState->AbortBuf)
+      clReleaseMemObject(clState->AbortBuf);
+    if (clState->gen_work)
+      free_work(clState->gen_work);
     clReleaseKernel(clState->kernel);
         for (i = 0; i < clState->n_extra_kernels; i++)
             clReleaseKernel(clState->extra_kernels[i]);
     clReleaseProgram(clState->program);
     clReleaseCommandQueue(clState->commandQueue);
+    if (clState->abortQueue)
+      clReleaseCommandQueue(clState->abortQueue);
     clReleaseContext(clState->context);
     if (clState->extra_kernels)
       free(clState->extra_kernels);
     free(clState);
   }
-  free(((struct opencl_thread_data *)thr->cgpu_data)->res);
   free(thr->cgpu_data);
   thr->cgpu_data = NULL;
 }
@@ -1519,7 +2166,7 @@ struct device_drv opencl_drv = {
   /*.scanhash = */    opencl_scanhash,
   /*.scanwork = */    NULL,
   /*.queue_full = */    NULL,
-  /*.flush_work = */    NULL,
+  /*.flush_work = */    opencl_flush_work,
   /*.update_work = */   NULL,
   /*.hw_error = */    NULL,
   /*.thread_shutdown = */   opencl_thread_shutdown,
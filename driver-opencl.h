@@ -3,6 +3,9 @@
 
 #include "miner.h"
 
+/* Most kernel launches a GPU thread keeps in flight with --gpu-pipeline */
+#define MAX_GPU_PIPELINE 8
+#define MAX_GPU_PIPELINE_STR "8"
 
 extern void print_ndevs(int *ndevs);
 extern void *reinit_gpu(void *userdata);
@@ -21,11 +24,18 @@ extern char *set_xintensity(const char *arg);
 extern char *set_rawintensity(const char *arg);
 extern char *set_vector(char *arg);
 extern char *set_worksize(const char *arg);
+extern char *set_hostkeys(const char *arg);
+extern char *set_round1_precompute(const char *arg);
+extern char *set_bitsliced(const char *arg);
+extern char *set_kernel_nonces(const char *arg);
+extern char *set_gpu_pipeline(const char *arg);
+extern char *set_gpu_prepared(const char *arg);
 extern char *set_shaders(char *arg);
 extern char *set_lookup_gap(char *arg);
 extern char *set_thread_concurrency(const char *arg);
 void manage_gpu(void);
 extern void pause_dynamic_threads(int gpu);
+extern void enable_dynamic_intensity(struct cgpu_info *gpu);
 
 extern int opt_platform_id;
 
@@ -168,68 +168,154 @@ void precalc_hash(dev_blk_ctx *blk, uint32_t *state, uint32_t *data)
 
 #endif
 
-struct pc_data {
+/* Nonces returned by the devices are verified on the CPU by a fixed pool of
+ * worker threads fed from a bounded ring of pending results. Each entry holds
+ * a reference to the work rather than a deep copy of it. */
+struct vq_entry {
   struct thr_info *thr;
   struct work *work;
   uint32_t res[MAXBUFFERS];
-  pthread_t pth;
-  int found;
+  struct timeval tv_queued;
 };
 
-static void *postcalc_hash(void *userdata)
+static struct vq_entry *vq;
+static int vq_head, vq_count;
+static pthread_mutex_t vq_lock;
+static pthread_cond_t vq_cond, vq_space_cond;
+static struct verify_stats vstats;
+
+static void postcalc_hash(struct thr_info *thr, struct work *work, uint32_t *res)
+{
+  struct work vwork;
+  uint32_t entry, count = res[RING_COUNT];
+  uint32_t *slots = res + RING_SLOTS;
+
+  /* Nonces that found no slot were never written anywhere, so they're lost
+   * rather than wrong, and are counted apart from HW errors */
+  if (unlikely(count > RING_SIZE)) {
+    if (res[RING_OVERFLOW] != count - RING_SIZE)
+      applog(LOG_DEBUG, "%s%d: ring count %u and overflow %u disagree",
+          thr->cgpu->drv->name, thr->cgpu->device_id, count, res[RING_OVERFLOW]);
+    inc_ring_overflows(thr, count - RING_SIZE);
+    count = RING_SIZE;
+  }
+
+  /* The referenced work is shared with the mining thread and possibly other
+   * verifiers, so test nonces against a private shallow copy of it. Any
+   * share that is submitted gets deep copied by submit_tested_work. */
+  memcpy(&vwork, work, sizeof(struct work));
+
+  for (entry = 0; entry < count; entry++)
+    applog(LOG_DEBUG, "[THR%d] OCL NONCE %08x (%lu) found in slot %u", thr->id, slots[entry], (unsigned long)slots[entry], entry);
+
+  /* All nonces of a launch share the work, so verify them as one batch */
+  submit_nonces(thr, &vwork, slots, count);
+}
+
+static void *verify_thread(void __maybe_unused *userdata)
 {
-  struct pc_data *pcd = (struct pc_data *)userdata;
-  struct thr_info *thr = pcd->thr;
-  unsigned int entry = 0;
+  struct vq_entry *ent = (struct vq_entry *)malloc(sizeof(struct vq_entry));
+  struct timeval tv_done;
+  double latency;
 
-  int found = thr->cgpu->algorithm.found_idx;
+  if (unlikely(!ent))
+    quit(1, "Failed to malloc vq_entry in verify_thread");
 
+  RenameThread("Verify");
   pthread_detach(pthread_self());
 
-  /* To prevent corrupt values in FOUND from trying to read beyond the
-   * end of the res[] array */
-  if (unlikely(pcd->res[found] & ~found)) {
-    applog(LOG_WARNING, "%s%d: invalid nonce count - HW error",
-        thr->cgpu->drv->name, thr->cgpu->device_id);
-    hw_errors++;
-    thr->cgpu->hw_errors++;
-    pcd->res[found] &= found;
+  while (42) {
+    mutex_lock(&vq_lock);
+    while (!vq_count)
+      pthread_cond_wait(&vq_cond, &vq_lock);
+    memcpy(ent, &vq[vq_head], sizeof(struct vq_entry));
+    vq_head = (vq_head + 1) % vstats.size;
+    vstats.depth = --vq_count;
+    pthread_cond_signal(&vq_space_cond);
+    mutex_unlock(&vq_lock);
+
+    postcalc_hash(ent->thr, ent->work, ent->res);
+    free_work(ent->work);
+
+    cgtime(&tv_done);
+    latency = us_tdiff(&tv_done, &ent->tv_queued) / 1000.0;
+
+    mutex_lock(&vq_lock);
+    vstats.verified++;
+    vstats.total_latency += latency;
+    if (latency > vstats.max_latency)
+      vstats.max_latency = latency;
+    mutex_unlock(&vq_lock);
   }
 
-  for (entry = 0; entry < pcd->res[found]; entry++) {
-    uint32_t nonce = pcd->res[entry];
-    if (found == 0x0F)
-        nonce = swab32(nonce);
+  return NULL;
+}
 
-    applog(LOG_DEBUG, "[THR%d] OCL NONCE %08x (%lu) found in slot %d (found = %d)", thr->id, nonce, nonce, entry, found);
-    submit_nonce(thr, pcd->work, nonce);
+void init_verify_pool(int threads)
+{
+  pthread_t pth;
+  int i;
+
+  vq = (struct vq_entry *)calloc(VERIFY_QUEUE_SIZE, sizeof(struct vq_entry));
+  if (unlikely(!vq))
+    quit(1, "Failed to calloc verify queue");
+  vstats.size = VERIFY_QUEUE_SIZE;
+
+  mutex_init(&vq_lock);
+  if (unlikely(pthread_cond_init(&vq_cond, NULL)))
+    quit(1, "Failed to pthread_cond_init vq_cond");
+  if (unlikely(pthread_cond_init(&vq_space_cond, NULL)))
+    quit(1, "Failed to pthread_cond_init vq_space_cond");
+
+  for (i = 0; i < threads; i++) {
+    if (unlikely(pthread_create(&pth, NULL, verify_thread, NULL)))
+      quit(1, "Failed to create verify thread %d", i);
   }
+  vstats.threads = threads;
 
-  discard_work(pcd->work);
-  free(pcd);
+  applog(LOG_DEBUG, "Started %d nonce verification threads", threads);
+}
 
-  return NULL;
+void get_verify_stats(struct verify_stats *stats)
+{
+  mutex_lock(&vq_lock);
+  memcpy(stats, &vstats, sizeof(struct verify_stats));
+  mutex_unlock(&vq_lock);
 }
 
+/* Queues the result buffer of a launch for verification. The work is only
+ * referenced, so the caller remains free to discard its own reference as soon
+ * as this returns. Blocks while the queue is full so a burst of results
+ * throttles the device thread instead of being dropped. */
 void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res)
 {
-  struct pc_data *pcd = (struct pc_data *)malloc(sizeof(struct pc_data));
-  int buffersize;
+  struct vq_entry *ent;
 
-  if (unlikely(!pcd)) {
-    applog(LOG_ERR, "Failed to malloc pc_data in postcalc_hash_async");
+  if (unlikely(!vq)) {
+    postcalc_hash(thr, work, res);
     return;
   }
 
-  pcd->thr = thr;
-  pcd->work = copy_work(work);
-  buffersize = BUFFERSIZE;
+  ref_work(work);
 
-  memcpy(&pcd->res, res, buffersize);
-
-  if (pthread_create(&pcd->pth, NULL, postcalc_hash, (void *)pcd)) {
-    applog(LOG_ERR, "Failed to create postcalc_hash thread");
-    discard_work(pcd->work);
-    free(pcd);
+  mutex_lock(&vq_lock);
+  if (vq_count == vstats.size) {
+    vstats.full_waits++;
+    do {
+      pthread_cond_wait(&vq_space_cond, &vq_lock);
+    } while (vq_count == vstats.size);
   }
+
+  ent = &vq[(vq_head + vq_count) % vstats.size];
+  ent->thr = thr;
+  ent->work = work;
+  /* Only the header and the slots actually used */
+  memcpy(ent->res, res, (RING_SLOTS + MIN(res[RING_COUNT], RING_SIZE)) * sizeof(uint32_t));
+  cgtime(&ent->tv_queued);
+
+  vstats.depth = ++vq_count;
+  if (vq_count > vstats.max_depth)
+    vstats.max_depth = vq_count;
+  pthread_cond_signal(&vq_cond);
+  mutex_unlock(&vq_lock);
 }
@@ -5,10 +5,46 @@
 #include "config.h"
 
 #define MAXTHREADS (0xFFFFFFFEULL)
-#define MAXBUFFERS (0x100)
+#define MAXBUFFERS (0x400)
 #define BUFFERSIZE (sizeof(uint32_t) * MAXBUFFERS)
 
+/* Layout of the found-nonce ring a launch fills in. The kernel bumps
+ * RING_COUNT for every nonce it finds, stores it if there is still a slot
+ * left below RING_CAPACITY, and bumps RING_OVERFLOW if there isn't, so it
+ * never writes past the end. A launch that quits early on a restart stores
+ * its abort generation in RING_ABORTED, which is never reset - every later
+ * launch of that generation quits too. The kernel has the same numbers. */
+#define RING_COUNT 0
+#define RING_CAPACITY 1
+#define RING_OVERFLOW 2
+#define RING_ABORTED 3
+#define RING_SLOTS 4
+#define RING_SIZE (MAXBUFFERS - RING_SLOTS)
+
+/* An empty ring, as the device buffer has to start out before a launch */
+static inline void ring_clear(uint32_t *res)
+{
+  res[RING_COUNT] = 0;
+  res[RING_CAPACITY] = RING_SIZE;
+  res[RING_OVERFLOW] = 0;
+  res[RING_ABORTED] = ~0U;
+}
+#define VERIFY_QUEUE_SIZE (64)
+
+struct verify_stats {
+  int threads;
+  int size;
+  int depth;
+  int max_depth;
+  uint64_t full_waits;
+  uint64_t verified;
+  double total_latency;
+  double max_latency;
+};
+
 extern void precalc_hash(dev_blk_ctx *blk, uint32_t *state, uint32_t *data);
 extern void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res);
+extern void init_verify_pool(int threads);
+extern void get_verify_stats(struct verify_stats *stats);
 
 #endif /*FINDNONCE_H*/
@@ -111,9 +111,85 @@ __constant static const ulong ROUND_CONSTANTS[10] =
 /*
 	Macro here to differentiate between the round implementations for Hawaii and Tonga versus all of the earlier cards; I'm most interested
 	in making sure it works well for Tahiti and Pitcairn, though. More on why they're different below.
+	
+	All of the choices I made by hand for each card can now be overridden from the host: WHIRLPOOLX_LDS_TABLES (2 or 4) is how many
+	tables are copied into LDS, WHIRLPOOLX_UNROLL is the unroll factor of the round loop, and WHIRLPOOLX_CONSTANT_TABLES skips LDS
+	altogether and reads straight from constant memory. That's what --kernel-tune builds every combination of, and times, so new cards
+	don't need anyone to add their name to these #if blocks. Leave them undefined and you get what I picked.
+*/
+
+#ifndef WHIRLPOOLX_LDS_TABLES
+	#if defined(__Hawaii__) || defined(__Tonga__)
+		#define WHIRLPOOLX_LDS_TABLES	4
+	#else
+		#define WHIRLPOOLX_LDS_TABLES	2
+	#endif
+#endif
+
+#ifndef WHIRLPOOLX_UNROLL
+	#define WHIRLPOOLX_UNROLL		1
+#endif
+
+/*
+	WHIRLPOOLX_NONCES is how many nonces each work-item hashes, one after the other, before it's done. Filling the tables
+	in LDS, and the barrier after it, is a fixed cost per work-group - hash more than one nonce per work-item and it gets
+	paid that many times less often. The nonces are strided by the global size, so the launch still covers one contiguous
+	range starting at the global offset, just WHIRLPOOLX_NONCES times longer than the global size. The host sets it with
+	--kernel-nonces, and divides the global size by it.
+*/
+
+#ifndef WHIRLPOOLX_NONCES
+	#define WHIRLPOOLX_NONCES		1
+#endif
+
+/*
+	WHIRLPOOLX_VECTORS is the other way of giving a work-item more than one nonce: 2 or 4 of them hashed side by side, as
+	lanes, instead of one after the other. Every lookup of one lane is independent of the others, so there's always another
+	lane's work to issue while one waits on LDS - that's the latency hiding, and it costs a ulong8 of state per lane in VGPRs.
+	The key schedule only depends on the midstate, so all the lanes share one; that's a round of key lookups saved per lane
+	on top of it. The lanes are plain arrays, fully unrolled, not ulong2/ulong4 - every lookup is a scalar gather anyway, and
+	amd_bfe doesn't take vectors. Lane j gets nonce gid + j * global size, so a launch still covers one contiguous range.
+	The host sets it with --vectors, and divides the global size by it.
+*/
+
+#ifndef WHIRLPOOLX_VECTORS
+	#define WHIRLPOOLX_VECTORS		1
+#endif
+
+#define W_LANES				W_PRAGMA(unroll) for(uint j = 0; j < WHIRLPOOLX_VECTORS; ++j)
+#define W_NONCE(j)			(gid + (j) * (uint)get_global_size(0))
+
+/*
+	When a new job comes in, everything already queued is hashing stale work, and at a high intensity one launch can take
+	a good while. So the host bumps a generation counter in abortgen when it restarts, from a second command queue, and every
+	launch is told which generation it belongs to. Each work-item checks once per nonce, after the tables are in LDS so it
+	doesn't leave its neighbours with holes in them, and quits if there's a newer one. The difference is taken signed so
+	it survives wrapping around, and so a launch made after the bump, but before the write lands, doesn't see itself as stale.
+	A work-item that quits leaves its generation in the ring header, so the host knows the launch didn't hash its whole range.
 */
 
-#if defined(__Hawaii__) || defined(__Tonga__)
+#define W_ABORTED()			((int)(*abortgen - gen) > 0)
+
+// Layout of the found-nonce output ring, see the end of the kernel.
+#define RING_COUNT			0
+#define RING_CAPACITY		1
+#define RING_OVERFLOW		2
+#define RING_ABORTED		3
+#define RING_SLOTS			4
+
+// The extra level is so the unroll factor gets expanded before it's stringified.
+#define W_PRAGMA(x)			_Pragma(#x)
+#define W_UNROLL(n)			W_PRAGMA(unroll n)
+
+#if defined(WHIRLPOOLX_CONSTANT_TABLES)
+	
+	#define T0		T0_C
+	
+	#define W_ROUND(in, i0, i1, i2, i3, i4, i5, i6, i7)	(T0[BYTE(in.s ## i0, 0U)] ^ rotate(T0[BYTE(in.s ## i1, 8U)], 8UL) ^ rotate(T0[BYTE(in.s ## i2, 16U)], 16UL) ^ rotate(T0[BYTE(in.s ## i3, 24U)], 24UL) ^ \
+															rotate(T0[BYTE(in.s ## i4, 32U)], 32UL) ^ rotate(T0[BYTE(in.s ## i5, 40U)], 40UL) ^ rotate(T0[BYTE(in.s ## i6, 48U)], 48UL) ^ \
+															rotate(T0[BYTE(in.s ## i7, 56U)], 56UL))
+	
+#elif WHIRLPOOLX_LDS_TABLES == 4
 	
 	#define W_ROUND(in, i0, i1, i2, i3, i4, i5, i6, i7)	(T0[BYTE(in.s ## i0, 0U)] ^ T1[BYTE(in.s ## i1, 8U)] ^ T2[BYTE(in.s ## i2, 16U)] ^ T3[BYTE(in.s ## i3, 24U)] ^ \
 															rotate(T0[BYTE(in.s ## i4, 32U)], 32UL) ^ rotate(T0[BYTE(in.s ## i5, 40U)], 40UL) ^ rotate(T0[BYTE(in.s ## i6, 48U)], 48UL) ^ \
@@ -127,6 +203,141 @@ __constant static const ulong ROUND_CONSTANTS[10] =
 	
 #endif
 
+/*
+	WHIRLPOOLX_BITSLICED is Whirlpool with no tables at all - the version I talk about further down, finally in here. Instead of
+	bytes, the state is kept as eight bit planes: plane b (.sb of a ulong8) holds bit b of every byte of the state, at bit 8 * row +
+	column. SubBytes is then the S-box as a circuit - it's built out of the 4-bit mini-boxes E, E^-1 and R, like the spec says, and
+	each of those is nothing but ANDs and XORs of the same ten products of its input bits. ShiftColumns is a masked rotate per column,
+	and MixRows is rotating bits within each byte, with xtime being a shuffle of the planes and three XORs. No LDS, no constant
+	memory, nothing indexed by data. Getting in and out of planes is two 8x8 transposes, done once on the way in and once at the end.
+	
+	Is it faster? On anything I have, no - it's a lot more ALU work than 64 lookups. But it never touches LDS, so on a card that
+	starves on LDS bandwidth, or can't keep enough waves in flight with the tables in it, it might be; --kernel-tune times it along
+	with the table versions, so it gets picked where it wins. It can't do WHIRLPOOLX_ROUND1, as that one is four table lookups by
+	definition, so the host turns that off when this is on.
+*/
+
+#ifdef WHIRLPOOLX_BITSLICED
+
+#ifdef WHIRLPOOLX_ROUND1
+	#error "WHIRLPOOLX_ROUND1 is table lookups, and WHIRLPOOLX_BITSLICED has no tables."
+#endif
+
+#define W_BS_MONOMIALS(x) \
+	const ulong m3 = x.s0 & x.s1, m5 = x.s0 & x.s2, m6 = x.s1 & x.s2, m7 = m3 & x.s2, m9 = x.s0 & x.s3; \
+	const ulong m10 = x.s1 & x.s3, m11 = m3 & x.s3, m12 = x.s2 & x.s3, m13 = m5 & x.s3, m14 = m6 & x.s3;
+
+ulong4 W_BS_E(const ulong4 x)
+{
+	W_BS_MONOMIALS(x)
+	
+	return((ulong4)(~(m3 ^ m5 ^ x.s3 ^ m10 ^ m13), x.s0 ^ m3 ^ m6 ^ x.s3 ^ m11 ^ m13, m3 ^ x.s2 ^ x.s3 ^ m9 ^ m13 ^ m14,
+		x.s0 ^ x.s1 ^ m3 ^ x.s2 ^ m6 ^ m7 ^ x.s3 ^ m9 ^ m11 ^ m12 ^ m13 ^ m14));
+}
+
+ulong4 W_BS_EINV(const ulong4 x)
+{
+	W_BS_MONOMIALS(x)
+	
+	return((ulong4)(~(x.s0 ^ m3 ^ m7 ^ m10 ^ m11), ~(x.s0 ^ x.s1 ^ m5 ^ m7 ^ x.s3 ^ m10 ^ m11 ^ m12 ^ m13 ^ m14),
+		~(x.s0 ^ m3 ^ x.s2 ^ m6 ^ m7 ^ x.s3 ^ m9 ^ m10 ^ m12 ^ m13), ~(x.s0 ^ m5 ^ m6 ^ m7 ^ m12)));
+}
+
+ulong4 W_BS_R(const ulong4 x)
+{
+	W_BS_MONOMIALS(x)
+	
+	return((ulong4)(~(x.s0 ^ m3 ^ x.s2 ^ m5 ^ m6 ^ m7 ^ x.s3 ^ m12 ^ m13), ~(x.s0 ^ m6 ^ m9 ^ m10 ^ m11 ^ m13 ^ m14),
+		~(x.s1 ^ m3 ^ m9 ^ m12 ^ m14), x.s0 ^ x.s1 ^ m3 ^ x.s2 ^ m6 ^ m9 ^ m11 ^ m12));
+}
+
+// High nibble through E, low nibble through E^-1, R on the XOR of them, then the same again, crossed over.
+ulong8 W_BS_SBOX(const ulong8 x)
+{
+	const ulong4 a = W_BS_E(x.hi), b = W_BS_EINV(x.lo), r = W_BS_R(a ^ b);
+	
+	return((ulong8)(W_BS_EINV(b ^ r), W_BS_E(a ^ r)));
+}
+
+// Times x, mod x^8 + x^4 + x^3 + x^2 + 1.
+ulong8 W_BS_XTIME(const ulong8 x)
+{
+	return((ulong8)(x.s7, x.s0, x.s1 ^ x.s7, x.s2 ^ x.s7, x.s3 ^ x.s7, x.s4, x.s5, x.s6));
+}
+
+// Moves every column j over, within its row - column c ends up in c + j.
+#define W_BS_ROTB(x, j)		((((x) << (j)) & (0x0101010101010101UL * ((0xFFUL << (j)) & 0xFFUL))) | (((x) >> (8 - (j))) & (0x0101010101010101UL * (0xFFUL >> (8 - (j))))))
+
+/*
+	One round, minus the key. Column k goes down k rows for ShiftColumns, and in MixRows, column c of a row gets column c - j times
+	entry j of the circulant (1, 1, 4, 1, 8, 5, 2, 9). Sorting the js by which bits of their entry are set, that's three xtimes, Horner style.
+*/
+
+ulong8 W_BS_ROUND(const ulong8 s)
+{
+	const ulong8 u = W_BS_SBOX(s);
+	ulong8 t = u & 0x0101010101010101UL, x;
+	
+	W_PRAGMA(unroll)
+	for(uint k = 1; k < 8; ++k) t ^= rotate(u & (0x0101010101010101UL << k), (ulong8)(k << 3));
+	
+	x = W_BS_ROTB(t, 4) ^ W_BS_ROTB(t, 7);
+	x = W_BS_XTIME(x) ^ W_BS_ROTB(t, 2) ^ W_BS_ROTB(t, 5);
+	x = W_BS_XTIME(x) ^ W_BS_ROTB(t, 6);
+	
+	return(W_BS_XTIME(x) ^ t ^ W_BS_ROTB(t, 1) ^ W_BS_ROTB(t, 3) ^ W_BS_ROTB(t, 5) ^ W_BS_ROTB(t, 7));
+}
+
+// 8x8 bit transpose of every ulong: bit c of byte b trades places with bit b of byte c.
+#define W_BS_TRANSPOSE8(x, t) \
+	t = ((x) ^ ((x) >> 7)) & 0x00AA00AA00AA00AAUL; x ^= t ^ (t << 7); \
+	t = ((x) ^ ((x) >> 14)) & 0x0000CCCC0000CCCCUL; x ^= t ^ (t << 14); \
+	t = ((x) ^ ((x) >> 28)) & 0x00000000F0F0F0F0UL; x ^= t ^ (t << 28);
+
+ulong8 W_BS_BITT(ulong8 x)
+{
+	ulong8 t;
+	
+	W_BS_TRANSPOSE8(x, t)
+	return(x);
+}
+
+// 8x8 byte transpose: byte c of ulong i trades places with byte i of ulong c.
+ulong8 W_BS_BYTET(ulong8 u)
+{
+	ulong4 a = u.lo, b = u.hi, c, d;
+	
+	u = (ulong8)((a & 0x00000000FFFFFFFFUL) | (b << 32), (a >> 32) | (b & 0xFFFFFFFF00000000UL));
+	
+	a = u.s0145;
+	b = u.s2367;
+	c = (a & 0x0000FFFF0000FFFFUL) | ((b & 0x0000FFFF0000FFFFUL) << 16);
+	d = ((a >> 16) & 0x0000FFFF0000FFFFUL) | (b & 0xFFFF0000FFFF0000UL);
+	u = (ulong8)(c.s01, d.s01, c.s23, d.s23);
+	
+	a = u.even;
+	b = u.odd;
+	c = (a & 0x00FF00FF00FF00FFUL) | ((b & 0x00FF00FF00FF00FFUL) << 8);
+	d = ((a >> 8) & 0x00FF00FF00FF00FFUL) | (b & 0xFF00FF00FF00FF00UL);
+	
+	return((ulong8)(c.s0, d.s0, c.s1, d.s1, c.s2, d.s2, c.s3, d.s3));
+}
+
+// Byte c of row i, bit b, goes to bit 8 * i + c of plane b - and back.
+#define W_BS_PLANES(x)		W_BS_BYTET(W_BS_BITT(x))
+#define W_BS_BYTES(x)		W_BS_BITT(W_BS_BYTET(x))
+
+// A round constant, in planes. It's only ever in row 0, so that's only the bottom byte of each plane.
+ulong8 W_BS_RC(ulong c)
+{
+	ulong t;
+	
+	W_BS_TRANSPOSE8(c, t)
+	return(((ulong8)(c) >> (ulong8)(0, 8, 16, 24, 32, 40, 48, 56)) & 0xFFUL);
+}
+
+#endif
+
 /*
 	The kernel parameters probably look odd, and the reason for that is likely another thing that will make you feel
 	like you should have thought of it before now - the first execution of Whirlpool is actually constant! It does
@@ -148,10 +359,30 @@ __constant static const ulong ROUND_CONSTANTS[10] =
 	
 	In case you didn't figure it out, the pointer to the block data was replaced by two constant ulongs containing the
 	values of the block data, indexes 8 and 9, when indexed 64 bits at a time. Those are input0 and input1.
+	
+	With WHIRLPOOLX_HOSTKEYS defined, the same trick is taken one step further: the key schedule of the second block
+	starts from the midstate, so it's ALSO the same for every nonce. The host expands the ten round keys once per work
+	and hands them over in roundkeys, and the kernel only has to run the half of each round that touches the state.
+	
+	WHIRLPOOLX_ROUND1 goes after the first round of the state itself. The nonce is only in the top half of the second
+	word, and each byte of the input only lands in one row of the output, so of the 64 lookups in that round, only four
+	actually change from nonce to nonce - one each for rows 5, 6, 7 and 0. The host does the other 60, XORs in the round
+	key, and passes the lot as round1 (and the round key alone as key1, if it isn't handing over the whole schedule).
 */
 
 __attribute__((reqd_work_group_size(WORKSIZE, 1, 1)))
-__kernel void WhirlpoolX(const ulong8 midstate, const ulong input0, const ulong input1, __global uint *output, const ulong target)
+__kernel void WhirlpoolX(const ulong8 midstate, const ulong input0, const ulong input1, __global uint *output, const ulong target,
+	__global const volatile uint *abortgen, const uint gen
+#ifdef WHIRLPOOLX_HOSTKEYS
+	, __constant ulong8 *roundkeys
+#endif
+#ifdef WHIRLPOOLX_ROUND1
+	, const ulong8 round1
+	#ifndef WHIRLPOOLX_HOSTKEYS
+	, const ulong8 key1
+	#endif
+#endif
+	)
 {
 	/*
 		Note that if you don't specify a type label, the variables automatically go in private memory if they can,
@@ -163,7 +394,10 @@ __kernel void WhirlpoolX(const ulong8 midstate, const ulong input0, const ulong
 	*/
 	
 	__private uint gid = get_global_id(0);
-	__private ulong8 n, h = midstate;
+	__private ulong8 n[WHIRLPOOLX_VECTORS], h;
+	
+	#if !defined(WHIRLPOOLX_CONSTANT_TABLES) && !defined(WHIRLPOOLX_BITSLICED)
+	
 	__local ulong T0[256], T1[256];
 	
 	/*
@@ -173,7 +407,7 @@ __kernel void WhirlpoolX(const ulong8 midstate, const ulong input0, const ulong
 	*/
 		
 	
-	#if defined(__Hawaii__) || defined(__Tonga__)
+	#if WHIRLPOOLX_LDS_TABLES == 4
 		
 		__local ulong T2[256], T3[256];
 		
@@ -186,7 +420,7 @@ __kernel void WhirlpoolX(const ulong8 midstate, const ulong input0, const ulong
 		T0[lid] = T0_C[lid];
 		T1[lid] = rotate(T0_C[lid], 8UL);
 		
-		#if defined(__Hawaii__) || defined(__Tonga__)
+		#if WHIRLPOOLX_LDS_TABLES == 4
 			
 			T2[lid] = rotate(T0_C[lid], 16UL);
 			T3[lid] = rotate(T0_C[lid], 24UL);
@@ -200,7 +434,7 @@ __kernel void WhirlpoolX(const ulong8 midstate, const ulong input0, const ulong
 			T0[lid] = T0_C[lid];
 			T1[lid] = rotate(T0_C[lid], 8UL);
 			
-			#if defined(__Hawaii__) || defined(__Tonga__)
+			#if WHIRLPOOLX_LDS_TABLES == 4
 				
 				T2[lid] = rotate(T0_C[lid], 16UL);
 				T3[lid] = rotate(T0_C[lid], 24UL);
@@ -212,7 +446,60 @@ __kernel void WhirlpoolX(const ulong8 midstate, const ulong input0, const ulong
 	
 	mem_fence(CLK_LOCAL_MEM_FENCE);
 	
-	n = (ulong8)(input0, (input1 & 0x00000000FFFFFFFF) | ((ulong)gid << 32), 0x0000000000000080, 0, 0, 0, 0, 0x8002000000000000) ^ h;
+	#endif
+	
+	// Everything from here on is per nonce, so it's all in the loop; h is the key, and gets clobbered by every pass.
+	#if WHIRLPOOLX_NONCES > 1
+	for(uint k = 0; k < WHIRLPOOLX_NONCES; ++k, gid += WHIRLPOOLX_VECTORS * get_global_size(0))
+	{
+		if(W_ABORTED()) { output[RING_ABORTED] = gen; break; }
+	
+	#else
+	
+	if(W_ABORTED()) { output[RING_ABORTED] = gen; return; }
+	
+	#endif
+	
+	h = midstate;
+	
+	#ifdef WHIRLPOOLX_ROUND1
+	
+	W_LANES
+	{
+		// The nonce half of the second word, as the first round would have seen it.
+		__private ulong n1 = ((ulong)W_NONCE(j) << 32) ^ midstate.s1;
+		
+		n[j] = round1;
+		n[j].s5 ^= rotate(T0[BYTE(n1, 32U)], 32UL);
+		n[j].s6 ^= rotate(T0[BYTE(n1, 40U)], 40UL);
+		n[j].s7 ^= rotate(T0[BYTE(n1, 48U)], 48UL);
+		n[j].s0 ^= rotate(T0[BYTE(n1, 56U)], 56UL);
+	}
+	
+	#ifndef WHIRLPOOLX_HOSTKEYS
+	h = key1;
+	#endif
+	
+	#define FIRST_ROUND		1
+	
+	#else
+	
+	W_LANES n[j] = (ulong8)(input0, (input1 & 0x00000000FFFFFFFF) | ((ulong)W_NONCE(j) << 32), 0x0000000000000080, 0, 0, 0, 0, 0x8002000000000000) ^ h;
+	
+	#define FIRST_ROUND		0
+	
+	#endif
+	
+	#ifdef WHIRLPOOLX_BITSLICED
+	
+	// Into bit planes for the rounds - the key too, unless the host is handing it over a round at a time.
+	W_LANES n[j] = W_BS_PLANES(n[j]);
+	
+	#ifndef WHIRLPOOLX_HOSTKEYS
+	h = W_BS_PLANES(h);
+	#endif
+	
+	#endif
 
 	/*
 	
@@ -263,15 +550,32 @@ __kernel void WhirlpoolX(const ulong8 midstate, const ulong input0, const ulong
 		However, you can see the messy, yet fully functional version now at this URL:
 		
 		https://ottrbutt.com/miner/wpltest.c
+		
+		Build with WHIRLPOOLX_BITSLICED for that version, see the top of the file.
 	*/
 	
 	// This loop is rolled up for a reason, by the way. I know what you're thinking - unrolling helped last time! Go ahead, try it.
+	// Or better yet, let --kernel-tune try it for you, on your card.
 	
-	#pragma unroll 1
-	for(int i = 0; i < 10; ++i)
+	W_UNROLL(WHIRLPOOLX_UNROLL)
+	for(int i = FIRST_ROUND; i < 9; ++i)
 	{
 		ulong8 t;
 		
+		#if defined(WHIRLPOOLX_HOSTKEYS) && defined(WHIRLPOOLX_BITSLICED)
+		
+		h = W_BS_PLANES(roundkeys[i]);
+		
+		#elif defined(WHIRLPOOLX_HOSTKEYS)
+		
+		h = roundkeys[i];
+		
+		#elif defined(WHIRLPOOLX_BITSLICED)
+		
+		h = W_BS_ROUND(h) ^ W_BS_RC(ROUND_CONSTANTS[i]);
+		
+		#else
+		
 		t.s0 = W_ROUND(h, 0, 7, 6, 5, 4, 3, 2, 1) ^ ROUND_CONSTANTS[i];
 		t.s1 = W_ROUND(h, 1, 0, 7, 6, 5, 4, 3, 2);
 		t.s2 = W_ROUND(h, 2, 1, 0, 7, 6, 5, 4, 3);
@@ -283,16 +587,83 @@ __kernel void WhirlpoolX(const ulong8 midstate, const ulong input0, const ulong
 		
 		h = t;
 		
-		t.s0 = W_ROUND(n, 0, 7, 6, 5, 4, 3, 2, 1);
-		t.s1 = W_ROUND(n, 1, 0, 7, 6, 5, 4, 3, 2);
-		t.s2 = W_ROUND(n, 2, 1, 0, 7, 6, 5, 4, 3);
-		t.s3 = W_ROUND(n, 3, 2, 1, 0, 7, 6, 5, 4);
-		t.s4 = W_ROUND(n, 4, 3, 2, 1, 0, 7, 6, 5);
-		t.s5 = W_ROUND(n, 5, 4, 3, 2, 1, 0, 7, 6);
-		t.s6 = W_ROUND(n, 6, 5, 4, 3, 2, 1, 0, 7);
-		t.s7 = W_ROUND(n, 7, 6, 5, 4, 3, 2, 1, 0);
+		#endif
 		
-		n = t ^ h;
+		W_LANES
+		{
+			#ifdef WHIRLPOOLX_BITSLICED
+			
+			n[j] = W_BS_ROUND(n[j]) ^ h;
+			
+			#else
+			
+			t.s0 = W_ROUND(n[j], 0, 7, 6, 5, 4, 3, 2, 1);
+			t.s1 = W_ROUND(n[j], 1, 0, 7, 6, 5, 4, 3, 2);
+			t.s2 = W_ROUND(n[j], 2, 1, 0, 7, 6, 5, 4, 3);
+			t.s3 = W_ROUND(n[j], 3, 2, 1, 0, 7, 6, 5, 4);
+			t.s4 = W_ROUND(n[j], 4, 3, 2, 1, 0, 7, 6, 5);
+			t.s5 = W_ROUND(n[j], 5, 4, 3, 2, 1, 0, 7, 6);
+			t.s6 = W_ROUND(n[j], 6, 5, 4, 3, 2, 1, 0, 7);
+			t.s7 = W_ROUND(n[j], 7, 6, 5, 4, 3, 2, 1, 0);
+			
+			n[j] = t ^ h;
+			
+			#endif
+		}
+	}
+	
+	/*
+		Now, the last round gets pulled out of the loop, and cut down to what we actually use. The check at the end only ever looks at
+		rows 3 and 5 of the state, and in W, each output row comes from one byte of every input row, so there's no reason to compute the
+		other six - not for the key, and not for the state. That's 12 of the 16 W_ROUNDs in the round gone, and no more loop-carried
+		ulong8 to haul through it. The round constant only touches row 0, so it goes too. Do not "fix" this by putting the full round
+		back in - the host side checks the same thing the same way (whirlpoolx_scan()), and --whirlpoolx-check will tell you if either
+		of them ever disagrees with the full hash.
+	*/
+	
+	ulong r3[WHIRLPOOLX_VECTORS], r5[WHIRLPOOLX_VECTORS];
+	
+	{
+		#if defined(WHIRLPOOLX_HOSTKEYS) && defined(WHIRLPOOLX_BITSLICED)
+		
+		h = W_BS_PLANES(roundkeys[9]);
+		
+		#elif defined(WHIRLPOOLX_HOSTKEYS)
+		
+		h = roundkeys[9];
+		
+		#elif defined(WHIRLPOOLX_BITSLICED)
+		
+		// No round constant, it's only in row 0.
+		h = W_BS_ROUND(h);
+		
+		#else
+		
+		ulong k3 = W_ROUND(h, 3, 2, 1, 0, 7, 6, 5, 4);
+		ulong k5 = W_ROUND(h, 5, 4, 3, 2, 1, 0, 7, 6);
+		
+		h.s3 = k3;
+		h.s5 = k5;
+		
+		#endif
+		
+		W_LANES
+		{
+			#ifdef WHIRLPOOLX_BITSLICED
+			
+			// Planes don't split by row, so this one is the whole round, and only rows 3 and 5 get looked at after.
+			const ulong8 t = W_BS_BYTES(W_BS_ROUND(n[j]) ^ h);
+			
+			r3[j] = t.s3;
+			r5[j] = t.s5;
+			
+			#else
+			
+			r3[j] = W_ROUND(n[j], 3, 2, 1, 0, 7, 6, 5, 4) ^ h.s3;
+			r5[j] = W_ROUND(n[j], 5, 4, 3, 2, 1, 0, 7, 6) ^ h.s5;
+			
+			#endif
+		}
 	}
 	
 	/*
@@ -304,12 +675,30 @@ __kernel void WhirlpoolX(const ulong8 midstate, const ulong input0, const ulong
 		You can not use atomic_inc() here if you like, but it's cleaner to do so, as two shares may be found at the same time, doing
 		God knows what to the output array. It's unlikely, but possible, so I use atomic_inc() whenever I make miners.
 		
+		The output is a ring with a header - the count, the capacity, an overflow counter and the abort generation, then the slots (RING_* in
+		findnonce.h, keep the two in sync). It used to be a bare array with the count at the end, and at a low enough difficulty
+		the count ran straight past it, over the counter itself and off the end of the buffer. Now every find bumps the count, only
+		the ones that got a slot below the capacity are written, and the rest are counted so the host knows what it missed.
+		
 		The original SWAP4 macro was rather stupid - their little rotate trick will be faster on CPU, but GPUs tend to prefer vector
 		operations, even if they don't have hardware vectors, like AMD's GCN cards (7xxx and up, in case you haven't done your homework.)
 		Therefore, explicit OpenCL cast to uchar4, reverse bytes, and explicit cast back to uint should be quicker, not that it matters much.
 	*/
 	
-	if((midstate.s3 ^ n.s3 ^ midstate.s5 ^ n.s5) <= target) output[atomic_inc(output+0xFF)] = as_uint(as_uchar4(gid).s3210);
+	W_LANES
+	{
+		if((midstate.s3 ^ r3[j] ^ midstate.s5 ^ r5[j]) <= target)
+		{
+			uint slot = atomic_inc(output + RING_COUNT);
+			
+			if(slot < output[RING_CAPACITY]) output[RING_SLOTS + slot] = as_uint(as_uchar4(W_NONCE(j)).s3210);
+			else atomic_inc(output + RING_OVERFLOW);
+		}
+	}
+	
+	#if WHIRLPOOLX_NONCES > 1
+	}
+	#endif
 }
 
 #endif	// WHIRLPOOLX_CL
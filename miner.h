@@ -27,6 +27,7 @@ extern char *curly;
 #include "uthash.h"
 #include "logging.h"
 #include "util.h"
+#include "sha2.h"
 #include <sys/types.h>
 #ifndef WIN32
 # include <sys/socket.h>
@@ -229,7 +230,8 @@ static inline int fsync (int fd)
  * the *_PARSE_COMMANDS macros for each listed driver.
  */
 #define DRIVER_PARSE_COMMANDS(DRIVER_ADD_COMMAND) \
-  DRIVER_ADD_COMMAND(opencl)
+  DRIVER_ADD_COMMAND(opencl) \
+  DRIVER_ADD_COMMAND(cpu)
 
 #define DRIVER_ENUM(X) DRIVER_##X,
 #define DRIVER_PROTOTYPE(X) struct device_drv X##_drv;
@@ -516,6 +518,8 @@ struct sgminer_pool_stats {
   uint64_t net_bytes_received;
 };
 
+struct _event_profile;
+
 struct cgpu_info {
   int sgminer_id;
   struct device_drv *drv;
@@ -528,6 +532,8 @@ struct cgpu_info {
   int accepted;
   int rejected;
   int hw_errors;
+  uint64_t ring_overflows;  /* found nonces the result ring had no room for */
+  double overflow_diff;  /* lowest device diff since the ring overflowed */
   double rolling;
   double total_mhashes;
   double utility;
@@ -551,14 +557,21 @@ struct cgpu_info {
 
   cl_uint vwidth;
   size_t work_size;
+  bool hostkeys;
+  bool round1pre;
+  bool bitsliced;
+  int kernel_nonces;
+  int pipeline;
+  int prepared_works;
+  struct _event_profile *event_profile;
   cl_ulong max_alloc;
   algorithm_t algorithm;
 
   int opt_lg, lookup_gap;
   size_t opt_tc, thread_concurrency;
   size_t shaders;
-  struct timeval tv_gpustart;
-  int intervals;
+  double dyn_log_threads;  /* dynamic intensity controller state */
+  double dyn_last_err;
 
   bool new_work;
 
@@ -618,6 +631,24 @@ struct thread_q {
   pthread_cond_t    cond;
 };
 
+/* Most works a mining thread keeps fetched and prepared ahead */
+#define MAX_PREPARED_WORKS 4
+#define MAX_PREPARED_WORKS_STR "4"
+
+/* Most nonces one kernel work-item hashes per launch */
+#define MAX_KERNEL_NONCES 64
+#define MAX_KERNEL_NONCES_STR "64"
+
+struct stratum_job;
+
+/* A block of nonce2 values a mining thread reserved on one stratum job, to
+ * make its own work from without touching the pool */
+struct nonce2_lease {
+  struct stratum_job *job;
+  uint64_t next;
+  uint64_t end;
+};
+
 struct thr_info {
   int   id;
   int   device_thread;
@@ -638,6 +669,12 @@ struct thr_info {
 
   bool  work_restart;
   bool  work_update;
+
+  /* Works already through prepare_work, oldest first */
+  struct work *prepared[MAX_PREPARED_WORKS];
+  int n_prepared;
+
+  struct nonce2_lease lease;
 };
 
 struct string_elist {
@@ -1011,7 +1048,11 @@ struct pool;
 extern bool opt_work_update;
 extern bool opt_protocol;
 extern bool have_longpoll;
+extern char *opt_kernel_cache_dir;
+extern int opt_kernel_cache_size;
 extern char *opt_kernel_path;
+extern bool opt_kernel_tune;
+extern char *opt_kernel_tune_file;
 extern char *opt_socks_proxy;
 
 #if defined(unix) || defined(__APPLE__)
@@ -1031,6 +1072,7 @@ extern int opt_shares;
 extern bool opt_fail_only;
 extern int opt_fail_switch_delay;
 extern int opt_watchpool_refresh;
+extern int opt_verify_threads;
 extern bool opt_autofan;
 extern bool opt_autoengine;
 extern bool use_curses;
@@ -1090,6 +1132,7 @@ typedef bool (*sha256_func)(struct thr_info*, const unsigned char *pmidstate,
 extern bool fulltest(const unsigned char *hash, const unsigned char *target);
 
 extern int opt_queue;
+extern int opt_nonce2_lease;
 extern int opt_scantime;
 extern int opt_expiry;
 
@@ -1150,7 +1193,9 @@ extern bool add_pool_details(struct pool *pool, bool live, char *url, char *user
 
 extern struct list_head scan_devices;
 extern int nDevs;
+extern bool opt_gpu_profile;
 extern int hw_errors;
+extern uint64_t ring_overflows;
 extern bool use_syslog;
 extern bool opt_quiet;
 extern struct thr_info *control_thr;
@@ -1214,6 +1259,12 @@ typedef struct _dev_blk_ctx {
   cl_uint zeroA, zeroB;
   cl_uint oneA, twoA, threeA, fourA, fiveA, sixA, sevenA;
 
+  /* WhirlpoolX kernel arguments, worked out once per work */
+  cl_ulong midstate64[8];
+  cl_ulong roundkeys64[10][8];  /* second block key schedule, for host keys */
+  cl_ulong input0, input1;
+  cl_ulong le_target;
+
   struct work *work;
 } dev_blk_ctx;
 
@@ -1245,6 +1296,40 @@ struct stratum_work {
   size_t header_len;
   int merkles;
   double diff;
+
+  /* SHA-256 state after the coinbase bytes ahead of nonce2, which only
+   * change with a notify, so each work only hashes from nonce2 on */
+  sha256_ctx cb_prefix;
+};
+
+/* Snapshot of everything work is generated from for one notify (and
+ * difficulty), never changed once made, so it can be read without the
+ * pool's data_lock. Taken with stratum_job_get and released with
+ * stratum_job_put. */
+struct stratum_job {
+  int refs;
+  unsigned int gen;
+  /* Only moves on when the job_id changes, for stale work checks */
+  unsigned int job_id_gen;
+  struct pool *pool;
+
+  char *job_id;
+  char *nonce1;
+  char *ntime;
+  char *nbit;
+  double diff;
+
+  /* Coinbase with the nonce2 gap zeroed */
+  unsigned char *coinbase;
+  size_t cb_len;
+  size_t nonce2_offset;
+  int n2size;
+  sha256_ctx cb_prefix;
+
+  unsigned char (*merkle_bin)[32];
+  int merkles;
+  unsigned char header_bin[128];
+  int merkle_offset;
 };
 
 #define RBUFSIZE 8192
@@ -1365,6 +1450,11 @@ struct pool {
   bool stratum_init;
   bool stratum_notify;
   struct stratum_work swork;
+  /* Current job and its generation, replaced under data_lock. job_gen is
+   * read unlocked by mining threads to see if their lease is still good. */
+  struct stratum_job *job;
+  unsigned int job_gen;
+  unsigned int job_id_gen;
   pthread_t stratum_sthread;
   pthread_t stratum_rthread;
   pthread_mutex_t stratum_lock;
@@ -1433,6 +1523,9 @@ struct work {
   bool    block;
 
   bool    stratum;
+  /* Stratum job the work was made from. job_id, nonce1 and ntime point
+   * into it unless they're its own copies, see clean_work() */
+  struct stratum_job *job;
   char    *job_id;
   uint64_t  nonce2;
   size_t    nonce2_len;
@@ -1448,6 +1541,9 @@ struct work {
   int   id;
   UT_hash_handle  hh;
 
+  // Extra references held on this work, see ref_work()
+  int   refs;
+
   double    work_difficulty;
 
   // Allow devices to identify work if multiple sub-devices
@@ -1479,9 +1575,11 @@ struct work {
 
 extern void get_datestamp(char *, size_t, struct timeval *);
 extern void inc_hw_errors(struct thr_info *thr);
+extern void inc_ring_overflows(struct thr_info *thr, uint32_t lost);
 extern bool test_nonce(struct work *work, uint32_t nonce);
 extern bool submit_tested_work(struct thr_info *thr, struct work *work);
 extern bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
+extern int submit_nonces(struct thr_info *thr, struct work *work, const uint32_t *nonces, int count);
 extern struct work *get_work(struct thr_info *thr, const int thr_id);
 extern void _wlog(const char *str);
 extern void _wlogprint(const char *str);
@@ -1496,6 +1594,7 @@ extern void kill_work(void);
 extern void __switch_pools(struct pool *selected, bool saveprio);
 
 extern void discard_work(struct work *work);
+extern bool stale_work(struct work *work, bool share);
 extern void remove_pool(struct pool *pool);
 //extern void write_config(FILE *fcfg);
 extern void zero_bestshare(void);
@@ -1517,6 +1616,7 @@ extern void adl(void);
 extern void app_restart(void);
 extern void clean_work(struct work *work);
 extern void free_work(struct work *work);
+extern struct work *ref_work(struct work *work);
 extern struct work *copy_work_noffset(struct work *base_work, int noffset);
 #define copy_work(work_in) copy_work_noffset(work_in, 0)
 extern struct cgpu_info *get_devices(int id);
@@ -34,6 +34,8 @@
 #include "ocl.h"
 #include "ocl/build_kernel.h"
 #include "ocl/binary_kernel.h"
+#include "ocl/kernel_tune.h"
+#include "ocl/binary_cache.h"
 
 /* FIXME: only here for global config vars, replace with configuration.h
  * or similar as soon as config is in a struct instead of littered all
@@ -135,15 +137,86 @@ out:
   return ret;
 }
 
-static cl_int create_opencl_context(cl_context *context, cl_platform_id *platform)
+// A context with just the one device this thread mines on - making it from the device type
+// drags every GPU on the platform into every context, and every initCl pays for that.
+static cl_int create_opencl_context(cl_context *context, cl_platform_id *platform, cl_device_id *device)
 {
 	cl_context_properties cps[3] = { CL_CONTEXT_PLATFORM, (cl_context_properties)*platform, 0 };
 	cl_int status;
 
-	*context = clCreateContextFromType(cps, CL_DEVICE_TYPE_GPU, NULL, NULL, &status);
+	*context = clCreateContext(cps, 1, device, NULL, NULL, &status);
 	return status;
 }
 
+// Platforms and devices don't change while we're running, so they're enumerated once, by whichever
+// GPU gets here first, instead of every initCl call asking the driver for all of it all over again.
+static pthread_mutex_t cl_devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static cl_platform_id cl_platform;
+static cl_device_id *cl_devices;
+static char **cl_device_names;
+static cl_uint cl_num_devices;
+
+static bool enumerate_cl_devices(void)
+{
+	bool ret = false;
+	int num;
+	
+	mutex_lock(&cl_devices_lock);
+	
+	if(cl_devices)
+	{
+		ret = true;
+		goto out;
+	}
+	
+	num = clDevicesNum();
+	if(num <= 0 || !get_opencl_platform(opt_platform_id, &cl_platform)) goto out;
+	
+	cl_device_id *devices = (cl_device_id *)calloc(num, sizeof(cl_device_id));
+	char **names = (char **)calloc(num, sizeof(char *));
+	
+	if(clGetDeviceIDs(cl_platform, CL_DEVICE_TYPE_GPU, num, devices, NULL) != CL_SUCCESS)
+	{
+		applog(LOG_ERR, "Error while attempting to get list of Device IDs for all GPUs present.");
+		free(devices);
+		free(names);
+		goto out;
+	}
+	
+	// Not assuming CL_DEVICE_NAME fits in 256 chars, so ask how long it is first.
+	for(int i = 0; i < num; ++i)
+	{
+		size_t tmpsize;
+		
+		if(clGetDeviceInfo(devices[i], CL_DEVICE_NAME, 0, NULL, &tmpsize) != CL_SUCCESS)
+		{
+			applog(LOG_ERR, "Error while getting the length of the name for GPU #%d.", i);
+			goto fail;
+		}
+		
+		names[i] = (char *)calloc(tmpsize + 1, 1);
+		if(clGetDeviceInfo(devices[i], CL_DEVICE_NAME, tmpsize, names[i], NULL) != CL_SUCCESS)
+		{
+			applog(LOG_ERR, "Error while attempting to get device information.");
+			goto fail;
+		}
+	}
+	
+	cl_device_names = names;
+	cl_num_devices = num;
+	cl_devices = devices;
+	ret = true;
+	goto out;
+	
+fail:
+	for(int i = 0; i < num; ++i) free(names[i]);
+	free(names);
+	free(devices);
+out:
+	mutex_unlock(&cl_devices_lock);
+	return(ret);
+}
+
 static float get_opencl_version(cl_device_id device)
 {
   /* Check for OpenCL >= 1.0 support, needed for global offset parameter usage. */
@@ -182,7 +255,10 @@ static cl_int create_opencl_command_queue(cl_command_queue *command_queue, cl_co
 	}
 	else
 	{
-		*command_queue = clCreateCommandQueueWithProperties(*context, *device, (const cl_queue_properties *)cq_properties, &status);
+		// This one takes a zero terminated property list, not the bitfield.
+		cl_queue_properties props[] = { CL_QUEUE_PROPERTIES, *((const cl_command_queue_properties *)cq_properties), 0 };
+		
+		*command_queue = clCreateCommandQueueWithProperties(*context, *device, props, &status);
 		
 		// Didn't work, same deal.
 		if(status != CL_SUCCESS) *command_queue = clCreateCommandQueueWithProperties(*context, *device, 0, &status);
@@ -202,73 +278,296 @@ static cl_int create_opencl_command_queue(cl_command_queue *command_queue, cl_co
 
 
 
-_clState *initCl(unsigned int gpu, char *name, size_t nameSize, algorithm_t *algorithm)
+/*
+	Known-answer test for the optional kernel modes: hash one workgroup's worth of nonces of a fixed
+	header on the CPU with the algorithm's own regenhash, set the target to the lowest result, and
+	check the kernel reports that nonce and nothing else. Costs one tiny launch, and works on any
+	OpenCL runtime, so a mode can be validated on pocl before it's ever let near a pool. With more
+	than one nonce per work-item, the workgroup covers that many times the nonces, so the CPU does too.
+*/
+static bool kernel_self_test(_clState *clState, algorithm_t *algorithm)
 {
-	cl_int status = 0;
-	size_t compute_units = 0;
-	cl_platform_id platform = NULL;
-	struct cgpu_info *cgpu = &gpus[gpu];
-	_clState *clState = (_clState *)calloc(1, sizeof(_clState));
-	cl_uint preferred_vwidth, slot = 0, cpnd = 0, numDevices = clDevicesNum();
-	cl_device_id *devices = (cl_device_id *)alloca(numDevices * sizeof(cl_device_id));
-	build_kernel_data *build_data = (build_kernel_data *)alloca(sizeof(struct _build_kernel_data));
-	unsigned char **pbuff = (unsigned char **)alloca(sizeof(unsigned char *) * numDevices), filename[256];
+	struct work *work = (struct work *)calloc(1, sizeof(struct work));
+	uint32_t res[BUFFERSIZE / sizeof(uint32_t)] = { 0 };
+	size_t globalThreads = clState->wsize, offset = 0;
+	uint64_t best = UINT64_MAX;
+	uint32_t bestnonce = 0;
+	cl_int status;
 	
-	// pbuff and filename were originally char buffers, but I prefer to KNOW if my char buffers are unsigned or not...
-	// Anyways, get the platform and sanity check some shit.
-
-	if(!get_opencl_platform(opt_platform_id, &platform)) return NULL;
-	if(numDevices <= 0) return NULL;
+	if(!work) return false;
+	
+	for(int i = 0; i < 80; ++i) work->data[i] = (unsigned char)(i * 0x9D + 0x3B);
+	
+	for(uint32_t gid = 0; gid < globalThreads * clState->vwidth * clState->nonces; ++gid)
+	{
+		*((uint32_t *)(work->data + 76)) = swab32(gid);
+		algorithm->regenhash(work);
 		
-	// You don't need to use the status variable if you're just checking one call, inline the fucker!
-	// It's slightly more ambiguous, but users will have no idea what the code means, anyway - would
-	// probably be better for debugging to resolve it to a string.
-	if(clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, numDevices, devices, NULL) != CL_SUCCESS)
+		if(*((uint64_t *)(work->hash + 24)) < best)
+		{
+			best = *((uint64_t *)(work->hash + 24));
+			bestnonce = swab32(gid);
+		}
+	}
+	
+	memcpy(work->device_target + 24, &best, sizeof(best));
+	work->blk.work = work;
+	if(algorithm->prepare_work) algorithm->prepare_work(&work->blk);
+	
+	ring_clear(res);
+	status = clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffer, CL_TRUE, 0, BUFFERSIZE, res, 0, NULL, NULL);
+	status |= algorithm->queue_kernel(clState, &work->blk, globalThreads);
+	status |= clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel, 1, &offset, &globalThreads, &clState->wsize, 0, NULL, NULL);
+	status |= clEnqueueReadBuffer(clState->commandQueue, clState->outputBuffer, CL_TRUE, 0, BUFFERSIZE, res, 0, NULL, NULL);
+	
+	free(work);
+	
+	if(status != CL_SUCCESS)
 	{
-		applog(LOG_ERR, "Error while attempting to get list of Device IDs for all GPUs present.");
-		return NULL;
+		applog(LOG_ERR, "Error %d while running the kernel known-answer test.", status);
+		return false;
 	}
 	
-	// IMO, this is cleaner, at the expense of a very slightly more ambiguous debugging statement.
-	// NOW we can use the status variable.
+	applog(LOG_DEBUG, "Known-answer test: expected nonce %08x, kernel found %u nonce(s), first %08x.", bestnonce, res[RING_COUNT], res[RING_SLOTS]);
 	
-	applog(LOG_INFO, "List of devices: ");
+	return(res[RING_COUNT] == 1 && res[RING_SLOTS] == bestnonce);
+}
+
+// The binary name is the kernel name, the device name, and a tag for every option that changes the
+// compiled code - worksize, the algorithm's kernel modes, and the tuned variant - so no two builds
+// ever share a .bin. Expects build_data->work_size to be set already.
+static void set_build_names(build_kernel_data *build_data, const char *filename, const char *devname, struct cgpu_info *cgpu, algorithm_t *algorithm, const kernel_variant *variant)
+{
+	strcpy(build_data->binary_filename, filename);
+	build_data->binary_filename[strlen(filename) - 3] = 0x00;		// And one NULL terminator, cutting off the .cl suffix.
+
+	strcat(build_data->binary_filename, devname);
 	
-	/*
-		You may think the original way of doing this was better - it certainly used less memory,
-		as it didn't store all of the GPU names. However, it also assumed that the response to
-		the CL_DEVICE_NAME query would always be less than 256 chars - something I am not sure
-		will always be true.
-	*/
+	// clState->goffset is always set for WhirlpoolX, no if statement necessary.
+	strcat(build_data->binary_filename, "g");
+	
+	set_base_compiler_options(build_data);
+	if(algorithm->set_compile_options) algorithm->set_compile_options(build_data, cgpu, algorithm);
+	kernel_variant_options(build_data, variant);
+
+	strcat(build_data->binary_filename, ".bin");
+	applog(LOG_DEBUG, "Using binary file %s", build_data->binary_filename);
+}
+
+// Load program from the binary cache or build it if it isn't there. The cache is keyed
+// on a hash of the kernel source, every compiler option, the platform, the device and the
+// driver version - the old way of trusting whatever .bin had the right name handed out stale
+// binaries any time the kernel or the driver changed under it.
+static cl_program get_program(build_kernel_data *build_data, const char *filename)
+{
+	char key[BINARY_CACHE_KEY_LEN];
+	cl_program program = NULL;
+	bool cache = opt_kernel_cache_size > 0 && binary_cache_key(build_data, key);
 	
-	for(int i = 0; i < numDevices; ++i)
+	// Identical cards come up at the same time, and there's no sense in all of them building the
+	// same thing - the first one builds it, the rest wait here and get it out of the cache.
+	if(cache)
 	{
-		size_t tmpsize;
-		if(clGetDeviceInfo(devices[i], CL_DEVICE_NAME, 0, NULL, &tmpsize) != CL_SUCCESS)
-		{
-			applog(LOG_ERR, "Error while getting the length of the name for GPU #%d.", i);
-			return NULL;
-		}
+		binary_cache_build_lock(key);
+		program = binary_cache_load(build_data, key);
+	}
+	
+	// Couldn't find a bin, build the kernel from source.
+	if(!program)
+	{
+		applog(LOG_NOTICE, "Building binary %s", build_data->binary_filename);
 		
-		// Does the size include the NULL terminator? Who knows, just add one, it's faster than looking it up.
-		pbuff[i] = (unsigned char *)alloca(sizeof(unsigned char) * (tmpsize + 1));
-		status |= clGetDeviceInfo(devices[i], CL_DEVICE_NAME, sizeof(unsigned char) * tmpsize, pbuff[i], NULL);
+		program = build_opencl_kernel(build_data, filename);
+		if(program && cache) binary_cache_store(build_data, key, program);
 	}
 	
-	// I really wanna change CL_SUCCESS to zero and make it if(status), but this would be bad form.
-	// Were OpenCL to change the definition of CL_SUCCESS (like that'll ever happen), it'd break the code.
+	if(cache) binary_cache_build_unlock(key);
+	
+	return(program);
+}
+
+#define TUNE_LAUNCH_NONCES		(1U << 20)
+#define TUNE_LAUNCHES			16
+
+/*
+	Times whatever kernel clState currently holds over a fixed range of nonces - one warm up launch that isn't
+	counted, then TUNE_LAUNCHES of TUNE_LAUNCH_NONCES each, waiting for every one to finish, like the miner
+	does. The header is junk and the target is zero, so nothing gets written to the output buffer. Returns MH/s,
+	or a negative number if anything failed. Work-items that hash more than one nonce each get launched that
+	many times fewer, so every variant is timed over the same nonces.
+*/
+static double time_kernel(_clState *clState, algorithm_t *algorithm)
+{
+	struct work *work = (struct work *)calloc(1, sizeof(struct work));
+	uint32_t blank[BUFFERSIZE / sizeof(uint32_t)] = { 0 };
+	size_t globalThreads = TUNE_LAUNCH_NONCES / (clState->vwidth * clState->nonces), offset = 0;
+	struct timeval tv_start, tv_end;
+	cl_int status;
+	
+	if(!work) return(-1.0);
+	
+	for(int i = 0; i < 80; ++i) work->data[i] = (unsigned char)(i * 0x3D + 0x11);
+	work->blk.work = work;
+	if(algorithm->prepare_work) algorithm->prepare_work(&work->blk);
+	
+	ring_clear(blank);
+	status = clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffer, CL_TRUE, 0, BUFFERSIZE, blank, 0, NULL, NULL);
+	status |= algorithm->queue_kernel(clState, &work->blk, globalThreads);
+	status |= clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel, 1, &offset, &globalThreads, &clState->wsize, 0, NULL, NULL);
+	status |= clFinish(clState->commandQueue);
+	
+	cgtime(&tv_start);
+	
+	for(int i = 1; i <= TUNE_LAUNCHES && status == CL_SUCCESS; ++i)
+	{
+		offset = (size_t)i * TUNE_LAUNCH_NONCES;
+		status |= clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel, 1, &offset, &globalThreads, &clState->wsize, 0, NULL, NULL);
+		status |= clFinish(clState->commandQueue);
+	}
 	
-	// Heh, actually... my little OR trick only works if CL_SUCCESS is defined to zero.
-	// Note to self: Fix that shit.
+	cgtime(&tv_end);
+	free(work);
 	
 	if(status != CL_SUCCESS)
 	{
-		applog(LOG_ERR, "Error while attempting to get device information.");
-		return NULL;
+		applog(LOG_ERR, "Error %d while timing a kernel variant.", status);
+		return(-1.0);
+	}
+	
+	return((double)TUNE_LAUNCHES * TUNE_LAUNCH_NONCES / tdiff(&tv_end, &tv_start) / 1e6);
+}
+
+/*
+	The tuner. Every combination of LDS table count, round loop unroll factor, and worksize - plus reading
+	the tables straight out of constant memory, and the bitsliced kernel that has no tables at all, for which
+	the table count doesn't matter - gets built from source, checked against the CPU hash, and timed on the
+	real card. Round 1 precompute needs the tables, so with it on, the bitsliced kernel sits this one out. A user-specified worksize is kept, not
+	tuned. The winner goes in best; the kernel handle and worksize in clState are borrowed for the timing
+	runs, and put back the way they were.
+*/
+static bool tune_kernel(_clState *clState, build_kernel_data *build_data, const char *filename, const char *devname, struct cgpu_info *cgpu, algorithm_t *algorithm, unsigned int gpu, kernel_variant *best, double *best_mhs)
+{
+	static const size_t worksizes[] = { 64, 128, 256 };
+	// 0 tables is constant memory, -1 is none, the bitsliced kernel.
+	static const int tables[] = { 2, 4, 0, -1 }, unrolls[] = { 1, 2 };
+	cl_kernel orig_kernel = clState->kernel;
+	size_t orig_wsize = clState->wsize;
+	int tried = 0;
+	
+	*best_mhs = 0.0;
+	
+	for(int w = 0; w < sizeof(worksizes) / sizeof(worksizes[0]); ++w)
+	{
+		if(cgpu->work_size && worksizes[w] != orig_wsize) continue;
+		if(worksizes[w] > clState->max_work_size) continue;
+		
+		for(int t = 0; t < sizeof(tables) / sizeof(tables[0]); ++t)
+		{
+			if(tables[t] < 0 && clState->round1pre) continue;
+			
+			// --bitsliced builds every variant without tables anyway, no need to time it four times over.
+			if(tables[t] >= 0 && cgpu->bitsliced) continue;
+			
+			for(int u = 0; u < sizeof(unrolls) / sizeof(unrolls[0]); ++u)
+			{
+				kernel_variant variant = { (tables[t] > 0) ? tables[t] : 0, unrolls[u], !tables[t], tables[t] < 0, worksizes[w] };
+				cl_program program;
+				cl_kernel kernel;
+				cl_int status;
+				char desc[96];
+				double mhs;
+				
+				kernel_variant_str(&variant, desc, sizeof(desc));
+				
+				build_data->work_size = variant.work_size;
+				set_build_names(build_data, filename, devname, cgpu, algorithm, &variant);
+				
+				// Straight from source, and not saved - only the winner gets a .bin.
+				program = build_opencl_kernel(build_data, filename);
+				if(!program)
+				{
+					applog(LOG_WARNING, "GPU %d: tuning: %s failed to build, skipping it.", gpu, desc);
+					continue;
+				}
+				
+				kernel = clCreateKernel(program, "WhirlpoolX", &status);
+				if(status != CL_SUCCESS)
+				{
+					clReleaseProgram(program);
+					continue;
+				}
+				
+				clState->kernel = kernel;
+				clState->wsize = variant.work_size;
+				clState->args_set = false;
+				
+				if(!kernel_self_test(clState, algorithm))
+				{
+					applog(LOG_WARNING, "GPU %d: tuning: %s failed its known-answer test, skipping it.", gpu, desc);
+					mhs = -1.0;
+				}
+				else
+				{
+					mhs = time_kernel(clState, algorithm);
+					if(mhs >= 0.0) applog(LOG_NOTICE, "GPU %d: tuning: %s: %.2f MH/s", gpu, desc, mhs);
+				}
+				
+				clReleaseKernel(kernel);
+				clReleaseProgram(program);
+				
+				if(mhs > *best_mhs)
+				{
+					*best = variant;
+					*best_mhs = mhs;
+				}
+				
+				++tried;
+			}
+		}
 	}
 	
-	// Print list of devices...
-	for(int i = 0; i < numDevices; ++i) applog(LOG_INFO, "\t%i\t%s", i, pbuff[i]);
+	clState->kernel = orig_kernel;
+	clState->wsize = orig_wsize;
+	clState->args_set = false;
+	
+	if(*best_mhs <= 0.0)
+	{
+		applog(LOG_ERR, "GPU %d: tuning found no working kernel variant out of %d tried.", gpu, tried);
+		return(false);
+	}
+	
+	return(true);
+}
+
+_clState *initCl(unsigned int gpu, char *name, size_t nameSize, algorithm_t *algorithm)
+{
+	cl_int status = 0;
+	size_t compute_units = 0;
+	cl_platform_id platform = NULL;
+	struct cgpu_info *cgpu = &gpus[gpu];
+	_clState *clState = (_clState *)calloc(1, sizeof(_clState));
+	cl_uint numDevices;
+	cl_device_id *devices;
+	build_kernel_data *build_data = (build_kernel_data *)alloca(sizeof(struct _build_kernel_data));
+	unsigned char **pbuff, filename[256];
+	static bool tuned_this_run[MAX_GPUDEVICES];
+	kernel_variant variant = { 0 };
+	char driver[256] = "";
+	bool tuned = false;
+	struct timeval tv_start, tv_context, tv_program, tv_end;
+	cl_command_queue_properties cq_properties;
+	
+	cgtime(&tv_start);
+	
+	// pbuff and filename were originally char buffers, but I prefer to KNOW if my char buffers are unsigned or not...
+	// Anyways, get the platform and sanity check some shit.
+
+	if(!enumerate_cl_devices()) return NULL;
+	
+	platform = cl_platform;
+	numDevices = cl_num_devices;
+	devices = cl_devices;
+	pbuff = (unsigned char **)cl_device_names;
 	
 	applog(LOG_INFO, "Selected %d: %s", gpu, pbuff[gpu]);
 
@@ -281,8 +580,14 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize, algorithm_t *alg
 	// Again, far cleaner, only slightly more ambiguous errors.
 	status = 0;
 	
-	status |= create_opencl_context(&clState->context, &platform);
-	status |= create_opencl_command_queue(&clState->commandQueue, &clState->context, &devices[gpu], (const void *)&(cgpu->algorithm.cq_properties));
+	status |= create_opencl_context(&clState->context, &platform, &devices[gpu]);
+	// Dynamic intensity times the kernel with profiling events, too.
+	cq_properties = cgpu->algorithm.cq_properties | ((opt_gpu_profile || cgpu->dynamic) ? CL_QUEUE_PROFILING_ENABLE : 0);
+	status |= create_opencl_command_queue(&clState->commandQueue, &clState->context, &devices[gpu], (const void *)&cq_properties);
+	
+	// A second, plain queue, just so the restart thread can write the abort generation while the kernel is
+	// still running on the first one - anything enqueued behind the kernel would only land after it's done.
+	if(status == CL_SUCCESS) clState->abortQueue = clCreateCommandQueue(clState->context, devices[gpu], 0, &status);
 	
 	if(status != CL_SUCCESS)
 	{
@@ -290,6 +595,18 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize, algorithm_t *alg
 		return NULL;
 	}
 	
+	// The queue silently loses its properties if the driver won't take them, so ask what we got.
+	if(opt_gpu_profile || cgpu->dynamic)
+	{
+		cq_properties = 0;
+		clGetCommandQueueInfo(clState->commandQueue, CL_QUEUE_PROPERTIES, sizeof(cq_properties), &cq_properties, NULL);
+		clState->profiling = (cq_properties & CL_QUEUE_PROFILING_ENABLE) != 0;
+		
+		if(!clState->profiling) applog(LOG_WARNING, "GPU %d: the driver refused a profiling command queue, no kernel timing events for it.", gpu);
+	}
+	
+	cgtime(&tv_context);
+	
 	// If it doesn't have bitalign support, you shouldn't be mining with it, goddamnit.
 	clState->hasBitAlign = true;
 		
@@ -334,8 +651,13 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize, algorithm_t *alg
 
 	applog(LOG_INFO, "Using source file %s.", filename);
 
-	// Doesn't make sense for Whirlpool, but may as well set it for completeness.
-	cgpu->vwidth = clState->vwidth = 1;
+	// Used to be forced to 1 - now it's how many nonces each work-item hashes side by side, see the kernel.
+	if(cgpu->vwidth != 2 && cgpu->vwidth != 4) cgpu->vwidth = 1;
+	clState->vwidth = cgpu->vwidth;
+	
+	clState->hostkeys = cgpu->hostkeys;
+	clState->round1pre = cgpu->round1pre;
+	clState->nonces = cgpu->kernel_nonces > 1 ? cgpu->kernel_nonces : 1;
 
 	clState->goffset = true;
 	
@@ -345,12 +667,41 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize, algorithm_t *alg
 	
 	clState->wsize = (cgpu->work_size && cgpu->work_size <= clState->max_work_size) ? cgpu->work_size : 256;
 	
+	// An earlier --kernel-tune run may have left the best variant for this card, under this driver, in the
+	// tuning cache. A new driver means a new compiler, so it has to be tuned again. The tuned worksize only
+	// counts if the user didn't pick one. With --kernel-tune, the first thread on each GPU retunes it.
+	clGetDeviceInfo(devices[gpu], CL_DRIVER_VERSION, sizeof(driver) - 1, driver, NULL);
+	
+	if((!opt_kernel_tune || tuned_this_run[gpu]) && tune_cache_lookup(opt_kernel_tune_file, (char *)pbuff[gpu], driver, &variant))
+	{
+		char desc[96];
+		
+		if(!cgpu->work_size && variant.work_size && variant.work_size <= clState->max_work_size) clState->wsize = variant.work_size;
+		variant.work_size = clState->wsize;
+		tuned = true;
+		
+		applog(LOG_INFO, "GPU %d: using tuned kernel variant: %s.", gpu, kernel_variant_str(&variant, desc, sizeof(desc)));
+	}
+	
+	// Round 1 precompute is four table lookups in the kernel, and the bitsliced one doesn't have any tables.
+	if(clState->round1pre && (cgpu->bitsliced || variant.bitsliced))
+	{
+		applog(LOG_WARNING, "GPU %d: round 1 precompute doesn't work with the bitsliced kernel, turning it off.", gpu);
+		cgpu->round1pre = clState->round1pre = false;
+	}
+	
 	build_data->context = clState->context;
 	build_data->device = devices + gpu;
 
 	// Build information
 	strcpy(build_data->source_filename, filename);
 	strcpy(build_data->platform, name);
+	
+	// All of these go into the binary cache key.
+	build_data->platform_name[0] = '\0';
+	clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(build_data->platform_name) - 1, build_data->platform_name, NULL);
+	snprintf(build_data->device_name, sizeof(build_data->device_name), "%s", (char *)pbuff[gpu]);
+	strcpy(build_data->driver_version, driver);
 	strcpy(build_data->sgminer_path, sgminer_path);
 	
 	// If opt_kernel_path is NULL, instead of assigning kernel_path to opt_kernel_path (again, NULL) - you explicitly assign
@@ -377,38 +728,16 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize, algorithm_t *alg
 
 	//strcpy(build_data->binary_filename, (!empty_string(cgpu->algorithm.kernelfile)?cgpu->algorithm.kernelfile:cgpu->algorithm.name));
 
-	strcpy(build_data->binary_filename, filename);
-	build_data->binary_filename[strlen(filename) - 3] = 0x00;		// And one NULL terminator, cutting off the .cl suffix.
-
-	strcat(build_data->binary_filename, pbuff[gpu]);
-	
-	// clState->goffset is always set for WhirlpoolX, no if statement necessary.
-	strcat(build_data->binary_filename, "g");
-	
-	set_base_compiler_options(build_data);
-	if(algorithm->set_compile_options) algorithm->set_compile_options(build_data, cgpu, algorithm);
-
-	strcat(build_data->binary_filename, ".bin");
-	applog(LOG_DEBUG, "Using binary file %s", build_data->binary_filename);
+	set_build_names(build_data, (char *)filename, (char *)pbuff[gpu], cgpu, algorithm, &variant);
 
-	// Load program from file or build it if it doesn't exist...
-	
 	// I think it's more readable to remove this from the if statement, as well as doing the 
 	// same for the build_opencl_kernel call, but it's really a style thing, so I don't fault
 	// the original author(s) for it.
 	
-	clState->program = load_opencl_binary_kernel(build_data);
+	clState->program = get_program(build_data, (char *)filename);
+	if(!clState->program) return NULL;
 	
-	// Couldn't find a bin, build the kernel from source.
-	if(!clState->program)
-	{
-		applog(LOG_NOTICE, "Building binary %s", build_data->binary_filename);
-		
-		clState->program = build_opencl_kernel(build_data, filename);
-		if(!clState->program) return NULL;
-		
-		save_opencl_kernel(build_data, clState->program);
-	}
+	cgtime(&tv_program);
 
 	// Load kernel - so much simpler without checking for BFI support (all cards that are
 	// worth mining with have it), and removing the support for the very obsolete binary
@@ -426,13 +755,89 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize, algorithm_t *alg
 	
 	applog(LOG_DEBUG, "Using output buffer sized %lu", BUFFERSIZE);
 	
-	clState->outputBuffer = clCreateBuffer(clState->context, CL_MEM_WRITE_ONLY, BUFFERSIZE, NULL, &status);
+	// Not write only - the kernel reads the ring's capacity back out of it.
+	clState->outputBuffer = clCreateBuffer(clState->context, CL_MEM_READ_WRITE, BUFFERSIZE, NULL, &status);
 	
 	if(status != CL_SUCCESS)
 	{
 		applog(LOG_ERR, "Error creating output buffer.");
 		return NULL;
 	}
+	
+	clState->AbortBuf = clCreateBuffer(clState->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(clState->abort_gen), &clState->abort_gen, &status);
+	
+	if(status != CL_SUCCESS)
+	{
+		applog(LOG_ERR, "Error creating abort buffer.");
+		return NULL;
+	}
+	
+	if(clState->hostkeys)
+	{
+		clState->KeyScheduleBuf = clCreateBuffer(clState->context, CL_MEM_READ_ONLY, sizeof(cl_ulong) * 10 * 8, NULL, &status);
+		
+		if(status != CL_SUCCESS)
+		{
+			applog(LOG_ERR, "Error creating key schedule buffer.");
+			return NULL;
+		}
+	}
+	
+	if(opt_kernel_tune && !tuned_this_run[gpu])
+	{
+		kernel_variant best;
+		double best_mhs;
+		char desc[96];
+		
+		applog(LOG_NOTICE, "GPU %d: tuning the kernel, this will take a while...", gpu);
+		tuned_this_run[gpu] = true;
+		
+		if(tune_kernel(clState, build_data, (char *)filename, (char *)pbuff[gpu], cgpu, algorithm, gpu, &best, &best_mhs))
+		{
+			applog(LOG_NOTICE, "GPU %d: best kernel variant: %s, %.2f MH/s.", gpu, kernel_variant_str(&best, desc, sizeof(desc)), best_mhs);
+			tune_cache_store(opt_kernel_tune_file, (char *)pbuff[gpu], driver, &best, best_mhs);
+			
+			// Swap the winner in, through the usual path, so it gets a .bin for next time.
+			build_data->work_size = best.work_size;
+			set_build_names(build_data, (char *)filename, (char *)pbuff[gpu], cgpu, algorithm, &best);
+			
+			clReleaseKernel(clState->kernel);
+			clReleaseProgram(clState->program);
+			
+			clState->program = get_program(build_data, (char *)filename);
+			if(!clState->program) return NULL;
+			
+			clState->kernel = clCreateKernel(clState->program, "WhirlpoolX", &status);
+			if(status != CL_SUCCESS)
+			{
+				applog(LOG_ERR, "Error creating WhirlpoolX kernel with clCreateKernel.");
+				return NULL;
+			}
+			
+			clState->wsize = best.work_size;
+			clState->args_set = false;
+			tuned = true;
+		}
+	}
+	
+	// Any mode that moves part of the hash to the host, any kernel doing more than one nonce per work-item, the
+	// bitsliced kernel, and any tuned kernel, gets checked against the CPU before it mines.
+	if(clState->hostkeys || clState->round1pre || clState->nonces > 1 || clState->vwidth > 1 || cgpu->bitsliced || tuned)
+	{
+		const char *mode = tuned ? "tuned" : cgpu->bitsliced ? "bitsliced" : ((clState->hostkeys && clState->round1pre) ? "host keys + round 1 precompute" : (clState->hostkeys ? "host keys" : (clState->round1pre ? "round 1 precompute" : "multi-nonce")));
+		
+		if(!kernel_self_test(clState, algorithm))
+		{
+			applog(LOG_ERR, "GPU %d: %s kernel failed its known-answer test against the CPU hash.", gpu, mode);
+			return NULL;
+		}
+		
+		applog(LOG_INFO, "GPU %d: %s kernel passed its known-answer test.", gpu, mode);
+	}
+	
+	cgtime(&tv_end);
+	applog(LOG_NOTICE, "GPU %d: initialised in %.2fs (context %.2fs, program %.2fs, kernel and buffers %.2fs).", gpu,
+		tdiff(&tv_end, &tv_start), tdiff(&tv_context, &tv_start), tdiff(&tv_program, &tv_context), tdiff(&tv_end, &tv_program));
 
 	return clState;
 }
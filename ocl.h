@@ -18,18 +18,35 @@ typedef struct __clState {
   cl_kernel *extra_kernels;
   size_t n_extra_kernels;
   cl_command_queue commandQueue;
+  cl_command_queue abortQueue;  /* only writes abort_gen to AbortBuf */
   cl_program program;
   cl_mem outputBuffer;
   cl_mem CLbuffer0;
   cl_mem MidstateBuf;
   cl_mem padbuffer8;
+  cl_mem KeyScheduleBuf;
+  cl_mem AbortBuf;
+  cl_uint abort_gen;  /* bumped on restarts, launches carry it */
+  cl_uint launch_gen;  /* abort_gen as the next launch took it */
+  struct work *gen_work;  /* the work launch_gen was taken for */
+  cl_uint arg_gen;
   unsigned char cldata[80];
+  cl_ulong arg_midstate[8];
+  cl_ulong arg_round1[8], arg_key1[8];
+  cl_ulong arg_input0, arg_input1;
+  cl_ulong arg_target;
+  cl_mem arg_output;
+  bool args_set;
   bool hasBitAlign;
   bool goffset;
   cl_uint vwidth;
   size_t max_work_size;
   size_t wsize;
   size_t compute_shaders;
+  bool hostkeys;
+  bool round1pre;
+  cl_uint nonces;
+  bool profiling;
 } _clState;
 
 extern int clDevicesNum(void);
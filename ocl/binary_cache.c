@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "binary_cache.h"
+#include "binary_kernel.h"
+#include "miner.h"
+#include "sha2.h"
+
+/* Kernel binaries are stored as <dir>/<key>.bin, where the key is a hash of
+ * the kernel source, the complete compiler options, the platform, device
+ * and driver version, so a changed kernel or driver can never pick up a
+ * stale binary. <dir>/index.txt has one tab separated line per binary:
+ *
+ *   <key> <size> <sha256 of the binary> <last used> <name>
+ *
+ * Last used is a sequence number, the lowest is evicted first once there
+ * are more than --kernel-cache-size entries. The name is the old binary
+ * file name, only for people reading the index. */
+
+/* Bump when anything about how binaries are made changes without the
+ * source or options changing, e.g. the BFI patch */
+#define BINARY_CACHE_VERSION "sgminer-binary-cache-1"
+
+#define BINARY_CACHE_INDEX "index.txt"
+#define BINARY_CACHE_LINE_MAX 512
+
+typedef struct _cache_entry {
+  char key[BINARY_CACHE_KEY_LEN];
+  size_t size;
+  char sum[BINARY_CACHE_KEY_LEN];
+  unsigned long long last_used;
+  char name[256];
+} cache_entry;
+
+/* GPU threads are initialised in parallel */
+static pthread_mutex_t binary_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Keys some thread is building right now. Identical GPUs initialised
+ * together have the same key, so all but the first wait for its build and
+ * then load the binary it cached, instead of all building the same
+ * program at once. */
+#define MAX_BUILDING (MAX_GPUDEVICES * 4)
+
+static pthread_mutex_t building_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t building_cond = PTHREAD_COND_INITIALIZER;
+static char building[MAX_BUILDING][BINARY_CACHE_KEY_LEN];
+
+static void sha256_hex(const unsigned char *buf, size_t len, char *hex)
+{
+  unsigned char digest[SHA256_DIGEST_SIZE];
+
+  sha256(buf, (unsigned int)len, digest);
+  __bin2hex(hex, digest, SHA256_DIGEST_SIZE);
+}
+
+static void hash_field(sha256_ctx *ctx, const char *str, size_t len)
+{
+  /* Include the NUL so no two sets of fields hash the same */
+  sha256_update(ctx, (const unsigned char *)str, (unsigned int)len);
+  sha256_update(ctx, (const unsigned char *)"", 1);
+}
+
+bool binary_cache_key(build_kernel_data *data, char *key)
+{
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  sha256_ctx ctx;
+  char *source;
+  int length;
+
+  source = read_kernel_source(data, &length);
+  if (!source)
+    return false;
+
+  sha256_init(&ctx);
+  hash_field(&ctx, BINARY_CACHE_VERSION, strlen(BINARY_CACHE_VERSION));
+  hash_field(&ctx, source, length);
+  hash_field(&ctx, data->compiler_options, strlen(data->compiler_options));
+  hash_field(&ctx, data->platform_name, strlen(data->platform_name));
+  hash_field(&ctx, data->device_name, strlen(data->device_name));
+  hash_field(&ctx, data->driver_version, strlen(data->driver_version));
+  hash_field(&ctx, data->patch_bfi ? "bfi" : "", data->patch_bfi ? 3 : 0);
+  sha256_final(&ctx, digest);
+  free(source);
+
+  __bin2hex(key, digest, SHA256_DIGEST_SIZE);
+  return true;
+}
+
+static void cache_path(char *path, size_t len, const char *name)
+{
+  snprintf(path, len, "%s/%s", opt_kernel_cache_dir, name);
+}
+
+static void binary_path(char *path, size_t len, const char *key)
+{
+  snprintf(path, len, "%s/%s.bin", opt_kernel_cache_dir, key);
+}
+
+static bool parse_cache_line(char *line, cache_entry *entry)
+{
+  char *fields[5];
+  int i;
+
+  if (line[0] == '#' || line[0] == '\n' || !line[0])
+    return false;
+
+  line[strcspn(line, "\r\n")] = '\0';
+
+  fields[0] = line;
+  for (i = 1; i < 5; i++) {
+    char *tab = strchr(fields[i - 1], '\t');
+
+    if (!tab)
+      return false;
+    *tab = '\0';
+    fields[i] = tab + 1;
+  }
+
+  if (strlen(fields[0]) != BINARY_CACHE_KEY_LEN - 1 || strlen(fields[2]) != BINARY_CACHE_KEY_LEN - 1)
+    return false;
+
+  strcpy(entry->key, fields[0]);
+  entry->size = strtoul(fields[1], NULL, 10);
+  strcpy(entry->sum, fields[2]);
+  entry->last_used = strtoull(fields[3], NULL, 10);
+  snprintf(entry->name, sizeof(entry->name), "%s", fields[4]);
+  return entry->size > 0;
+}
+
+/* Returns a malloced array of the index entries, NULL and 0 entries if
+ * there's no index yet */
+static cache_entry *read_index(int *count)
+{
+  char path[PATH_MAX], line[BINARY_CACHE_LINE_MAX];
+  cache_entry *entries = NULL, entry;
+  int n = 0, alloced = 0;
+  FILE *in;
+
+  *count = 0;
+  cache_path(path, sizeof(path), BINARY_CACHE_INDEX);
+  in = fopen(path, "r");
+  if (!in)
+    return NULL;
+
+  while (fgets(line, sizeof(line), in)) {
+    if (!parse_cache_line(line, &entry))
+      continue;
+    if (n == alloced) {
+      alloced = alloced ? alloced * 2 : 16;
+      entries = (cache_entry *)realloc(entries, alloced * sizeof(cache_entry));
+      if (unlikely(!entries))
+        quit(1, "Failed to realloc in read_index");
+    }
+    entries[n++] = entry;
+  }
+  fclose(in);
+
+  *count = n;
+  return entries;
+}
+
+static bool write_index(const cache_entry *entries, int count)
+{
+  char path[PATH_MAX], tmpname[PATH_MAX];
+  FILE *out;
+  int i;
+
+  cache_path(path, sizeof(path), BINARY_CACHE_INDEX);
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", path);
+
+  out = fopen(tmpname, "w");
+  if (!out) {
+    applog(LOG_DEBUG, "Unable to create %s", tmpname);
+    return false;
+  }
+
+  fputs("# sgminer kernel binary cache index\n", out);
+  for (i = 0; i < count; i++)
+    fprintf(out, "%s\t%lu\t%s\t%llu\t%s\n", entries[i].key, (unsigned long)entries[i].size,
+      entries[i].sum, entries[i].last_used, entries[i].name);
+
+  if (fclose(out)) {
+    applog(LOG_ERR, "Error writing the kernel cache index to %s", tmpname);
+    return false;
+  }
+
+#ifdef WIN32
+  remove(path);
+#endif
+  if (rename(tmpname, path)) {
+    applog(LOG_ERR, "Unable to replace kernel cache index %s", path);
+    return false;
+  }
+
+  return true;
+}
+
+static int find_entry(const cache_entry *entries, int count, const char *key)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    if (!strcmp(entries[i].key, key))
+      return i;
+  return -1;
+}
+
+static unsigned long long next_use(const cache_entry *entries, int count)
+{
+  unsigned long long last = 0;
+  int i;
+
+  for (i = 0; i < count; i++)
+    if (entries[i].last_used > last)
+      last = entries[i].last_used;
+  return last + 1;
+}
+
+static void remove_entry(cache_entry *entries, int *count, int idx)
+{
+  char path[PATH_MAX];
+
+  binary_path(path, sizeof(path), entries[idx].key);
+  remove(path);
+  memmove(&entries[idx], &entries[idx + 1], (*count - idx - 1) * sizeof(cache_entry));
+  (*count)--;
+}
+
+/* Returns the binary for key if it's in the index and its checksum still
+ * matches, the binary and its index entry are dropped if it doesn't */
+static unsigned char *read_cached_binary(cache_entry *entries, int *count, int idx, size_t *size)
+{
+  char path[PATH_MAX], sum[BINARY_CACHE_KEY_LEN];
+  unsigned char *binary;
+  struct stat binary_stat;
+  FILE *in;
+
+  binary_path(path, sizeof(path), entries[idx].key);
+  if (stat(path, &binary_stat) || (size_t)binary_stat.st_size != entries[idx].size) {
+    applog(LOG_WARNING, "Kernel cache binary %s is missing or has the wrong size, discarding it", path);
+    goto bad;
+  }
+
+  binary = (unsigned char *)malloc(entries[idx].size);
+  if (unlikely(!binary))
+    quit(1, "Failed to malloc in read_cached_binary");
+
+  in = fopen(path, "rb");
+  if (!in || fread(binary, 1, entries[idx].size, in) != entries[idx].size) {
+    applog(LOG_WARNING, "Unable to read kernel cache binary %s, discarding it", path);
+    if (in)
+      fclose(in);
+    free(binary);
+    goto bad;
+  }
+  fclose(in);
+
+  sha256_hex(binary, entries[idx].size, sum);
+  if (strcmp(sum, entries[idx].sum)) {
+    applog(LOG_WARNING, "Kernel cache binary %s failed its checksum, discarding it", path);
+    free(binary);
+    goto bad;
+  }
+
+  *size = entries[idx].size;
+  return binary;
+bad:
+  remove_entry(entries, count, idx);
+  write_index(entries, *count);
+  return NULL;
+}
+
+cl_program binary_cache_load(build_kernel_data *data, const char *key)
+{
+  cache_entry *entries;
+  unsigned char *binary = NULL;
+  cl_program program = NULL;
+  size_t size;
+  int count, idx;
+
+  mutex_lock(&binary_cache_lock);
+  entries = read_index(&count);
+  idx = find_entry(entries, count, key);
+  if (idx < 0) {
+    applog(LOG_DEBUG, "No cached binary for %s, generating from source", data->binary_filename);
+    goto out;
+  }
+
+  binary = read_cached_binary(entries, &count, idx, &size);
+  if (!binary)
+    goto out;
+
+  entries[idx].last_used = next_use(entries, count);
+  write_index(entries, count);
+out:
+  mutex_unlock(&binary_cache_lock);
+  free(entries);
+
+  if (binary) {
+    program = load_opencl_binary(data, binary, size);
+    if (program)
+      applog(LOG_DEBUG, "Loaded cached binary %s for %s", key, data->binary_filename);
+    free(binary);
+  }
+
+  return program;
+}
+
+bool binary_cache_store(build_kernel_data *data, const char *key, cl_program program)
+{
+  char path[PATH_MAX];
+  cache_entry *entries = NULL, entry;
+  unsigned char *binary;
+  size_t size;
+  bool ret = false;
+  FILE *out;
+  int count, idx;
+
+#ifdef __APPLE__
+  /* OSX OpenCL breaks reading off binaries with >1 GPU */
+  return false;
+#endif
+
+  binary = get_opencl_binary(data, program, &size);
+  if (!binary)
+    return false;
+
+  memset(&entry, 0, sizeof(entry));
+  strcpy(entry.key, key);
+  entry.size = size;
+  sha256_hex(binary, size, entry.sum);
+  snprintf(entry.name, sizeof(entry.name), "%s", data->binary_filename);
+
+  mutex_lock(&binary_cache_lock);
+
+#ifdef WIN32
+  mkdir(opt_kernel_cache_dir);
+#else
+  mkdir(opt_kernel_cache_dir, 0755);
+#endif
+
+  /* Not fatal if any of this fails, the kernel just gets built again next
+   * time */
+  binary_path(path, sizeof(path), key);
+  out = fopen(path, "wb");
+  if (!out) {
+    applog(LOG_DEBUG, "Unable to create file %s", path);
+    goto out;
+  }
+  if (fwrite(binary, 1, size, out) != size) {
+    applog(LOG_ERR, "Unable to fwrite to %s", path);
+    fclose(out);
+    remove(path);
+    goto out;
+  }
+  if (fclose(out)) {
+    applog(LOG_ERR, "Error writing %s", path);
+    remove(path);
+    goto out;
+  }
+
+  entries = read_index(&count);
+  idx = find_entry(entries, count, key);
+  entry.last_used = next_use(entries, count);
+  if (idx < 0) {
+    entries = (cache_entry *)realloc(entries, (count + 1) * sizeof(cache_entry));
+    if (unlikely(!entries))
+      quit(1, "Failed to realloc in binary_cache_store");
+    idx = count++;
+  }
+  entries[idx] = entry;
+
+  /* Evict the least recently used binaries */
+  while (count > opt_kernel_cache_size) {
+    int i, lru = 0;
+
+    for (i = 1; i < count; i++)
+      if (entries[i].last_used < entries[lru].last_used)
+        lru = i;
+    applog(LOG_DEBUG, "Evicting %s (%s) from the kernel cache", entries[lru].key, entries[lru].name);
+    remove_entry(entries, &count, lru);
+  }
+
+  ret = write_index(entries, count);
+  if (ret)
+    applog(LOG_DEBUG, "Cached binary %s for %s", key, data->binary_filename);
+out:
+  mutex_unlock(&binary_cache_lock);
+  free(entries);
+  free(binary);
+  return ret;
+}
+
+static int find_building(const char *key)
+{
+  int i;
+
+  for (i = 0; i < MAX_BUILDING; i++)
+    if (!strcmp(building[i], key))
+      return i;
+  return -1;
+}
+
+void binary_cache_build_lock(const char *key)
+{
+  int i;
+
+  mutex_lock(&building_lock);
+  while (find_building(key) >= 0 || (i = find_building("")) < 0)
+    pthread_cond_wait(&building_cond, &building_lock);
+  strcpy(building[i], key);
+  mutex_unlock(&building_lock);
+}
+
+void binary_cache_build_unlock(const char *key)
+{
+  int i;
+
+  mutex_lock(&building_lock);
+  i = find_building(key);
+  if (i >= 0)
+    building[i][0] = '\0';
+  pthread_cond_broadcast(&building_cond);
+  mutex_unlock(&building_lock);
+}
@@ -0,0 +1,23 @@
+#ifndef BINARY_CACHE_H
+#define BINARY_CACHE_H
+
+#include <stdbool.h>
+
+#ifdef __APPLE_CC__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include "build_kernel.h"
+
+/* Hex SHA-256 of everything that goes into a program binary */
+#define BINARY_CACHE_KEY_LEN 65
+
+bool binary_cache_key(build_kernel_data *data, char *key);
+cl_program binary_cache_load(build_kernel_data *data, const char *key);
+bool binary_cache_store(build_kernel_data *data, const char *key, cl_program program);
+void binary_cache_build_lock(const char *key);
+void binary_cache_build_unlock(const char *key);
+
+#endif /* BINARY_CACHE_H */
@@ -9,6 +9,6 @@
 
 #include "build_kernel.h"
 
-cl_program load_opencl_binary_kernel(build_kernel_data *data);
+cl_program load_opencl_binary(build_kernel_data *data, const unsigned char *binary, size_t binary_size);
 
 #endif /* BINARY_KERNEL_H */
@@ -57,6 +57,11 @@ static char *file_contents(const char *filename, int *length)
   return (char*)buffer;
 }
 
+char *read_kernel_source(build_kernel_data *data, int *length)
+{
+  return file_contents(data->source_filename, length);
+}
+
 void set_base_compiler_options(build_kernel_data *data)
 {
   char buf[255];
@@ -151,20 +156,15 @@ out:
   return ret;
 }
 
-bool save_opencl_kernel(build_kernel_data *data, cl_program program)
+/* Returns a malloced copy of the device binary of program, BFI patched if
+ * needed, or NULL */
+unsigned char *get_opencl_binary(build_kernel_data *data, cl_program program, size_t *size)
 {
   cl_uint slot, cpnd = 0;
   size_t *binary_sizes = (size_t *)calloc(MAX_GPUDEVICES * 4, sizeof(size_t));
   char **binaries = NULL;
+  unsigned char *ret = NULL;
   cl_int status;
-  FILE *binaryfile;
-  bool ret = false;
-
-  #ifdef __APPLE__
-    /* OSX OpenCL breaks reading off binaries with >1 GPU so always build
-     * from source. */
-    goto out;
-  #endif
 
   status = clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &cpnd, NULL);
   if (unlikely(status != CL_SUCCESS)) {
@@ -196,13 +196,13 @@ bool save_opencl_kernel(build_kernel_data *data, cl_program program)
     if (binary_sizes[slot])
       break;
 
-  /* copy over all of the generated binaries. */
-  applog(LOG_DEBUG, "Binary size found in binary slot %d: %d", slot, (int)(binary_sizes[slot]));
-  if (!binary_sizes[slot]) {
+  if (slot == cpnd) {
     applog(LOG_ERR, "OpenCL compiler generated a zero sized binary!");
     goto out;
   }
 
+  applog(LOG_DEBUG, "Binary size found in binary slot %d: %d", slot, (int)(binary_sizes[slot]));
+
   /* Patch the kernel if the hardware supports BFI_INT but it needs to
    * be hacked in */
   if (data->patch_bfi) {
@@ -211,26 +211,16 @@ bool save_opencl_kernel(build_kernel_data *data, cl_program program)
     }
   }
 
-  /* Save the binary to be loaded next time */
-  binaryfile = fopen(data->binary_filename, "wb");
-  if (!binaryfile) {
-    /* Not fatal, just means we build it again next time, unless BFI patch is needed */
-    applog(LOG_DEBUG, "Unable to create file %s", data->binary_filename);
-    goto out;
-  } else {
-    if (unlikely(fwrite(binaries[slot], 1, binary_sizes[slot], binaryfile) != binary_sizes[slot])) {
-      applog(LOG_ERR, "Unable to fwrite to binaryfile");
-      goto out;
-    }
-    fclose(binaryfile);
-  }
-
-  ret = true;
+  /* Hand over the one binary that's there instead of copying it */
+  ret = (unsigned char *)binaries[slot];
+  binaries[slot] = NULL;
+  *size = binary_sizes[slot];
 out:
-  for (slot = 0; slot < cpnd; slot++)
-    if (binary_sizes[slot])
+  if (binaries) {
+    for (slot = 0; slot < cpnd; slot++)
       free(binaries[slot]);
-  if (binaries) free(binaries);
+    free(binaries);
+  }
   free(binary_sizes);
 
   return ret;
@@ -27,6 +27,9 @@ typedef struct _build_kernel_data {
 
 // for compiler options
   char platform[64];
+  char platform_name[256];
+  char device_name[256];
+  char driver_version[256];
   char sgminer_path[255];
   const char *kernel_path;
   size_t work_size;
@@ -37,7 +40,8 @@ typedef struct _build_kernel_data {
 
 bool needs_bfi_patch(build_kernel_data *data);
 cl_program build_opencl_kernel(build_kernel_data *data, const char *filename);
-bool save_opencl_kernel(build_kernel_data *data, cl_program program);
+unsigned char *get_opencl_binary(build_kernel_data *data, cl_program program, size_t *size);
+char *read_kernel_source(build_kernel_data *data, int *length);
 void set_base_compiler_options(build_kernel_data *data);
 
 #endif /* BUILD_KERNEL_H */
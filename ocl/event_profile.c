@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "event_profile.h"
+#include "miner.h"
+
+static const char *hist_names[EVENT_HISTS] = {
+  "Kernel",
+  "Gap",
+  "Submit",
+  "Read",
+  "Write"
+};
+
+const char *event_hist_name(enum event_hist hist)
+{
+  return hist_names[hist];
+}
+
+event_profile *event_profile_new(void)
+{
+  event_profile *profile = (event_profile *)calloc(1, sizeof(event_profile));
+
+  if (unlikely(!profile)) {
+    applog(LOG_ERR, "Failed to calloc in event_profile_new");
+    return NULL;
+  }
+  mutex_init(&profile->lock);
+  return profile;
+}
+
+void event_profile_free(event_profile *profile)
+{
+  if (!profile)
+    return;
+  mutex_destroy(&profile->lock);
+  free(profile);
+}
+
+static void hist_add(event_histogram *hist, double us)
+{
+  int bucket = 0;
+
+  while (bucket < EVENT_HIST_BUCKETS - 1 && us >= (double)(1ULL << bucket))
+    bucket++;
+
+  if (!hist->count || us < hist->min_us)
+    hist->min_us = us;
+  if (us > hist->max_us)
+    hist->max_us = us;
+  hist->count++;
+  hist->total_us += us;
+  hist->buckets[bucket]++;
+}
+
+static bool event_times(cl_event event, cl_ulong *queued, cl_ulong *submit, cl_ulong *start, cl_ulong *end)
+{
+  cl_int status;
+
+  status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), queued, NULL);
+  status |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), submit, NULL);
+  status |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), start, NULL);
+  status |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), end, NULL);
+  return status == CL_SUCCESS;
+}
+
+/* Timestamps are in ns of the device clock. The gap is measured against
+ * the end of the previous kernel on the same queue, kept by the caller.
+ * Returns the kernel time in us, or -1 if the event has no timestamps.
+ * profile may be NULL when only the kernel time is wanted. */
+double event_profile_kernel(event_profile *profile, cl_event event, cl_ulong *last_end)
+{
+  cl_ulong queued, submit, start, end;
+
+  if (!event_times(event, &queued, &submit, &start, &end))
+    return -1;
+
+  if (profile) {
+    mutex_lock(&profile->lock);
+    hist_add(&profile->hists[EVENT_HIST_KERNEL], (end - start) / 1000.0);
+    hist_add(&profile->hists[EVENT_HIST_SUBMIT], (submit - queued) / 1000.0);
+    if (*last_end && start > *last_end)
+      hist_add(&profile->hists[EVENT_HIST_GAP], (start - *last_end) / 1000.0);
+    mutex_unlock(&profile->lock);
+  }
+
+  *last_end = end;
+  return (end - start) / 1000.0;
+}
+
+void event_profile_transfer(event_profile *profile, enum event_hist hist, cl_event event)
+{
+  cl_ulong queued, submit, start, end;
+
+  if (!profile || !event_times(event, &queued, &submit, &start, &end))
+    return;
+
+  mutex_lock(&profile->lock);
+  hist_add(&profile->hists[hist], (end - queued) / 1000.0);
+  mutex_unlock(&profile->lock);
+}
+
+void event_profile_snapshot(event_profile *profile, event_histogram *hists)
+{
+  mutex_lock(&profile->lock);
+  memcpy(hists, profile->hists, sizeof(profile->hists));
+  mutex_unlock(&profile->lock);
+}
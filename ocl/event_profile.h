@@ -0,0 +1,49 @@
+#ifndef EVENT_PROFILE_H
+#define EVENT_PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __APPLE_CC__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+/* What --gpu-profile measures, from the CL event timestamps of every
+ * launch on a profiling command queue */
+enum event_hist {
+  EVENT_HIST_KERNEL,  /* kernel start to end */
+  EVENT_HIST_GAP,     /* previous kernel end to this kernel start */
+  EVENT_HIST_SUBMIT,  /* kernel queued to submitted to the device */
+  EVENT_HIST_READ,    /* result read queued to end */
+  EVENT_HIST_WRITE,   /* counter reset queued to end */
+  EVENT_HISTS
+};
+
+/* Bucket 0 is under 1us, bucket i is 2^(i-1) to 2^i us, the last one
+ * takes everything longer */
+#define EVENT_HIST_BUCKETS 24
+
+typedef struct _event_histogram {
+  uint64_t count;
+  double total_us;
+  double min_us;
+  double max_us;
+  uint64_t buckets[EVENT_HIST_BUCKETS];
+} event_histogram;
+
+typedef struct _event_profile {
+  pthread_mutex_t lock;
+  event_histogram hists[EVENT_HISTS];
+} event_profile;
+
+event_profile *event_profile_new(void);
+void event_profile_free(event_profile *profile);
+double event_profile_kernel(event_profile *profile, cl_event event, cl_ulong *last_end);
+void event_profile_transfer(event_profile *profile, enum event_hist hist, cl_event event);
+void event_profile_snapshot(event_profile *profile, event_histogram *hists);
+const char *event_hist_name(enum event_hist hist);
+
+#endif /* EVENT_PROFILE_H */
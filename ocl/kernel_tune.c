@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernel_tune.h"
+#include "miner.h"
+
+/* The tuning cache is a plain text file, one line per device name and
+ * driver version, tab separated since device names have spaces:
+ *
+ *   <device> <driver> <lds tables> <unroll> <constant> <worksize> <MH/s>
+ *
+ * <constant> is 1 for tables in constant memory, and 2 for the bitsliced
+ * kernel, which has none. Lines starting with # are ignored. The MH/s column
+ * is only for people reading the file. */
+
+#define TUNE_LINE_MAX 512
+
+/* Every GPU thread can end up in here at once */
+static pthread_mutex_t tune_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void kernel_variant_options(build_kernel_data *data, const kernel_variant *variant)
+{
+  char buf[64];
+
+  if (variant->bitsliced) {
+    strcat(data->compiler_options, " -D WHIRLPOOLX_BITSLICED");
+    strcat(data->binary_filename, "b");
+  } else if (variant->constant_tables) {
+    strcat(data->compiler_options, " -D WHIRLPOOLX_CONSTANT_TABLES");
+    strcat(data->binary_filename, "c");
+  } else if (variant->lds_tables) {
+    sprintf(buf, " -D WHIRLPOOLX_LDS_TABLES=%d", variant->lds_tables);
+    strcat(data->compiler_options, buf);
+    sprintf(buf, "t%d", variant->lds_tables);
+    strcat(data->binary_filename, buf);
+  }
+
+  if (variant->unroll) {
+    sprintf(buf, " -D WHIRLPOOLX_UNROLL=%d", variant->unroll);
+    strcat(data->compiler_options, buf);
+    sprintf(buf, "u%d", variant->unroll);
+    strcat(data->binary_filename, buf);
+  }
+}
+
+const char *kernel_variant_str(const kernel_variant *variant, char *buf, size_t len)
+{
+  char tables[16];
+
+  if (variant->bitsliced)
+    strcpy(tables, "none");
+  else if (variant->constant_tables)
+    strcpy(tables, "constant");
+  else if (variant->lds_tables)
+    sprintf(tables, "%d LDS", variant->lds_tables);
+  else
+    strcpy(tables, "default");
+
+  snprintf(buf, len, "tables %s, unroll %d, worksize %d", tables,
+     variant->unroll ? variant->unroll : 1, (int)variant->work_size);
+  return buf;
+}
+
+/* Splits a cache line in place, returns false if it isn't an entry */
+static bool parse_tune_line(char *line, char **device, char **driver, kernel_variant *variant)
+{
+  char *fields[7];
+  int i;
+
+  if (line[0] == '#' || line[0] == '\n' || !line[0])
+    return false;
+
+  line[strcspn(line, "\r\n")] = '\0';
+
+  fields[0] = line;
+  for (i = 1; i < 7; i++) {
+    char *tab = strchr(fields[i - 1], '\t');
+
+    if (!tab)
+      return false;
+    *tab = '\0';
+    fields[i] = tab + 1;
+  }
+
+  *device = fields[0];
+  *driver = fields[1];
+  variant->lds_tables = atoi(fields[2]);
+  variant->unroll = atoi(fields[3]);
+  variant->constant_tables = atoi(fields[4]) == 1;
+  variant->bitsliced = atoi(fields[4]) == 2;
+  variant->work_size = (size_t)atoi(fields[5]);
+  return true;
+}
+
+bool tune_cache_lookup(const char *filename, const char *device, const char *driver, kernel_variant *variant)
+{
+  char line[TUNE_LINE_MAX], *dev, *drv;
+  kernel_variant entry;
+  bool found = false;
+  FILE *fp;
+
+  mutex_lock(&tune_cache_lock);
+
+  fp = fopen(filename, "r");
+  if (!fp)
+    goto out;
+
+  while (fgets(line, sizeof(line), fp)) {
+    if (!parse_tune_line(line, &dev, &drv, &entry))
+      continue;
+    if (!strcmp(dev, device) && !strcmp(drv, driver)) {
+      *variant = entry;
+      found = true;
+      break;
+    }
+  }
+
+  fclose(fp);
+out:
+  mutex_unlock(&tune_cache_lock);
+  return found;
+}
+
+/* Rewrites the whole file with this device's entry replaced, through a
+ * temporary so a crash halfway never leaves a truncated cache */
+bool tune_cache_store(const char *filename, const char *device, const char *driver, const kernel_variant *variant, double mhs)
+{
+  char line[TUNE_LINE_MAX], copy[TUNE_LINE_MAX], *dev, *drv, *tmpname;
+  kernel_variant entry;
+  FILE *in, *out;
+  bool ret = false;
+
+  tmpname = (char *)malloc(strlen(filename) + 5);
+  if (!tmpname)
+    return false;
+  sprintf(tmpname, "%s.tmp", filename);
+
+  mutex_lock(&tune_cache_lock);
+
+  out = fopen(tmpname, "w");
+  if (!out) {
+    applog(LOG_ERR, "Unable to open %s for writing the tuning cache", tmpname);
+    goto out;
+  }
+
+  in = fopen(filename, "r");
+  if (in) {
+    while (fgets(line, sizeof(line), in)) {
+      strcpy(copy, line);
+      if (parse_tune_line(copy, &dev, &drv, &entry) && !strcmp(dev, device) && !strcmp(drv, driver))
+        continue;
+      fputs(line, out);
+    }
+    fclose(in);
+  } else
+    fputs("# sgminer kernel tuning cache - written by --kernel-tune\n", out);
+
+  fprintf(out, "%s\t%s\t%d\t%d\t%d\t%d\t%.3f\n", device, driver, variant->lds_tables,
+    variant->unroll, variant->bitsliced ? 2 : (variant->constant_tables ? 1 : 0), (int)variant->work_size, mhs);
+
+  if (fclose(out)) {
+    applog(LOG_ERR, "Error writing the tuning cache to %s", tmpname);
+    goto out;
+  }
+
+#ifdef WIN32
+  remove(filename);
+#endif
+  if (rename(tmpname, filename)) {
+    applog(LOG_ERR, "Unable to replace tuning cache %s", filename);
+    goto out;
+  }
+
+  ret = true;
+out:
+  mutex_unlock(&tune_cache_lock);
+  free(tmpname);
+  return ret;
+}
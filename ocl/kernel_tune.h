@@ -0,0 +1,25 @@
+#ifndef KERNEL_TUNE_H
+#define KERNEL_TUNE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "build_kernel.h"
+
+/* One point of the --kernel-tune matrix. Zero in any field means the
+ * kernel's own default, so a zeroed variant builds exactly what was built
+ * before tuning existed. */
+typedef struct _kernel_variant {
+  int lds_tables;        /* tables copied to LDS, 2 or 4 */
+  int unroll;            /* unroll factor of the round loop */
+  bool constant_tables;  /* read tables from constant memory, no LDS */
+  bool bitsliced;        /* no tables at all */
+  size_t work_size;
+} kernel_variant;
+
+void kernel_variant_options(build_kernel_data *data, const kernel_variant *variant);
+const char *kernel_variant_str(const kernel_variant *variant, char *buf, size_t len);
+bool tune_cache_lookup(const char *filename, const char *device, const char *driver, kernel_variant *variant);
+bool tune_cache_store(const char *filename, const char *device, const char *driver, const kernel_variant *variant, double mhs);
+
+#endif /* KERNEL_TUNE_H */
@@ -55,10 +55,12 @@ char *curly = ":D";
 #include "findnonce.h"
 #include "adl.h"
 #include "driver-opencl.h"
+#include "driver-cpu.h"
 #include "bench_block.h"
 #include "sha2.h"
 
 #include "algorithm.h"
+#include "algorithm/whirlpoolx.h"
 #include "pool.h"
 #include "config_parser.h"
 #include "events.h"
@@ -100,6 +102,7 @@ bool opt_remoteconf_usecache = false; // use last downloaded copy of the config
 const int opt_cutofftemp = 95;
 int opt_log_interval = 5;
 int opt_queue = 1;
+int opt_nonce2_lease;
 int opt_scantime = 7;
 int opt_expiry = 28;
 
@@ -110,6 +113,7 @@ time_t last_getwork;
 
 int nDevs;
 int opt_dynamic_interval = 7;
+bool opt_gpu_profile;
 int opt_g_threads = -1;
 bool opt_restart = true;
 
@@ -143,6 +147,7 @@ int opt_shares;
 bool opt_fail_only;
 int opt_fail_switch_delay = 60;
 int opt_watchpool_refresh = 30;
+int opt_verify_threads = 2;
 static bool opt_fix_protocol;
 static bool opt_lowmem;
 static bool opt_morenotices;
@@ -172,7 +177,11 @@ int opt_tcp_keepalive;
 #endif
 double opt_diff_mult = 0.0;
 
+char *opt_kernel_cache_dir = "kernel-cache";
+int opt_kernel_cache_size = 32;
 char *opt_kernel_path;
+bool opt_kernel_tune;
+char *opt_kernel_tune_file = "sgminer-tune.txt";
 char *sgminer_path;
 
 #define QUIET (opt_quiet || opt_realquiet)
@@ -199,6 +208,7 @@ pthread_mutex_t console_lock;
 cglock_t ch_lock;
 static pthread_rwlock_t blk_lock;
 static pthread_mutex_t sshare_lock;
+static pthread_mutex_t work_ref_lock;
 
 pthread_rwlock_t netacc_lock;
 pthread_rwlock_t mining_thr_lock;
@@ -221,6 +231,8 @@ pthread_cond_t gws_cond;
 double total_rolling;
 double total_mhashes_done;
 static struct timeval total_tv_start, total_tv_end, launch_time;
+static struct timeval startup_tv;
+static bool first_hashes;
 
 cglock_t control_lock;
 pthread_mutex_t stats_lock;
@@ -230,15 +242,20 @@ static void apply_initial_gpu_settings(struct pool *pool);
 static unsigned long compare_pool_settings(struct pool *oldpool, struct pool *newpool);
 static void apply_switcher_options(unsigned long options, struct pool *pool);
 static void restart_mining_threads(unsigned int new_n_threads);
+static void log_startup_phase(const char *phase, struct timeval *phase_start);
 static void probe_pools(void);
 static bool test_pool(struct pool *pool);
 
 int hw_errors;
+uint64_t ring_overflows;
 int total_accepted, total_rejected;
 double total_diff1;
 int total_getworks, total_stale, total_discarded;
 double total_diff_accepted, total_diff_rejected, total_diff_stale;
 static int staged_rollable;
+/* Protected by stgd_lock: works popped so far, and mining threads blocked in
+ * hash_pop waiting for one */
+static int works_popped, getq_waiting;
 unsigned int new_blocks;
 static unsigned int work_block;
 unsigned int found_blocks;
@@ -1321,6 +1338,14 @@ char *set_difficulty_multiplier(char *arg)
   return NULL;
 }
 
+static char *set_whirlpoolx_hasher(const char *arg)
+{
+  if (!whirlpoolx_set_hasher(arg))
+    return "Invalid value passed to whirlpoolx-hasher";
+
+  return NULL;
+}
+
 /* These options are available from config file or commandline */
 struct opt_table opt_config_table[] = {
   OPT_WITH_ARG("--algorithm|--kernel|-k",
@@ -1370,6 +1395,9 @@ struct opt_table opt_config_table[] = {
   OPT_WITHOUT_ARG("--balance",
       set_balance, &pool_strategy,
       "Change multipool strategy from failover to even share balance"),
+  OPT_WITH_ARG("--bitsliced",
+      set_bitsliced, NULL, NULL,
+      "Use the table-free bitsliced WhirlpoolX kernel (0 or 1) - one value or comma separated list"),
   OPT_WITHOUT_ARG("--blake-compact",
       opt_set_bool, &opt_blake_compact,
       "Set SPH_COMPACT_BLAKE64 for Xn derived algorithms (Can give better hashrate for some GPUs)"),
@@ -1378,6 +1406,9 @@ struct opt_table opt_config_table[] = {
       opt_set_bool, &opt_compact,
       "Use compact display without per device statistics"),
 #endif
+  OPT_WITH_ARG("--cpu-threads",
+      set_cpu_threads, NULL, NULL,
+      "Number of CPU mining threads, or auto for one per core (default: 0)"),
   OPT_WITHOUT_ARG("--debug|-D",
       enable_debug, &opt_debug,
       "Enable debug output"),
@@ -1431,10 +1462,19 @@ struct opt_table opt_config_table[] = {
       "Do not redirect to a different getwork protocol (eg. stratum)"),
   OPT_WITH_ARG("--gpu-dyninterval",
       set_int_1_to_65535, opt_show_intval, &opt_dynamic_interval,
-      "Set the refresh interval in ms for GPUs using dynamic intensity"),
+      "Set the kernel time in ms per launch for GPUs using dynamic intensity"),
   OPT_WITH_ARG("--gpu-platform",
       set_int_0_to_9999, opt_show_intval, &opt_platform_id,
       "Select OpenCL platform ID to use for GPU mining"),
+  OPT_WITH_ARG("--gpu-pipeline",
+      set_gpu_pipeline, NULL, NULL,
+      "Number of kernel launches kept in flight per GPU thread (1 to " MAX_GPU_PIPELINE_STR ", default: 1) - one value or comma separated list"),
+  OPT_WITHOUT_ARG("--gpu-profile",
+      opt_set_bool, &opt_gpu_profile,
+      "Time every kernel launch and transfer with OpenCL profiling events, reported by the gpuprofile API command"),
+  OPT_WITH_ARG("--gpu-prepared",
+      set_gpu_prepared, NULL, NULL,
+      "Number of works each GPU thread keeps fetched and prepared ahead (0 to " MAX_PREPARED_WORKS_STR ", default: 0) - one value or comma separated list"),
 #ifndef HAVE_ADL
   // gpu-threads can only be set per-card if ADL is available
   OPT_WITH_ARG("--gpu-threads|-g",
@@ -1475,9 +1515,15 @@ struct opt_table opt_config_table[] = {
   OPT_WITHOUT_ARG("--hamsi-short",
       opt_set_bool, &opt_hamsi_short,
       "Set SPH_HAMSI_SHORT for X13 derived algorithms (Can give better hashrate for some GPUs)"),
+  OPT_WITH_ARG("--hostkeys",
+      set_hostkeys, NULL, NULL,
+      "Precompute the WhirlpoolX key schedule on the host (0 or 1) - one value or comma separated list"),
   OPT_WITH_ARG("--keccak-unroll",
       set_int_0_to_9999, opt_show_intval, &opt_keccak_unroll,
       "Set SPH_KECCAK_UNROLL for Xn derived algorithms (Default: 0)"),
+  OPT_WITH_ARG("--kernel-nonces",
+      set_kernel_nonces, NULL, NULL,
+      "Nonces each WhirlpoolX work-item hashes per launch (1 to " MAX_KERNEL_NONCES_STR ") - one value or comma separated list"),
   OPT_WITH_ARG("--kernelfile",
          set_default_kernelfile, NULL, NULL,
          "Set the algorithm kernel source file (without file extension)."),
@@ -1508,9 +1554,21 @@ struct opt_table opt_config_table[] = {
       set_default_rawintensity, NULL, NULL,
       "Raw intensity of GPU scanning (" MIN_RAWINTENSITY_STR " to "
         MAX_RAWINTENSITY_STR "), overrides --intensity|-I and --xintensity|-X."),
+  OPT_WITH_ARG("--kernel-cache-dir",
+      opt_set_charp, opt_show_charp, &opt_kernel_cache_dir,
+      "Directory compiled kernel binaries are cached in (default: kernel-cache)"),
+  OPT_WITH_ARG("--kernel-cache-size",
+      set_int_0_to_9999, opt_show_intval, &opt_kernel_cache_size,
+      "Most kernel binaries to keep in the cache, least recently used go first, 0 disables the cache (default: 32)"),
   OPT_WITH_ARG("--kernel-path|-K",
       opt_set_charp, opt_show_charp, &opt_kernel_path,
       "Specify a path to where kernel files are"),
+  OPT_WITHOUT_ARG("--kernel-tune",
+      opt_set_bool, &opt_kernel_tune,
+      "Build and time every kernel variant on each GPU at startup, and save the fastest to the tuning file"),
+  OPT_WITH_ARG("--kernel-tune-file",
+      opt_set_charp, opt_show_charp, &opt_kernel_tune_file,
+      "Tuning file the fastest kernel variant per GPU model and driver is kept in (default: sgminer-tune.txt)"),
   OPT_WITHOUT_ARG("--load-balance",
       set_loadbalance, &pool_strategy,
       "Change multipool strategy from failover to quota based balance"),
@@ -1563,6 +1621,9 @@ struct opt_table opt_config_table[] = {
   OPT_WITHOUT_ARG("--no-extranonce|--pool-no-extranonce",
       set_no_extranonce_subscribe, NULL,
       "Disable 'extranonce' stratum subscribe for pool"),
+  OPT_WITH_ARG("--nonce2-lease",
+      set_int_0_to_9999, opt_show_intval, &opt_nonce2_lease,
+      "Stratum nonce2 values each mining thread reserves to make its own work from, 0 to use the work queue"),
   OPT_WITH_ARG("--pass|--pool-pass|-p",
       set_pass, NULL, NULL,
       "Password for bitcoin JSON-RPC server"),
@@ -1724,6 +1785,9 @@ struct opt_table opt_config_table[] = {
   OPT_WITHOUT_ARG("--round-robin",
       set_rr, &pool_strategy,
       "Change multipool strategy from failover to round robin on failure"),
+  OPT_WITH_ARG("--round1-precompute",
+      set_round1_precompute, NULL, NULL,
+      "Precompute the nonce independent part of the first WhirlpoolX round on the host (0 or 1) - one value or comma separated list"),
   OPT_WITH_ARG("--scan-time|-s",
       set_int_0_to_9999, opt_show_intval, &opt_scantime,
       "Upper bound on time spent scanning current work, in seconds"),
@@ -1802,15 +1866,19 @@ struct opt_table opt_config_table[] = {
       "Username for bitcoin JSON-RPC server"),
   OPT_WITH_ARG("--vectors",
       set_vector, NULL, NULL,
-      opt_hidden),
-      /* All current kernels only support vectors=1 */
-      /* "Override detected optimal vector (1, 2 or 4) - one value or comma separated list"), */
+      "Nonces each WhirlpoolX work-item hashes side by side (1, 2 or 4) - one value or comma separated list"),
   OPT_WITHOUT_ARG("--verbose|-v",
       opt_set_bool, &opt_verbose,
       "Log verbose output to stderr as well as status output"),
+  OPT_WITH_ARG("--verify-threads",
+      set_int_1_to_10, opt_show_intval, &opt_verify_threads,
+      "Number of threads verifying nonces returned by the devices"),
   OPT_WITH_ARG("--watchpool-refresh",
       set_int_1_to_65535, opt_show_intval, &opt_watchpool_refresh,
       "Interval in seconds to refresh pool status"),
+  OPT_WITH_ARG("--whirlpoolx-hasher",
+      set_whirlpoolx_hasher, NULL, NULL,
+      "CPU WhirlpoolX hasher for the CPU miner and share checks: auto, scalar, bitsliced, avx2 or avx512"),
   OPT_WITH_ARG("--worksize|-w",
       set_default_worksize, NULL, NULL,
       "Override detected optimal worksize - one value or comma separated list"),
@@ -1853,6 +1921,64 @@ char *display_devs(int *ndevs)
   exit(*ndevs);
 }
 
+/* Check every SHA-256 backend the CPU can run against the scalar code over
+ * the FIPS 180-2 vectors and arg random messages, and exit with the result */
+static char *sha256_check_opt(const char *arg)
+{
+  int count = atoi(arg), bad;
+
+  if (count < 1)
+    return "Invalid value passed to sha256-check";
+
+  bad = sha256_check(count);
+  if (bad)
+    applog(LOG_ERR, "SHA-256 check: %d mismatches over %d messages", bad, count);
+  else
+    applog(LOG_NOTICE, "SHA-256 check: %d messages OK", count);
+  exit(bad ? 1 : 0);
+}
+
+/* Time every SHA-256 backend the CPU can run for arg seconds each, and exit */
+static char *sha256_bench_opt(const char *arg)
+{
+  double seconds = atof(arg);
+
+  if (seconds <= 0.0)
+    return "Invalid value passed to sha256-bench";
+
+  sha256_bench(seconds);
+  exit(0);
+}
+
+/* Check the shortened last round of the CPU hashers against the full
+ * WhirlpoolX hash over arg random headers, and exit with the result */
+static char *whirlpoolx_check(const char *arg)
+{
+  int count = atoi(arg), bad;
+
+  if (count < 1)
+    return "Invalid value passed to whirlpoolx-check";
+
+  bad = whirlpoolx_check_pruned(count);
+  if (bad)
+    applog(LOG_ERR, "WhirlpoolX check: %d mismatches over %d headers", bad, count);
+  else
+    applog(LOG_NOTICE, "WhirlpoolX check: %d headers OK", count);
+  exit(bad ? 1 : 0);
+}
+
+/* Time every CPU WhirlpoolX hasher for arg seconds each, and exit */
+static char *whirlpoolx_bench_opt(const char *arg)
+{
+  double seconds = atof(arg);
+
+  if (seconds <= 0.0)
+    return "Invalid value passed to whirlpoolx-bench";
+
+  whirlpoolx_bench(seconds);
+  exit(0);
+}
+
 /* These options are available from commandline only */
 static struct opt_table opt_cmdline_table[] = {
   OPT_WITH_ARG("--config|-c",
@@ -1879,6 +2005,18 @@ static struct opt_table opt_cmdline_table[] = {
       display_devs, &nDevs,
       "Display number of detected GPUs, OpenCL platform "
       "information, and exit"),
+  OPT_WITH_ARG("--sha256-bench",
+      sha256_bench_opt, NULL, NULL,
+      "Time every SHA-256 backend the CPU can run for <arg> seconds each, and exit"),
+  OPT_WITH_ARG("--sha256-check",
+      sha256_check_opt, NULL, NULL,
+      "Check the SHA-256 backends against known answers and the scalar code over <arg> random messages, and exit"),
+  OPT_WITH_ARG("--whirlpoolx-bench",
+      whirlpoolx_bench_opt, NULL, NULL,
+      "Time every CPU WhirlpoolX hasher for <arg> seconds each, and exit"),
+  OPT_WITH_ARG("--whirlpoolx-check",
+      whirlpoolx_check, NULL, NULL,
+      "Check the CPU WhirlpoolX hashers against the reference hash over <arg> random headers, and exit"),
   OPT_WITHOUT_ARG("--version|-V",
       opt_version_and_exit, packagename,
       "Display version and exit"),
@@ -1946,21 +2084,47 @@ static struct work *make_work(void)
  * cleaned to remove any dynamically allocated arrays within the struct */
 void clean_work(struct work *w)
 {
-  free(w->job_id);
-  free(w->ntime);
+  /* Strings borrowed from the stratum job go with the job */
+  if (!w->job || w->job_id != w->job->job_id)
+    free(w->job_id);
+  if (!w->job || w->ntime != w->job->ntime)
+    free(w->ntime);
+  if (!w->job || w->nonce1 != w->job->nonce1)
+    free(w->nonce1);
   free(w->coinbase);
-  free(w->nonce1);
+  stratum_job_put(w->job);
   memset(w, 0, sizeof(struct work));
 }
 
 /* All dynamically allocated work structs should be freed here to not leak any
- * ram from arrays allocated within the work struct */
+ * ram from arrays allocated within the work struct. If extra references were
+ * taken with ref_work() this only drops one of them. */
 void free_work(struct work *w)
 {
+  mutex_lock(&work_ref_lock);
+  if (w->refs) {
+    w->refs--;
+    mutex_unlock(&work_ref_lock);
+    return;
+  }
+  mutex_unlock(&work_ref_lock);
+
   clean_work(w);
   free(w);
 }
 
+/* Takes an extra reference to a work struct that has to outlive its owner,
+ * such as one queued for nonce verification, without deep copying it. Every
+ * reference is released with free_work(). */
+struct work *ref_work(struct work *w)
+{
+  mutex_lock(&work_ref_lock);
+  w->refs++;
+  mutex_unlock(&work_ref_lock);
+
+  return w;
+}
+
 static void calc_diff(struct work *work, double known);
 char *workpadding = "000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000";
 
@@ -3653,7 +3817,6 @@ static void push_curl_entry(struct curl_ent *ce, struct pool *pool)
   mutex_unlock(&pool->pool_lock);
 }
 
-static bool stale_work(struct work *work, bool share);
 
 static inline bool should_roll(struct work *work)
 {
@@ -3862,9 +4025,13 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
   /* Keep the unique new id assigned during make_work to prevent copied
    * work from having the same id. */
   work->id = id;
-  if (base_work->job_id)
+  work->refs = 0;
+  /* A stratum job is shared by reference along with the strings in it */
+  if (work->job)
+    stratum_job_get(work->job);
+  if (base_work->job_id && (!work->job || base_work->job_id != work->job->job_id))
     work->job_id = strdup(base_work->job_id);
-  if (base_work->nonce1)
+  if (base_work->nonce1 && (!work->job || base_work->nonce1 != work->job->nonce1))
     work->nonce1 = strdup(base_work->nonce1);
   if (base_work->ntime) {
     /* If we are passed an noffset the binary work->data ntime and
@@ -3876,7 +4043,7 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
       ntime += noffset;
       *work_ntime = htobe32(ntime);
       work->ntime = offset_ntime(base_work->ntime, noffset);
-    } else
+    } else if (!work->job || base_work->ntime != work->job->ntime)
       work->ntime = strdup(base_work->ntime);
   } else if (noffset) {
     uint32_t *work_ntime = (uint32_t *)(work->data + 68);
@@ -3925,7 +4092,7 @@ static void pool_died(struct pool *pool)
   }
 }
 
-static bool stale_work(struct work *work, bool share)
+bool stale_work(struct work *work, bool share)
 {
   struct timeval now;
   time_t work_expiry;
@@ -3955,12 +4122,15 @@ static bool stale_work(struct work *work, bool share)
       return true;
     }
 
-    same_job = true;
-
-    cg_rlock(&pool->data_lock);
-    if (strcmp(work->job_id, pool->swork.job_id))
-      same_job = false;
-    cg_runlock(&pool->data_lock);
+    /* Works from a stratum job just compare its generation, anything
+     * else falls back to the job_id */
+    if (work->job)
+      same_job = work->job->job_id_gen == pool->job_id_gen;
+    else {
+      cg_rlock(&pool->data_lock);
+      same_job = !strcmp(work->job_id, pool->swork.job_id);
+      cg_runlock(&pool->data_lock);
+    }
 
     if (!same_job) {
       applog(LOG_DEBUG, "Work stale due to stratum job_id mismatch");
@@ -4169,12 +4339,14 @@ void __switch_pools(struct pool *selected, bool saveprio)
 void discard_work(struct work *work)
 {
   if (!work->clone && !work->rolls && !work->mined) {
+    mutex_lock(&stats_lock);
     if (work->pool) {
       work->pool->discarded_work++;
       work->pool->quota_used--;
       work->pool->works--;
     }
     total_discarded++;
+    mutex_unlock(&stats_lock);
     applog(LOG_DEBUG, "[THR%d] Discarded work", work->thr_id);
   } else
     applog(LOG_DEBUG, "[THR%d] Discarded cloned or rolled work", work->thr_id);
@@ -4463,10 +4635,41 @@ static void stage_work(struct work *work)
   applog(LOG_DEBUG, "[THR%d] Pushing work from %s to hash queue", work->thr_id, get_pool_name(work->pool));
   work->work_block = work_block;
   test_work_current(work);
+  mutex_lock(&stats_lock);
   work->pool->works++;
+  mutex_unlock(&stats_lock);
   hash_push(work);
 }
 
+/* As stage_work, but the whole batch goes on the queue under one lock and
+ * wakes the waiting mining threads once */
+static void stage_works(struct work **works, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++) {
+    applog(LOG_DEBUG, "[THR%d] Pushing work from %s to hash queue", works[i]->thr_id, get_pool_name(works[i]->pool));
+    works[i]->work_block = work_block;
+    test_work_current(works[i]);
+  }
+
+  /* Leasing mining threads count their works under the same lock */
+  mutex_lock(&stats_lock);
+  for (i = 0; i < count; i++)
+    works[i]->pool->works++;
+  mutex_unlock(&stats_lock);
+
+  mutex_lock(stgd_lock);
+  for (i = 0; i < count && likely(!getq->frozen); i++) {
+    if (work_rollable(works[i]))
+      staged_rollable++;
+    HASH_ADD_INT(staged_work, id, works[i]);
+  }
+  HASH_SORT(staged_work, tv_sort);
+  pthread_cond_broadcast(&getq->cond);
+  mutex_unlock(stgd_lock);
+}
+
 #ifdef HAVE_CURSES
 int curses_int(const char *query)
 {
@@ -4542,6 +4745,7 @@ void zero_stats(void)
   total_accepted = 0;
   total_rejected = 0;
   hw_errors = 0;
+  ring_overflows = 0;
   total_stale = 0;
   total_discarded = 0;
   local_work = 0;
@@ -4582,6 +4786,7 @@ void zero_stats(void)
     cgpu->accepted = 0;
     cgpu->rejected = 0;
     cgpu->hw_errors = 0;
+    cgpu->ring_overflows = 0;
     cgpu->utility = 0.0;
     cgpu->last_share_pool_time = 0;
     cgpu->diff1 = 0;
@@ -5894,6 +6099,7 @@ static struct work *hash_pop(bool blocking)
   if (!HASH_COUNT(staged_work)) {
     if (!blocking)
       goto out_unlock;
+    getq_waiting++;
     do {
       struct timespec then;
       struct timeval now;
@@ -5913,6 +6119,7 @@ static struct work *hash_pop(bool blocking)
         event_notify("idle");
       }
     } while (!HASH_COUNT(staged_work));
+    getq_waiting--;
   }
 
   if (no_work) {
@@ -5932,6 +6139,7 @@ static struct work *hash_pop(bool blocking)
   HASH_DEL(staged_work, work);
   if (work_rollable(work))
     staged_rollable--;
+  works_popped++;
 
   /* Signal the getwork scheduler to look for more work */
   pthread_cond_signal(&gws_cond);
@@ -6043,122 +6251,273 @@ void set_target_neoscrypt(unsigned char *target, double diff, const int thr_id)
   }
 }
 
-/* Generates stratum based work based on the most recent notify information
- * from the pool. This will keep generating work while a pool is down so we use
- * other means to detect when the pool has died in stratum_thread */
-static void gen_stratum_work(struct pool *pool, struct work *work)
+/* Most stratum works made in one batch, and how far ahead of the mining
+ * threads' measured consumption a batch reaches */
+#define STRATUM_BATCH_MAX 64
+#define STRATUM_BATCH_MS 500
+
+/* Generates count stratum works for consecutive nonce2 values from nonce2
+ * on, from a job snapshot so no pool lock is needed. The coinbase and merkle
+ * branch hashes of the whole batch go through sha256d_many together. */
+static void gen_job_works(struct stratum_job *job, uint64_t nonce2, struct work **works, int count)
 {
-  unsigned char merkle_root[32], merkle_sha[64];
+  unsigned char hashes[STRATUM_BATCH_MAX][32], merkle_sha[STRATUM_BATCH_MAX][64];
+  const unsigned char *msgs[STRATUM_BATCH_MAX];
+  unsigned char merkle_root[32], *tails, *cb;
+  struct pool *pool = job->pool;
   uint32_t *data32, *swap32;
   uint64_t nonce2le;
-  int i, j;
+  size_t tail_len;
+  int i, j, n;
+
+  if (unlikely(count < 1 || count > STRATUM_BATCH_MAX))
+    quit(1, "Invalid stratum batch of %d works", count);
+
+  /* Copy off the coinbase from nonce2 on for every work. Always use an LE
+   * encoded nonce2 to fill in values from left to right and prevent
+   * overflow errors with small n2sizes */
+  tail_len = job->cb_len - job->nonce2_offset;
+  tails = (unsigned char *)malloc(tail_len * count);
+  if (unlikely(!tails))
+    quit(1, "Failed to malloc tails in gen_job_works");
+  for (n = 0; n < count; n++) {
+    nonce2le = htole64(nonce2);
+    memcpy(tails + n * tail_len, job->coinbase + job->nonce2_offset, tail_len);
+    memcpy(tails + n * tail_len, &nonce2le, job->n2size);
+    msgs[n] = tails + n * tail_len;
+    works[n]->nonce2 = nonce2++;
+    works[n]->nonce2_len = job->n2size;
+  }
+
+  /* Generate the coinbase hashes. For plain double SHA-256, pick them up
+   * from the state parse_notify left after the bytes before nonce2 */
+  if (pool->algorithm.gen_hash == gen_hash)
+    sha256d_many(&job->cb_prefix, msgs, tail_len, hashes, count);
+  else {
+    cb = (unsigned char *)malloc(job->cb_len);
+    if (unlikely(!cb))
+      quit(1, "Failed to malloc cb in gen_job_works");
+    memcpy(cb, job->coinbase, job->nonce2_offset);
+    for (n = 0; n < count; n++) {
+      memcpy(cb + job->nonce2_offset, msgs[n], tail_len);
+      pool->algorithm.gen_hash(cb, job->cb_len, hashes[n]);
+    }
+    free(cb);
+  }
+  free(tails);
 
-  cg_wlock(&pool->data_lock);
+  /* Generate merkle roots, one branch level at a time for the batch */
+  for (i = 0; i < job->merkles; i++) {
+    for (n = 0; n < count; n++) {
+      memcpy(merkle_sha[n], hashes[n], 32);
+      memcpy(merkle_sha[n] + 32, job->merkle_bin[i], 32);
+      msgs[n] = merkle_sha[n];
+    }
+    sha256d_many(NULL, msgs, 64, hashes, count);
+  }
 
-  /* Update coinbase. Always use an LE encoded nonce2 to fill in values
-  * from left to right and prevent overflow errors with small n2sizes */
-  nonce2le = htole64(pool->nonce2);
-  memcpy(pool->coinbase + pool->nonce2_offset, &nonce2le, pool->n2size);
-  work->nonce2 = pool->nonce2++;
-  work->nonce2_len = pool->n2size;
+  for (n = 0; n < count; n++) {
+    struct work *work = works[n];
 
-  /* Downgrade to a read lock to read off the pool variables */
-  cg_dwlock(&pool->data_lock);
+    memcpy(merkle_sha[n], hashes[n], 32);
 
-  /* Generate merkle root */
-  pool->algorithm.gen_hash(pool->coinbase, pool->swork.cb_len, merkle_root);
-  memcpy(merkle_sha, merkle_root, 32);
-  for (i = 0; i < pool->swork.merkles; i++) {
-    memcpy(merkle_sha + 32, pool->swork.merkle_bin[i], 32);
-    gen_hash(merkle_sha, 64, merkle_root);
-    memcpy(merkle_sha, merkle_root, 32);
-  }
+    applog(LOG_DEBUG, "[THR%d] gen_stratum_work() - algorithm = %s", work->thr_id, pool->algorithm.name);
+
+    // Different for Neoscrypt because of Little Endian
+    if (!safe_cmp(pool->algorithm.name, "neoscrypt")) {
+      /* Incoming data is in little endian. */
+      memcpy(merkle_root, merkle_sha[n], 32);
+
+      uint32_t temp = job->merkle_offset / sizeof(uint32_t), i;
+      /* Put version (4 byte) + prev_hash (4 byte* 8) but big endian encoded
+      * into work. */
+      for (i = 0; i < temp; ++i) {
+        ((uint32_t *)work->data)[i] = be32toh(((uint32_t *)job->header_bin)[i]);
+      }
 
-  applog(LOG_DEBUG, "[THR%d] gen_stratum_work() - algorithm = %s", work->thr_id, pool->algorithm.name);
+      /* Now add the merkle_root (4 byte* 8), but it is encoded in little endian. */
+      temp += 8;
 
-  // Different for Neoscrypt because of Little Endian
-  if (!safe_cmp(pool->algorithm.name, "neoscrypt")) {
-    /* Incoming data is in little endian. */
-    memcpy(merkle_root, merkle_sha, 32);
+      for (j = 0; i < temp; ++i, ++j) {
+        ((uint32_t *)work->data)[i] = le32toh(((uint32_t *)merkle_root)[j]);
+      }
+
+      /* Add the time encoded in big endianess. */
+      hex2bin((unsigned char *)&temp, job->ntime, 4);
 
-    uint32_t temp = pool->merkle_offset / sizeof(uint32_t), i;
-    /* Put version (4 byte) + prev_hash (4 byte* 8) but big endian encoded
-    * into work. */
-    for (i = 0; i < temp; ++i) {
-      ((uint32_t *)work->data)[i] = be32toh(((uint32_t *)pool->header_bin)[i]);
+      /* Add the nbits (big endianess). */
+      ((uint32_t *)work->data)[17] = be32toh(temp);
+      hex2bin((unsigned char *)&temp, job->nbit, 4);
+      ((uint32_t *)work->data)[18] = be32toh(temp);
+      ((uint32_t *)work->data)[20] = 0x80000000;
+      ((uint32_t *)work->data)[31] = 0x00000280;
     }
+    else {
+      data32 = (uint32_t *)merkle_sha[n];
+      swap32 = (uint32_t *)merkle_root;
+      flip32(swap32, data32);
+
+      /* Copy the data template from header_bin */
+      memcpy(work->data, job->header_bin, 128);
+      memcpy(work->data + job->merkle_offset, merkle_root, 32);
+    }
+
+    /* Store the stratum work diff to check it still matches the pool's
+    * stratum diff when submitting shares */
+    work->sdiff = job->diff;
 
-    /* Now add the merkle_root (4 byte* 8), but it is encoded in little endian. */
-    temp += 8;
+    /* Parameters required for share submission live in the job */
+    work->job = stratum_job_get(job);
+    work->job_id = job->job_id;
+    work->nonce1 = job->nonce1;
+    work->ntime = job->ntime;
 
-    for (j = 0; i < temp; ++i, ++j) {
-      ((uint32_t *)work->data)[i] = le32toh(((uint32_t *)merkle_root)[j]);
+    if (opt_debug) {
+      char *header, *merkle_hash;
+
+      header = bin2hex(work->data, 128);
+      merkle_hash = bin2hex((const unsigned char *)merkle_root, 32);
+      applog(LOG_DEBUG, "[THR%d] Generated stratum merkle %s", work->thr_id, merkle_hash);
+      applog(LOG_DEBUG, "[THR%d] Generated stratum header %s", work->thr_id, header);
+      applog(LOG_DEBUG, "[THR%d] Work job_id %s nonce2 %"PRIu64" ntime %s", work->thr_id, work->job_id,
+             work->nonce2, work->ntime);
+      free(header);
+      free(merkle_hash);
+    }
+
+    // For Neoscrypt use set_target_neoscrypt() function
+    if (!safe_cmp(pool->algorithm.name, "neoscrypt")) {
+      set_target_neoscrypt(work->target, work->sdiff, work->thr_id);
+    } else {
+      calc_midstate(work);
+      set_target(work->target, work->sdiff, pool->algorithm.diff_multiplier2, work->thr_id);
     }
 
-    /* Add the time encoded in big endianess. */
-    hex2bin((unsigned char *)&temp, pool->swork.ntime, 4);
+    work->pool = pool;
+    work->stratum = true;
+    work->blk.nonce = 0;
+    work->longpoll = false;
+    work->getwork_mode = GETWORK_MODE_STRATUM;
+    work->work_block = work_block;
+    /* Nominally allow a driver to ntime roll 60 seconds */
+    work->drv_rolllimit = 60;
+    calc_diff(work, work->sdiff);
 
-    /* Add the nbits (big endianess). */
-    ((uint32_t *)work->data)[17] = be32toh(temp);
-    hex2bin((unsigned char *)&temp, pool->swork.nbit, 4);
-    ((uint32_t *)work->data)[18] = be32toh(temp);
-    ((uint32_t *)work->data)[20] = 0x80000000;
-    ((uint32_t *)work->data)[31] = 0x00000280;
+    cgtime(&work->tv_staged);
   }
-  else {
-    data32 = (uint32_t *)merkle_sha;
-    swap32 = (uint32_t *)merkle_root;
-    flip32(swap32, data32);
 
-    /* Copy the data template from header_bin */
-    memcpy(work->data, pool->header_bin, 128);
-    memcpy(work->data + pool->merkle_offset, merkle_root, 32);
-  }
+  /* Mining threads generate their leased works here too */
+  mutex_lock(&stats_lock);
+  local_work += count;
+  mutex_unlock(&stats_lock);
+}
 
-  /* Store the stratum work diff to check it still matches the pool's
-  * stratum diff when submitting shares */
-  work->sdiff = pool->swork.diff;
+/* Generates stratum based work based on the most recent notify information
+ * from the pool. The pool lock is only held to reserve the nonce2s and take
+ * the job. This will keep generating work while a pool is down so we use
+ * other means to detect when the pool has died in stratum_thread */
+static void gen_stratum_works(struct pool *pool, struct work **works, int count)
+{
+  struct stratum_job *job;
+  uint64_t nonce2;
 
-  /* Copy parameters required for share submission */
-  work->job_id = strdup(pool->swork.job_id);
-  work->nonce1 = strdup(pool->nonce1);
-  work->ntime = strdup(pool->swork.ntime);
-  cg_runlock(&pool->data_lock);
+  cg_wlock(&pool->data_lock);
+  job = stratum_job_get(pool->job);
+  nonce2 = pool->nonce2;
+  pool->nonce2 += count;
+  cg_wunlock(&pool->data_lock);
 
-  if (opt_debug) {
-    char *header, *merkle_hash;
-
-    header = bin2hex(work->data, 128);
-    merkle_hash = bin2hex((const unsigned char *)merkle_root, 32);
-    applog(LOG_DEBUG, "[THR%d] Generated stratum merkle %s", work->thr_id, merkle_hash);
-    applog(LOG_DEBUG, "[THR%d] Generated stratum header %s", work->thr_id, header);
-    applog(LOG_DEBUG, "[THR%d] Work job_id %s nonce2 %"PRIu64" ntime %s", work->thr_id, work->job_id,
-           work->nonce2, work->ntime);
-    free(header);
-    free(merkle_hash);
+  gen_job_works(job, nonce2, works, count);
+  stratum_job_put(job);
+}
+
+static void gen_stratum_work(struct pool *pool, struct work *work)
+{
+  gen_stratum_works(pool, &work, 1);
+}
+
+/* Whether mining threads lease their work from pool instead of taking it
+ * from the getwork scheduler. Load balance strategies need the scheduler's
+ * pool rotation, so they always go through it. */
+static bool pool_leased(struct pool *pool)
+{
+  return opt_nonce2_lease && pool_strategy != POOL_LOADBALANCE &&
+         pool_strategy != POOL_BALANCE && pool->has_stratum &&
+         pool->stratum_active && pool->stratum_notify;
+}
+
+/* A mining thread's stratum work straight from its nonce2 lease, taking a
+ * new lease when it's used up or the pool's job has changed. Returns NULL
+ * when leasing doesn't apply, so the work comes from the getwork scheduler
+ * instead. */
+static struct work *get_leased_work(struct thr_info *thr)
+{
+  struct nonce2_lease *lease = &thr->lease;
+  struct pool *pool = current_pool();
+  struct work *work;
+
+  if (!pool_leased(pool)) {
+    stratum_job_put(lease->job);
+    lease->job = NULL;
+    return NULL;
   }
 
-  // For Neoscrypt use set_target_neoscrypt() function
-  if (!safe_cmp(pool->algorithm.name, "neoscrypt")) {
-    set_target_neoscrypt(work->target, work->sdiff, work->thr_id);
-  } else {
-    calc_midstate(work);
-    set_target(work->target, work->sdiff, pool->algorithm.diff_multiplier2, work->thr_id);
+  if (lease->job && (lease->job->pool != pool || lease->job->gen != pool->job_gen ||
+      lease->next >= lease->end)) {
+    stratum_job_put(lease->job);
+    lease->job = NULL;
   }
 
-  local_work++;
-  work->pool = pool;
-  work->stratum = true;
-  work->blk.nonce = 0;
-  work->id = total_work++;
-  work->longpoll = false;
-  work->getwork_mode = GETWORK_MODE_STRATUM;
-  work->work_block = work_block;
-  /* Nominally allow a driver to ntime roll 60 seconds */
-  work->drv_rolllimit = 60;
-  calc_diff(work, work->sdiff);
+  if (!lease->job) {
+    cg_wlock(&pool->data_lock);
+    if (pool->job) {
+      lease->job = stratum_job_get(pool->job);
+      lease->next = pool->nonce2;
+      pool->nonce2 += opt_nonce2_lease;
+      lease->end = pool->nonce2;
+    }
+    cg_wunlock(&pool->data_lock);
+    if (!lease->job)
+      return NULL;
+    applog(LOG_DEBUG, "[THR%d] Leased nonce2 %"PRIu64"-%"PRIu64" on %s job %s", thr->id,
+           lease->next, lease->end - 1, get_pool_name(pool), lease->job->job_id);
+  }
 
-  cgtime(&work->tv_staged);
+  work = make_work();
+  work->thr_id = thr->id;
+  gen_job_works(lease->job, lease->next++, &work, 1);
+  mutex_lock(&stats_lock);
+  pool->works++;
+  mutex_unlock(&stats_lock);
+  return work;
+}
+
+/* How many stratum works the getwork scheduler makes in one go: at least
+ * the free queue slots and one per mining thread blocked in hash_pop, or
+ * what the mining threads go through in STRATUM_BATCH_MS at their measured
+ * rate if that's more. popped is the running works_popped count. */
+static int stratum_batch_size(int room, int waiting, int popped)
+{
+  static struct timeval tv_last;
+  static int popped_last;
+  static double pop_rate;
+  struct timeval now;
+  double secs;
+  int want;
+
+  cgtime(&now);
+  secs = tdiff(&now, &tv_last);
+  if (secs >= 1.0) {
+    if (tv_last.tv_sec)
+      decay_time(&pop_rate, (popped - popped_last) / secs, secs);
+    popped_last = popped;
+    copy_time(&tv_last, &now);
+  }
+
+  want = MAX(room, waiting);
+  want = MAX(want, (int)ceil(pop_rate * STRATUM_BATCH_MS / 1000));
+  want = MIN(want, mining_threads + opt_queue);
+  return MAX(1, MIN(want, STRATUM_BATCH_MAX));
 }
 
 static void enable_devices(void)
@@ -6972,7 +7331,8 @@ static void get_work_prepare_thread(struct thr_info *mythr, struct work *work)
   pthread_cleanup_pop(1);
 }
 
-struct work *get_work(struct thr_info *thr, const int thr_id)
+/* Without blocking, returns NULL if no work is staged right now */
+static struct work *__get_work(struct thr_info *thr, const int thr_id, bool blocking)
 {
   struct work *work = NULL;
   time_t diff_t;
@@ -6981,7 +7341,13 @@ struct work *get_work(struct thr_info *thr, const int thr_id)
   applog(LOG_DEBUG, "[THR%d] Popping work from get queue to get work", thr_id);
   diff_t = time(NULL);
   while (!work) {
-    work = hash_pop(true);
+    work = get_leased_work(thr);
+    if (!work)
+      work = hash_pop(blocking);
+    if (!work) {
+      thread_reportin(thr);
+      return NULL;
+    }
     if (stale_work(work, false)) {
       applog(LOG_DEBUG, "[THR%d] Work is stale, discarding", thr_id);
       discard_work(work);
@@ -7010,6 +7376,11 @@ struct work *get_work(struct thr_info *thr, const int thr_id)
   return work;
 }
 
+struct work *get_work(struct thr_info *thr, const int thr_id)
+{
+  return __get_work(thr, thr_id, true);
+}
+
 /* Submit a copy of the tested, statistic recorded work item asynchronously */
 static void submit_work_async(struct work *work)
 {
@@ -7066,6 +7437,30 @@ void inc_hw_errors(struct thr_info *thr)
   thr->cgpu->drv->hw_error(thr);
 }
 
+/* More nonces were found in one launch than the device's result ring has
+ * slots for. Doubling the device difficulty halves how many come back, so
+ * it doesn't keep happening. Shares are unaffected as long as the device
+ * difficulty stays at or below the work difficulty, which
+ * prepare_sole_work makes sure of. */
+void inc_ring_overflows(struct thr_info *thr, uint32_t lost)
+{
+  struct cgpu_info *cgpu = thr->cgpu;
+  double diff;
+
+  mutex_lock(&stats_lock);
+  ring_overflows += lost;
+  cgpu->ring_overflows += lost;
+  if (cgpu->overflow_diff < 1)
+    cgpu->overflow_diff = 1;
+  if (cgpu->overflow_diff < 0x100000000ULL)
+    cgpu->overflow_diff *= 2;
+  diff = cgpu->overflow_diff;
+  mutex_unlock(&stats_lock);
+
+  applog(LOG_WARNING, "%s%d: %u found nonces did not fit in the result ring, device difficulty raised to %.0f",
+         cgpu->drv->name, cgpu->device_id, lost, diff);
+}
+
 /* Fills in the work nonce and builds the output data in work->hash */
 static void rebuild_nonce(struct work *work, uint32_t nonce)
 {
@@ -7076,14 +7471,12 @@ static void rebuild_nonce(struct work *work, uint32_t nonce)
   work->pool->algorithm.regenhash(work);
 }
 
-/* For testing a nonce against diff 1 */
-bool test_nonce(struct work *work, uint32_t nonce)
+/* Tests the hash already in work->hash against diff 1 */
+static bool hash_meets_diff1(struct work *work)
 {
   uint32_t *hash_32 = (uint32_t *)(work->hash + 28);
   uint32_t diff1targ;
 
-  rebuild_nonce(work, nonce);
-
   // for Neoscrypt, the diff1targ value is in work->target
   if (!safe_cmp(work->pool->algorithm.name, "neoscrypt")) {
     diff1targ = ((uint32_t *)work->target)[7];
@@ -7095,6 +7488,13 @@ bool test_nonce(struct work *work, uint32_t nonce)
   return (le32toh(*hash_32) <= diff1targ);
 }
 
+/* For testing a nonce against diff 1 */
+bool test_nonce(struct work *work, uint32_t nonce)
+{
+  rebuild_nonce(work, nonce);
+  return hash_meets_diff1(work);
+}
+
 static void update_work_stats(struct thr_info *thr, struct work *work)
 {
   double test_diff = current_diff;
@@ -7149,6 +7549,50 @@ bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
   return false;
 }
 
+/* Submits several nonces found for the same work. Algorithms that can hash a
+ * batch of nonces at once get them all in one call rather than one
+ * regenhash per nonce, first only as far as the diff 1 check needs, and
+ * then in full for the ones that pass it. Returns the number of valid
+ * shares. */
+int submit_nonces(struct thr_info *thr, struct work *work, const uint32_t *nonces, int count)
+{
+  uint32_t hashes[64][8], passed[64];
+  int i, j, batch, npassed, valid = 0;
+
+  if (!work->pool->algorithm.regenhash_many) {
+    for (i = 0; i < count; i++)
+      valid += submit_nonce(thr, work, nonces[i]);
+    return valid;
+  }
+
+  for (i = 0; i < count; i += batch) {
+    batch = MIN(count - i, 64);
+    work->pool->algorithm.regenhash_many(work, nonces + i, hashes, batch, false);
+
+    /* Only the last word is there yet, which is all diff 1 looks at */
+    npassed = 0;
+    for (j = 0; j < batch; j++) {
+      memcpy(work->hash + 24, hashes[j] + 6, 8);
+      if (hash_meets_diff1(work))
+        passed[npassed++] = nonces[i + j];
+      else
+        inc_hw_errors(thr);
+    }
+    if (!npassed)
+      continue;
+
+    work->pool->algorithm.regenhash_many(work, passed, hashes, npassed, true);
+    for (j = 0; j < npassed; j++) {
+      *(uint32_t *)(work->data + 76) = htole32(passed[j]);
+      memcpy(work->hash, hashes[j], sizeof(hashes[j]));
+      submit_tested_work(thr, work);
+      valid++;
+    }
+  }
+
+  return valid;
+}
+
 static inline bool abandon_work(struct work *work, struct timeval *wdiff, uint64_t hashes)
 {
   if (wdiff->tv_sec > opt_scantime ||
@@ -7172,6 +7616,87 @@ static void mt_disable(struct thr_info *mythr, const int thr_id,
   drv->thread_enable(mythr);
 }
 
+/* Sets the device target and lets the driver compute its per-work state,
+ * so the work is ready to be hashed */
+static bool prepare_sole_work(struct thr_info *mythr, struct work *work)
+{
+  struct device_drv *drv = mythr->cgpu->drv;
+  /* Raised by inc_ring_overflows, never lowered */
+  double floor_diff = mythr->cgpu->overflow_diff;
+
+  work->device_diff = MIN(MAX(drv->working_diff, floor_diff), work->work_difficulty);
+
+  /* Dynamically adjust the working diff even if the target
+   * diff is very high to ensure we can still validate scrypt is
+   * returning shares. */
+  double wu;
+
+  wu = total_diff1 / total_secs * 60;
+  if (wu > 30 && drv->working_diff < drv->max_diff &&
+    drv->working_diff < work->work_difficulty) {
+    drv->working_diff++;
+    applog(LOG_DEBUG, "Driver %s working diff changed to %.0f",
+         drv->dname, drv->working_diff);
+    work->device_diff = MIN(MAX(drv->working_diff, floor_diff), work->work_difficulty);
+  } else if (drv->working_diff > work->work_difficulty)
+    drv->working_diff = work->work_difficulty;
+
+  if (!safe_cmp(work->pool->algorithm.name, "neoscrypt")) {
+    set_target_neoscrypt(work->device_target, work->device_diff, work->thr_id);
+  } else {
+    set_target(work->device_target, work->device_diff, work->pool->algorithm.diff_multiplier2, work->thr_id);
+  }
+
+  /* Prepare once the device target is known, so drivers can cache it
+   * along with the rest of the per-work kernel arguments. */
+  return drv->prepare_work(mythr, work);
+}
+
+/* Tops up the thread's queue of prepared works with whatever is staged,
+ * without waiting for more. Called after each scanhash, so a job switch or
+ * nonce range rollover can launch straight away. The GPU driver keeps a
+ * launch in flight whenever prepared works are on, which is what keeps the
+ * GPU busy in the meantime. */
+static void fill_prepared_works(struct thr_info *mythr)
+{
+  struct cgpu_info *cgpu = mythr->cgpu;
+
+  while (mythr->n_prepared < cgpu->prepared_works && !mythr->work_restart) {
+    struct work *work = __get_work(mythr, mythr->id, false);
+
+    if (!work)
+      break;
+    if (!prepare_sole_work(mythr, work)) {
+      discard_work(work);
+      break;
+    }
+    mythr->prepared[mythr->n_prepared++] = work;
+  }
+}
+
+static void flush_prepared_works(struct thr_info *mythr)
+{
+  while (mythr->n_prepared)
+    discard_work(mythr->prepared[--mythr->n_prepared]);
+}
+
+/* The oldest prepared work that is still current, or NULL */
+static struct work *next_prepared_work(struct thr_info *mythr)
+{
+  while (mythr->n_prepared) {
+    struct work *work = mythr->prepared[0];
+
+    mythr->n_prepared--;
+    memmove(&mythr->prepared[0], &mythr->prepared[1], mythr->n_prepared * sizeof(struct work *));
+    if (!stale_work(work, false))
+      return work;
+    applog(LOG_DEBUG, "[THR%d] Prepared work is stale, discarding", mythr->id);
+    discard_work(work);
+  }
+
+  return NULL;
+}
+
 /* The main hashing loop for devices that are slow enough to work on one work
  * item at a time, without a queue, aborting work before the entire nonce
  * range has been hashed if needed. */
@@ -7196,42 +7721,24 @@ static void hash_sole_work(struct thr_info *mythr)
   cgtime(&tv_lastupdate);
 
   while (likely(!cgpu->shutdown)) {
-    struct work *work = get_work(mythr, thr_id);
+    struct work *work = next_prepared_work(mythr);
     int64_t hashes;
 
+    if (!work) {
+      work = get_work(mythr, thr_id);
+      if (!prepare_sole_work(mythr, work)) {
+        applog(LOG_ERR, "work prepare failed, exiting "
+          "mining thread %d", thr_id);
+        break;
+      }
+    }
+
     mythr->work_restart = false;
     cgpu->new_work = true;
 
     cgtime(&tv_workstart);
     work->blk.nonce = 0;
     cgpu->max_hashes = 0;
-    if (!drv->prepare_work(mythr, work)) {
-      applog(LOG_ERR, "work prepare failed, exiting "
-        "mining thread %d", thr_id);
-      break;
-    }
-    work->device_diff = MIN(drv->working_diff, work->work_difficulty);
-
-    /* Dynamically adjust the working diff even if the target
-     * diff is very high to ensure we can still validate scrypt is
-     * returning shares. */
-    double wu;
-
-    wu = total_diff1 / total_secs * 60;
-    if (wu > 30 && drv->working_diff < drv->max_diff &&
-      drv->working_diff < work->work_difficulty) {
-      drv->working_diff++;
-      applog(LOG_DEBUG, "Driver %s working diff changed to %.0f",
-           drv->dname, drv->working_diff);
-      work->device_diff = MIN(drv->working_diff, work->work_difficulty);
-    } else if (drv->working_diff > work->work_difficulty)
-      drv->working_diff = work->work_difficulty;
-
-    if (!safe_cmp(work->pool->algorithm.name, "neoscrypt")) {
-      set_target_neoscrypt(work->device_target, work->device_diff, work->thr_id);
-    } else {
-      set_target(work->device_target, work->device_diff, work->pool->algorithm.diff_multiplier2, work->thr_id);
-    }
 
     do {
       cgtime(&tv_start);
@@ -7283,6 +7790,18 @@ static void hash_sole_work(struct thr_info *mythr)
       if (hashes > cgpu->max_hashes)
         cgpu->max_hashes = hashes;
 
+      if (cgpu->prepared_works)
+        fill_prepared_works(mythr);
+
+      if (unlikely(!first_hashes) && hashes > 0) {
+        mutex_lock(&hash_lock);
+        if (!first_hashes) {
+          first_hashes = true;
+          log_startup_phase("first hashes", &startup_tv);
+        }
+        mutex_unlock(&hash_lock);
+      }
+
       timersub(tv_end, &tv_start, &diff);
       sdiff.tv_sec += diff.tv_sec;
       sdiff.tv_usec += diff.tv_usec;
@@ -7331,6 +7850,7 @@ static void hash_sole_work(struct thr_info *mythr)
           rgtp.tv_nsec = 250 * mythr->device_thread * 1000000;
           nanosleep(&rgtp, NULL);
         }
+        flush_prepared_works(mythr);
         break;
       }
 
@@ -7341,6 +7861,7 @@ static void hash_sole_work(struct thr_info *mythr)
     } while (!abandon_work(work, &wdiff, cgpu->max_hashes));
     free_work(work);
   }
+  flush_prepared_works(mythr);
   cgpu->deven = DEV_DISABLED;
 }
 
@@ -8479,9 +9000,39 @@ static void probe_pools(void)
   }
 }
 
+/* Startup phases are logged with how long they took and the time since
+ * launch, so time to first hash can be tracked */
+static void log_startup_phase(const char *phase, struct timeval *phase_start)
+{
+  struct timeval now;
+
+  cgtime(&now);
+  applog(LOG_NOTICE, "Startup: %s took %.2fs, %.2fs since launch", phase,
+         tdiff(&now, phase_start), tdiff(&now, &startup_tv));
+}
+
+/* Prepares all the threads of one device. Devices are prepared in
+ * parallel, their threads one after another. */
+static void *prepare_device_thread(void *userdata)
+{
+  struct cgpu_info *cgpu = (struct cgpu_info *)userdata;
+  int j;
+
+  for (j = 0; j < cgpu->threads; j++) {
+    struct thr_info *thr = cgpu->thr[j];
+
+    if (!cgpu->drv->thread_prepare(thr))
+      applog(LOG_ERR, "thread_prepare failed for thread %d", thr->id);
+  }
+
+  return NULL;
+}
+
 static void restart_mining_threads(unsigned int new_n_threads)
 {
   struct thr_info *thr;
+  struct timeval prepare_start;
+  pthread_t *prepare_thr;
   unsigned int i, j, k;
 
   // Stop and free threads
@@ -8583,13 +9134,25 @@ static void restart_mining_threads(unsigned int new_n_threads)
 
       cgtime(&thr->last);
       cgpu->thr[j] = thr;
-
-      if (!cgpu->drv->thread_prepare(thr)) {
-        applog(LOG_ERR, "thread_prepare failed for thread %d", thr->id);
-        continue;
-      }
     }
   }
+
+  cgtime(&prepare_start);
+  prepare_thr = (pthread_t *)calloc(total_devices, sizeof(pthread_t));
+  if (unlikely(!prepare_thr))
+    quit(1, "Failed to calloc prepare_thr");
+  for (i = 0; i < total_devices; ++i) {
+    if (!devices[i]->threads)
+      continue;
+    if (unlikely(pthread_create(&prepare_thr[i], NULL, prepare_device_thread, (void *)devices[i])))
+      quit(1, "Failed to create device %d prepare thread", i);
+  }
+  for (i = 0; i < total_devices; ++i) {
+    if (devices[i]->threads)
+      pthread_join(prepare_thr[i], NULL);
+  }
+  free(prepare_thr);
+  log_startup_phase("device init", &prepare_start);
   rd_unlock(&devices_lock);
   wr_unlock(&mining_thr_lock);
 
@@ -8646,6 +9209,8 @@ int main(int argc, char *argv[])
   if (unlikely(curl_global_init(CURL_GLOBAL_ALL)))
     quit(1, "Failed to curl_global_init");
 
+  cgtime(&startup_tv);
+
 #if LOCK_TRACKING
   // Must be first
   if (unlikely(pthread_mutex_init(&lockstat_lock, NULL)))
@@ -8667,6 +9232,7 @@ int main(int argc, char *argv[])
   mutex_init(&sharelog_lock);
   cglock_init(&ch_lock);
   mutex_init(&sshare_lock);
+  mutex_init(&work_ref_lock);
   rwlock_init(&blk_lock);
   rwlock_init(&netacc_lock);
   rwlock_init(&mining_thr_lock);
@@ -8804,12 +9370,17 @@ int main(int argc, char *argv[])
 
   gwsched_thr_id = 0;
 
+  /* Start verifying nonces before any device can return them */
+  init_verify_pool(opt_verify_threads);
+
   //Detect GPUs
   /* Use the DRIVER_PARSE_COMMANDS macro to fill all the device_drvs */
   DRIVER_PARSE_COMMANDS(DRIVER_FILL_DEVICE_DRV)
 
   // this will set total_devices
   opencl_drv.drv_detect();
+  cpu_drv.drv_detect();
+  log_startup_phase("device detection", &startup_tv);
 
   if (opt_display_devs) {
     applog(LOG_ERR, "Devices detected:");
@@ -8945,6 +9516,8 @@ int main(int argc, char *argv[])
   }
 
   applog(LOG_NOTICE, "Probing for an alive pool");
+  struct timeval probe_start;
+  cgtime(&probe_start);
   int slept = 0;
   do {
 
@@ -8978,6 +9551,7 @@ int main(int argc, char *argv[])
         quit(0, "No servers could be used! Exiting.");
     }
   } while (!pools_active);
+  log_startup_phase("pool probe", &probe_start);
 
   //wait for GPUs to be initialized after first alive pool is found
   slept = 0;
@@ -9049,7 +9623,8 @@ int main(int argc, char *argv[])
 
   /* Once everything is set up, main() becomes the getwork scheduler */
   while (42) {
-    int ts, max_staged = opt_queue;
+    int ts, max_staged = opt_queue, waiting, popped, i, n;
+    struct work *works[STRATUM_BATCH_MAX];
     struct pool *pool, *cp;
     bool lagging = false;
     struct timespec then;
@@ -9066,6 +9641,12 @@ int main(int argc, char *argv[])
     if (!pool_localgen(cp) && !staged_rollable)
       max_staged += mining_threads;
 
+    /* Mining threads lease their own work from this pool, so anything
+     * staged would only go stale. Keep one around, for a thread whose
+     * lease can't be had, and to keep checking the pool is alive. */
+    if (pool_leased(cp))
+      max_staged = 1;
+
     cgtime(&now);
     then.tv_sec = now.tv_sec + 2;
     then.tv_nsec = now.tv_usec * 1000;
@@ -9081,6 +9662,8 @@ int main(int argc, char *argv[])
       pthread_cond_timedwait(&gws_cond, stgd_lock, &then);
       ts = __total_staged();
     }
+    waiting = getq_waiting;
+    popped = works_popped;
     mutex_unlock(stgd_lock);
 
     if (ts > max_staged) {
@@ -9118,9 +9701,15 @@ retry:
           goto retry;
         }
       }
-      gen_stratum_work(pool, work);
-      applog(LOG_DEBUG, "Generated stratum work");
-      stage_work(work);
+      /* Make a batch for distinct nonce2s and stage it all at once, so
+       * threads waiting after a notify don't get their work one by one */
+      works[0] = work;
+      n = stratum_batch_size(max_staged + 1 - ts, waiting, popped);
+      for (i = 1; i < n; i++)
+        works[i] = make_work();
+      gen_stratum_works(pool, works, n);
+      applog(LOG_DEBUG, "Generated %d stratum works", n);
+      stage_works(works, n);
       continue;
     }
 
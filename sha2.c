@@ -36,6 +36,12 @@
 
 #include "sha2.h"
 
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SHA256_SIMD_X86
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
 #define SHFR(x, n)    (x >> n)
 #define ROTR(x, n)   ((x >> n) | (x << ((sizeof(x) << 3) - n)))
 #define CH(x, y, z)  ((x & y) ^ (~x & z))
@@ -92,8 +98,11 @@ uint32_t sha256_k[64] =
 
 /* SHA-256 functions */
 
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
+typedef void (*sha256_transf_fn)(uint32_t *h, const unsigned char *message,
+                                 unsigned int block_nb);
+
+static void sha256_transf_scalar(uint32_t *h, const unsigned char *message,
+                                 unsigned int block_nb)
 {
     uint32_t w[64];
     uint32_t wv[8];
@@ -115,7 +124,7 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
         }
 
         for (j = 0; j < 8; j++) {
-            wv[j] = ctx->h[j];
+            wv[j] = h[j];
         }
 
         for (j = 0; j < 64; j++) {
@@ -133,33 +142,198 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
         }
 
         for (j = 0; j < 8; j++) {
-            ctx->h[j] += wv[j];
+            h[j] += wv[j];
         }
     }
 }
 
-void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
+#ifdef SHA256_SIMD_X86
+
+/* Intel SHA extensions. The state is kept as ABEF/CDGH halves the way
+ * sha256rnds2 wants it, and each quad of rounds also advances the message
+ * schedule four words ahead with sha256msg1/sha256msg2. */
+
+#define SHANI_QROUND(g, cur, prev, next)                                    \
+{                                                                           \
+    msg = _mm_add_epi32(cur,                                                \
+          _mm_loadu_si128((const __m128i *) &sha256_k[(g) << 2]));          \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                    \
+    if ((g) >= 3 && (g) < 15) {                                             \
+        next = _mm_add_epi32(next, _mm_alignr_epi8(cur, prev, 4));          \
+        next = _mm_sha256msg2_epu32(next, cur);                             \
+    }                                                                       \
+    msg = _mm_shuffle_epi32(msg, 0x0e);                                     \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);                    \
+    if ((g) >= 1 && (g) < 13) {                                             \
+        prev = _mm_sha256msg1_epu32(prev, cur);                             \
+    }                                                                       \
+}
+
+#define SHANI_LOAD(m, g)                                                    \
+{                                                                           \
+    m = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)                  \
+                         (sub_block + ((g) << 4))), bswap);                 \
+}
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_transf_shani(uint32_t *h, const unsigned char *message,
+                                unsigned int block_nb)
 {
-    sha256_ctx ctx;
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                         0x0405060700010203ULL);
+    __m128i state0, state1, msg, tmp, m0, m1, m2, m3, abef, cdgh;
+    const unsigned char *sub_block;
+    unsigned int i;
 
-    sha256_init(&ctx);
-    sha256_update(&ctx, message, len);
-    sha256_final(&ctx, digest);
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[0]), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[4]), 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (i = 0; i < block_nb; i++) {
+        sub_block = message + (i << 6);
+        abef = state0;
+        cdgh = state1;
+
+        SHANI_LOAD(m0, 0);
+        SHANI_QROUND(0, m0, m3, m1);
+        SHANI_LOAD(m1, 1);
+        SHANI_QROUND(1, m1, m0, m2);
+        SHANI_LOAD(m2, 2);
+        SHANI_QROUND(2, m2, m1, m3);
+        SHANI_LOAD(m3, 3);
+        SHANI_QROUND(3, m3, m2, m0);
+        SHANI_QROUND(4, m0, m3, m1);
+        SHANI_QROUND(5, m1, m0, m2);
+        SHANI_QROUND(6, m2, m1, m3);
+        SHANI_QROUND(7, m3, m2, m0);
+        SHANI_QROUND(8, m0, m3, m1);
+        SHANI_QROUND(9, m1, m0, m2);
+        SHANI_QROUND(10, m2, m1, m3);
+        SHANI_QROUND(11, m3, m2, m0);
+        SHANI_QROUND(12, m0, m3, m1);
+        SHANI_QROUND(13, m1, m0, m2);
+        SHANI_QROUND(14, m2, m1, m3);
+        SHANI_QROUND(15, m3, m2, m0);
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    _mm_storeu_si128((__m128i *) &h[0], _mm_blend_epi16(tmp, state1, 0xf0));
+    _mm_storeu_si128((__m128i *) &h[4], _mm_alignr_epi8(state1, tmp, 8));
 }
 
-void sha256_init(sha256_ctx *ctx)
+/* AVX2 8-way: the same rounds as the scalar code, one message per 32-bit
+ * lane, for hashing a batch of equal-length messages together */
+
+#define SHA256_8W_ROTR(x, n) \
+    _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define SHA256_8W_XOR3(x, y, z) \
+    _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+
+#define SHA256_8W_F1(x) SHA256_8W_XOR3(SHA256_8W_ROTR(x,  2), \
+                        SHA256_8W_ROTR(x, 13), SHA256_8W_ROTR(x, 22))
+#define SHA256_8W_F2(x) SHA256_8W_XOR3(SHA256_8W_ROTR(x,  6), \
+                        SHA256_8W_ROTR(x, 11), SHA256_8W_ROTR(x, 25))
+#define SHA256_8W_F3(x) SHA256_8W_XOR3(SHA256_8W_ROTR(x,  7), \
+                        SHA256_8W_ROTR(x, 18), _mm256_srli_epi32(x,  3))
+#define SHA256_8W_F4(x) SHA256_8W_XOR3(SHA256_8W_ROTR(x, 17), \
+                        SHA256_8W_ROTR(x, 19), _mm256_srli_epi32(x, 10))
+
+__attribute__((target("avx2")))
+static void sha256_transf_8way(__m256i *h, __m256i *w)
 {
-    int i;
-    for (i = 0; i < 8; i++) {
-        ctx->h[i] = sha256_h0[i];
+    __m256i wv[8], t1, t2;
+    int j;
+
+    for (j = 16; j < 64; j++) {
+        w[j] = _mm256_add_epi32(
+               _mm256_add_epi32(SHA256_8W_F4(w[j - 2]), w[j - 7]),
+               _mm256_add_epi32(SHA256_8W_F3(w[j - 15]), w[j - 16]));
     }
 
-    ctx->len = 0;
-    ctx->tot_len = 0;
+    for (j = 0; j < 8; j++) {
+        wv[j] = h[j];
+    }
+
+    for (j = 0; j < 64; j++) {
+        t1 = _mm256_add_epi32(
+             _mm256_add_epi32(wv[7], SHA256_8W_F2(wv[4])),
+             _mm256_add_epi32(
+             _mm256_xor_si256(_mm256_and_si256(wv[4], wv[5]),
+                              _mm256_andnot_si256(wv[4], wv[6])),
+             _mm256_add_epi32(_mm256_set1_epi32(sha256_k[j]), w[j])));
+        t2 = _mm256_add_epi32(SHA256_8W_F1(wv[0]),
+             _mm256_or_si256(_mm256_and_si256(wv[0], wv[1]),
+             _mm256_and_si256(wv[2], _mm256_or_si256(wv[0], wv[1]))));
+        wv[7] = wv[6];
+        wv[6] = wv[5];
+        wv[5] = wv[4];
+        wv[4] = _mm256_add_epi32(wv[3], t1);
+        wv[3] = wv[2];
+        wv[2] = wv[1];
+        wv[1] = wv[0];
+        wv[0] = _mm256_add_epi32(t1, t2);
+    }
+
+    for (j = 0; j < 8; j++) {
+        h[j] = _mm256_add_epi32(h[j], wv[j]);
+    }
 }
 
-void sha256_update(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int len)
+#endif /* SHA256_SIMD_X86 */
+
+static const struct {
+    const char *name;
+    sha256_transf_fn fn;
+} sha256_backends[] = {
+    { "scalar", sha256_transf_scalar },
+#ifdef SHA256_SIMD_X86
+    { "SHA-NI", sha256_transf_shani },
+#endif
+};
+
+#define SHA256_BACKENDS (int) (sizeof(sha256_backends) / sizeof(sha256_backends[0]))
+
+static sha256_transf_fn sha256_transf_best = sha256_transf_scalar;
+static bool sha256_use_8way;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+/* The builtin has no "sha" bit on older compilers, so leaf 7 is read
+ * directly; AVX2 also needs the OS to save the ymm state, which the
+ * builtin checks */
+static bool sha256_backend_usable(int idx)
+{
+#ifdef SHA256_SIMD_X86
+    unsigned int eax, ebx, ecx, edx;
+
+    if (sha256_backends[idx].fn == sha256_transf_shani) {
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1 << 19)))
+            return false;
+        if (__get_cpuid_max(0, NULL) < 7)
+            return false;
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return (ebx & (1 << 29)) != 0;
+    }
+#endif
+    return true;
+}
+
+static bool sha256_8way_usable(void)
+{
+#ifdef SHA256_SIMD_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+static void sha256_update_with(sha256_transf_fn transf, sha256_ctx *ctx,
+                               const unsigned char *message, unsigned int len)
 {
     unsigned int block_nb;
     unsigned int new_len, rem_len, tmp_len;
@@ -180,8 +354,8 @@ void sha256_update(sha256_ctx *ctx, const unsigned char *message,
 
     shifted_message = message + rem_len;
 
-    sha256_transf(ctx, ctx->block, 1);
-    sha256_transf(ctx, shifted_message, block_nb);
+    transf(ctx->h, ctx->block, 1);
+    transf(ctx->h, shifted_message, block_nb);
 
     rem_len = new_len % SHA256_BLOCK_SIZE;
 
@@ -192,7 +366,8 @@ void sha256_update(sha256_ctx *ctx, const unsigned char *message,
     ctx->tot_len += (block_nb + 1) << 6;
 }
 
-void sha256_final(sha256_ctx *ctx, unsigned char *digest)
+static void sha256_final_with(sha256_transf_fn transf, sha256_ctx *ctx,
+                              unsigned char *digest)
 {
     unsigned int block_nb;
     unsigned int pm_len;
@@ -210,9 +385,430 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest)
     ctx->block[ctx->len] = 0x80;
     UNPACK32(len_b, ctx->block + pm_len - 4);
 
-    sha256_transf(ctx, ctx->block, block_nb);
+    transf(ctx->h, ctx->block, block_nb);
 
     for (i = 0 ; i < 8; i++) {
         UNPACK32(ctx->h[i], &digest[i << 2]);
     }
 }
+
+/* Double SHA-256 of prefix || messages[i] for each i, one message at a
+ * time */
+static void sha256d_many_with(sha256_transf_fn transf, const sha256_ctx *prefix,
+                              const unsigned char *const *messages,
+                              unsigned int len,
+                              unsigned char (*digests)[SHA256_DIGEST_SIZE],
+                              int count)
+{
+    sha256_ctx ctx;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        ctx = *prefix;
+        sha256_update_with(transf, &ctx, messages[i], len);
+        sha256_final_with(transf, &ctx, digests[i]);
+        sha256_init(&ctx);
+        sha256_update_with(transf, &ctx, digests[i], SHA256_DIGEST_SIZE);
+        sha256_final_with(transf, &ctx, digests[i]);
+    }
+}
+
+#ifdef SHA256_SIMD_X86
+
+/* Block b of the padded stream prefix->block[0..prefix->len) || message,
+ * out of block_nb, with len_b the total length in bits */
+static void sha256_lane_block(unsigned char *out, const sha256_ctx *prefix,
+                              const unsigned char *message, unsigned int len,
+                              unsigned int b, unsigned int block_nb,
+                              unsigned int len_b)
+{
+    unsigned int pos = b << 6, end = prefix->len + len;
+    unsigned int from, to;
+
+    memset(out, 0, SHA256_BLOCK_SIZE);
+
+    if (pos < prefix->len)
+        memcpy(out, prefix->block + pos, prefix->len - pos);
+
+    from = pos > prefix->len ? pos : prefix->len;
+    to = end < pos + SHA256_BLOCK_SIZE ? end : pos + SHA256_BLOCK_SIZE;
+    if (from < to)
+        memcpy(out + from - pos, message + from - prefix->len, to - from);
+
+    if (end >= pos && end < pos + SHA256_BLOCK_SIZE)
+        out[end - pos] = 0x80;
+
+    if (b == block_nb - 1)
+        UNPACK32(len_b, out + SHA256_BLOCK_SIZE - 4);
+}
+
+/* sha256d_many_with() for eight messages at once. Every lane has the same
+ * length, so they all take the same number of blocks. */
+__attribute__((target("avx2")))
+static void sha256d_8way(const sha256_ctx *prefix,
+                         const unsigned char *const *messages, unsigned int len,
+                         unsigned char (*digests)[SHA256_DIGEST_SIZE])
+{
+    unsigned char blocks[8][SHA256_BLOCK_SIZE];
+    uint32_t out[8][8];
+    __m256i h[8], w[64];
+    unsigned int block_nb, len_b, b;
+    int i, l;
+
+    block_nb = (prefix->len + len + 9 + SHA256_BLOCK_SIZE - 1) / SHA256_BLOCK_SIZE;
+    len_b = (prefix->tot_len + prefix->len + len) << 3;
+
+    for (i = 0; i < 8; i++) {
+        h[i] = _mm256_set1_epi32(prefix->h[i]);
+    }
+
+    for (b = 0; b < block_nb; b++) {
+        for (l = 0; l < 8; l++) {
+            sha256_lane_block(blocks[l], prefix, messages[l], len, b, block_nb,
+                              len_b);
+        }
+
+        for (i = 0; i < 16; i++) {
+            uint32_t v[8];
+
+            for (l = 0; l < 8; l++) {
+                PACK32(&blocks[l][i << 2], &v[l]);
+            }
+            w[i] = _mm256_loadu_si256((const __m256i *) v);
+        }
+
+        sha256_transf_8way(h, w);
+    }
+
+    /* The second hash is a single block, the first digest words followed
+     * by the padding for 256 bits */
+    for (i = 0; i < 8; i++) {
+        w[i] = h[i];
+        h[i] = _mm256_set1_epi32(sha256_h0[i]);
+    }
+    w[8] = _mm256_set1_epi32(0x80000000);
+    for (i = 9; i < 15; i++) {
+        w[i] = _mm256_setzero_si256();
+    }
+    w[15] = _mm256_set1_epi32(256);
+
+    sha256_transf_8way(h, w);
+
+    for (i = 0; i < 8; i++) {
+        _mm256_storeu_si256((__m256i *) out[i], h[i]);
+    }
+    for (l = 0; l < 8; l++) {
+        for (i = 0; i < 8; i++) {
+            UNPACK32(out[i][l], &digests[l][i << 2]);
+        }
+    }
+}
+
+#endif /* SHA256_SIMD_X86 */
+
+static void sha256d_many_8way(const sha256_ctx *prefix,
+                              const unsigned char *const *messages,
+                              unsigned int len,
+                              unsigned char (*digests)[SHA256_DIGEST_SIZE],
+                              int count)
+{
+#ifdef SHA256_SIMD_X86
+    const unsigned char *lanes[8];
+    unsigned char tail[8][SHA256_DIGEST_SIZE];
+    int i, l;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        sha256d_8way(prefix, messages + i, len, digests + i);
+    }
+
+    /* Spare lanes just repeat the first message of the tail */
+    if (i < count) {
+        for (l = 0; l < 8; l++) {
+            lanes[l] = messages[i + (i + l < count ? l : 0)];
+        }
+        sha256d_8way(prefix, lanes, len, tail);
+        memcpy(digests + i, tail, (count - i) * sizeof(tail[0]));
+    }
+#else
+    sha256d_many_with(sha256_transf_scalar, prefix, messages, len, digests,
+                      count);
+#endif
+}
+
+/* Known answers from FIPS 180-2, then random lengths and offsets against
+ * the scalar code, for the single-message backend idx */
+static const struct {
+    const char *message;
+    const char *digest;
+} sha256_kat[] = {
+    { "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+    { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+      "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1" },
+};
+
+#define SHA256_KATS (int) (sizeof(sha256_kat) / sizeof(sha256_kat[0]))
+
+static uint64_t sha256_test_rng = 0x243f6a8885a308d3ULL;
+
+static void sha256_test_fill(unsigned char *buf, unsigned int len)
+{
+    unsigned int i;
+
+    /* xorshift64, plenty for test vectors */
+    for (i = 0; i < len; i++) {
+        sha256_test_rng ^= sha256_test_rng << 13;
+        sha256_test_rng ^= sha256_test_rng >> 7;
+        sha256_test_rng ^= sha256_test_rng << 17;
+        buf[i] = (uint8_t) sha256_test_rng;
+    }
+}
+
+static int sha256_backend_check(sha256_transf_fn transf, const char *name,
+                                int count)
+{
+    unsigned char buf[600], want[SHA256_DIGEST_SIZE], got[SHA256_DIGEST_SIZE];
+    sha256_ctx ref, ctx;
+    unsigned int len, split;
+    int bad = 0, i;
+
+    for (i = 0; i < SHA256_KATS; i++) {
+        char *hex;
+
+        sha256_init(&ctx);
+        sha256_update_with(transf, &ctx, (const unsigned char *) sha256_kat[i].message,
+                           strlen(sha256_kat[i].message));
+        sha256_final_with(transf, &ctx, got);
+        hex = bin2hex(got, SHA256_DIGEST_SIZE);
+        if (strcmp(hex, sha256_kat[i].digest)) {
+            applog(LOG_ERR, "SHA-256 %s: known answer %d gave %s", name, i, hex);
+            bad++;
+        }
+        free(hex);
+    }
+
+    for (i = 0; i < count; i++) {
+        sha256_test_fill(buf, sizeof(buf));
+        len = buf[0] + buf[1] + 1;
+        split = buf[2] % len;
+
+        sha256_init(&ref);
+        sha256_update_with(sha256_transf_scalar, &ref, buf, len);
+        sha256_final_with(sha256_transf_scalar, &ref, want);
+
+        sha256_init(&ctx);
+        sha256_update_with(transf, &ctx, buf, split);
+        sha256_update_with(transf, &ctx, buf + split, len - split);
+        sha256_final_with(transf, &ctx, got);
+
+        if (memcmp(want, got, SHA256_DIGEST_SIZE)) {
+            applog(LOG_ERR, "SHA-256 %s: mismatch on %u bytes split at %u",
+                   name, len, split);
+            bad++;
+        }
+    }
+
+    return bad;
+}
+
+/* Batches of coinbase-like messages resumed from a random prefix, the
+ * 8-way path against sha256d_many_with() on the scalar code */
+static int sha256_8way_check(int count)
+{
+    unsigned char buf[11][300], want[11][SHA256_DIGEST_SIZE];
+    unsigned char got[11][SHA256_DIGEST_SIZE], pre[200];
+    const unsigned char *messages[11];
+    sha256_ctx prefix;
+    unsigned int len, plen;
+    int bad = 0, i, n, l;
+
+    for (i = 0; i < count; i++) {
+        sha256_test_fill(pre, sizeof(pre));
+        plen = pre[0] % sizeof(pre);
+        n = 1 + pre[1] % 11;
+
+        sha256_init(&prefix);
+        sha256_update_with(sha256_transf_scalar, &prefix, pre, plen);
+
+        sha256_test_fill(buf[0], sizeof(buf));
+        len = buf[0][0] + buf[0][1] % 45;
+        for (l = 0; l < n; l++) {
+            messages[l] = buf[l];
+        }
+
+        sha256d_many_with(sha256_transf_scalar, &prefix, messages, len, want, n);
+        sha256d_many_8way(&prefix, messages, len, got, n);
+
+        for (l = 0; l < n; l++) {
+            if (memcmp(want[l], got[l], SHA256_DIGEST_SIZE)) {
+                applog(LOG_ERR, "SHA-256 8-way: lane %d of %d mismatch on %u+%u bytes",
+                       l, n, plen, len);
+                bad++;
+            }
+        }
+    }
+
+    return bad;
+}
+
+/* Take the first hardware backend that passes its self-test */
+static void sha256_select(void)
+{
+    int i;
+
+    for (i = SHA256_BACKENDS - 1; i > 0; i--) {
+        if (!sha256_backend_usable(i))
+            continue;
+        if (sha256_backend_check(sha256_backends[i].fn, sha256_backends[i].name, 16)) {
+            applog(LOG_WARNING, "SHA-256 %s failed its self-test, not using it",
+                   sha256_backends[i].name);
+            continue;
+        }
+        sha256_transf_best = sha256_backends[i].fn;
+        applog(LOG_DEBUG, "SHA-256: using %s", sha256_backends[i].name);
+        break;
+    }
+
+    /* A single SHA-NI stream is still faster than eight AVX2 lanes */
+    if (sha256_8way_usable() && sha256_transf_best == sha256_transf_scalar) {
+        if (sha256_8way_check(4))
+            applog(LOG_WARNING, "SHA-256 8-way AVX2 failed its self-test, not using it");
+        else
+            sha256_use_8way = true;
+    }
+}
+
+void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
+{
+    sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, message, len);
+    sha256_final(&ctx, digest);
+}
+
+void sha256_init(sha256_ctx *ctx)
+{
+    int i;
+    for (i = 0; i < 8; i++) {
+        ctx->h[i] = sha256_h0[i];
+    }
+
+    ctx->len = 0;
+    ctx->tot_len = 0;
+}
+
+void sha256_update(sha256_ctx *ctx, const unsigned char *message,
+                   unsigned int len)
+{
+    pthread_once(&sha256_once, sha256_select);
+    sha256_update_with(sha256_transf_best, ctx, message, len);
+}
+
+void sha256_final(sha256_ctx *ctx, unsigned char *digest)
+{
+    pthread_once(&sha256_once, sha256_select);
+    sha256_final_with(sha256_transf_best, ctx, digest);
+}
+
+void sha256d_many(const sha256_ctx *prefix, const unsigned char *const *messages,
+                  unsigned int len, unsigned char (*digests)[SHA256_DIGEST_SIZE],
+                  int count)
+{
+    sha256_ctx empty;
+
+    if (!prefix) {
+        sha256_init(&empty);
+        prefix = &empty;
+    }
+
+    pthread_once(&sha256_once, sha256_select);
+    if (sha256_use_8way)
+        sha256d_many_8way(prefix, messages, len, digests, count);
+    else
+        sha256d_many_with(sha256_transf_best, prefix, messages, len, digests,
+                          count);
+}
+
+int sha256_check(int count)
+{
+    int bad = 0, i;
+
+    for (i = 0; i < SHA256_BACKENDS; i++) {
+        if (sha256_backend_usable(i))
+            bad += sha256_backend_check(sha256_backends[i].fn,
+                                        sha256_backends[i].name, count);
+    }
+
+    if (sha256_8way_usable())
+        bad += sha256_8way_check(count);
+
+    return bad;
+}
+
+void sha256_bench(double seconds)
+{
+    unsigned char buf[8][SHA256_BLOCK_SIZE * 4], digests[8][SHA256_DIGEST_SIZE];
+    const unsigned char *messages[8];
+    struct timeval tv_start, tv_now;
+    sha256_ctx prefix;
+    uint32_t h[8];
+    uint64_t done;
+    double elapsed;
+    int i, k;
+
+    sha256_test_fill(buf[0], sizeof(buf));
+    for (i = 0; i < 8; i++) {
+        messages[i] = buf[i];
+    }
+
+    /* Raw compression speed */
+    for (i = 0; i < SHA256_BACKENDS; i++) {
+        if (!sha256_backend_usable(i))
+            continue;
+
+        memcpy(h, sha256_h0, sizeof(h));
+        done = 0;
+        cgtime(&tv_start);
+        do {
+            for (k = 0; k < 256; k++, done += 8) {
+                sha256_backends[i].fn(h, buf[0], 4);
+                sha256_backends[i].fn(h, buf[1], 4);
+            }
+            cgtime(&tv_now);
+        } while ((elapsed = tdiff(&tv_now, &tv_start)) < seconds);
+
+        applog(LOG_NOTICE, "SHA-256 %s: %.1f MB/s", sha256_backends[i].name,
+               done * SHA256_BLOCK_SIZE / elapsed / 1e6);
+    }
+
+    /* Coinbase-sized double hashes resumed from a 60 byte prefix, the way
+     * stratum work is made */
+    sha256_init(&prefix);
+    sha256_update_with(sha256_transf_scalar, &prefix, buf[7], 60);
+
+    for (i = 0; i <= SHA256_BACKENDS; i++) {
+        const char *name = i < SHA256_BACKENDS ? sha256_backends[i].name : "AVX2 8-way";
+
+        if (i < SHA256_BACKENDS ? !sha256_backend_usable(i) : !sha256_8way_usable())
+            continue;
+
+        done = 0;
+        cgtime(&tv_start);
+        do {
+            for (k = 0; k < 64; k++, done += 8) {
+                if (i < SHA256_BACKENDS)
+                    sha256d_many_with(sha256_backends[i].fn, &prefix, messages,
+                                      140, digests, 8);
+                else
+                    sha256d_many_8way(&prefix, messages, 140, digests, 8);
+            }
+            cgtime(&tv_now);
+        } while ((elapsed = tdiff(&tv_now, &tv_start)) < seconds);
+
+        applog(LOG_NOTICE, "SHA-256 %s: %.1f k coinbases/s", name,
+               done / elapsed / 1e3);
+    }
+}
@@ -55,4 +55,16 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
 
+/* Double SHA-256 of prefix || messages[i] into digests[i] for count
+ * messages of len bytes each; prefix may be NULL. Batches go through the
+ * AVX2 8-way code when the CPU has it and no SHA extensions. */
+void sha256d_many(const sha256_ctx *prefix, const unsigned char *const *messages,
+                  unsigned int len, unsigned char (*digests)[SHA256_DIGEST_SIZE],
+                  int count);
+
+/* Known answers and random messages through every backend the CPU can run,
+ * against the scalar code; returns the number of mismatches */
+int sha256_check(int count);
+void sha256_bench(double seconds);
+
 #endif /* !SHA2_H */
@@ -1502,6 +1502,87 @@ static char *json_array_string(json_t *val, unsigned int entry)
 
 static char *blank_merkel = "0000000000000000000000000000000000000000000000000000000000000000";
 
+static pthread_mutex_t job_ref_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Takes another reference to a stratum job, to read it with no pool lock */
+struct stratum_job *stratum_job_get(struct stratum_job *job)
+{
+  mutex_lock(&job_ref_lock);
+  job->refs++;
+  mutex_unlock(&job_ref_lock);
+
+  return job;
+}
+
+void stratum_job_put(struct stratum_job *job)
+{
+  bool last;
+
+  if (!job)
+    return;
+
+  mutex_lock(&job_ref_lock);
+  last = !--job->refs;
+  mutex_unlock(&job_ref_lock);
+
+  if (!last)
+    return;
+
+  free(job->job_id);
+  free(job->nonce1);
+  free(job->ntime);
+  free(job->nbit);
+  free(job->coinbase);
+  free(job->merkle_bin);
+  free(job);
+}
+
+/* Replace the pool's job with a snapshot of the current notify and
+ * difficulty, which ends every lease on the old one. Must be called with
+ * the pool's data_lock write locked. */
+static void stratum_job_update(struct pool *pool)
+{
+  struct stratum_job *job, *old;
+  int i;
+
+  job = (struct stratum_job *)calloc(1, sizeof(*job));
+  if (unlikely(!job))
+    quithere(1, "Failed to calloc job in stratum_job_update");
+
+  job->refs = 1;
+  job->gen = ++pool->job_gen;
+  job->job_id_gen = pool->job_id_gen;
+  job->pool = pool;
+  job->job_id = strdup(pool->swork.job_id);
+  job->nonce1 = strdup(pool->nonce1);
+  job->ntime = strdup(pool->swork.ntime);
+  job->nbit = strdup(pool->swork.nbit);
+  job->diff = pool->swork.diff;
+
+  job->cb_len = pool->swork.cb_len;
+  job->nonce2_offset = pool->nonce2_offset;
+  job->n2size = pool->n2size;
+  job->coinbase = (unsigned char *)malloc(job->cb_len);
+  if (unlikely(!job->coinbase))
+    quithere(1, "Failed to malloc coinbase in stratum_job_update");
+  memcpy(job->coinbase, pool->coinbase, job->cb_len);
+  memset(job->coinbase + job->nonce2_offset, 0, job->n2size);
+  job->cb_prefix = pool->swork.cb_prefix;
+
+  job->merkles = pool->swork.merkles;
+  job->merkle_bin = (unsigned char (*)[32])malloc(32 * (job->merkles + 1));
+  if (unlikely(!job->merkle_bin))
+    quithere(1, "Failed to malloc merkle_bin in stratum_job_update");
+  for (i = 0; i < job->merkles; i++)
+    memcpy(job->merkle_bin[i], pool->swork.merkle_bin[i], 32);
+  memcpy(job->header_bin, pool->header_bin, 128);
+  job->merkle_offset = pool->merkle_offset;
+
+  old = pool->job;
+  pool->job = job;
+  stratum_job_put(old);
+}
+
 static bool parse_notify(struct pool *pool, json_t *val)
 {
   char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit,
@@ -1628,6 +1709,12 @@ static bool parse_notify(struct pool *pool, json_t *val)
   memcpy(pool->coinbase + cb1_len, pool->nonce1bin, pool->n1_len);
   // NOTE: gap for nonce2, filled at work generation time
   memcpy(pool->coinbase + cb1_len + pool->n1_len + pool->n2size, cb2, cb2_len);
+  sha256_init(&pool->swork.cb_prefix);
+  sha256_update(&pool->swork.cb_prefix, pool->coinbase, pool->nonce2_offset);
+  /* Works from a notify that only resends the job_id stay current */
+  if (!pool->job || strcmp(pool->job->job_id, job_id))
+    pool->job_id_gen++;
+  stratum_job_update(pool);
   cg_wunlock(&pool->data_lock);
 
   if (opt_protocol) {
@@ -1670,6 +1757,8 @@ static bool parse_diff(struct pool *pool, json_t *val)
   cg_wlock(&pool->data_lock);
   old_diff = pool->swork.diff;
   pool->swork.diff = diff;
+  if (pool->job && old_diff != diff)
+    stratum_job_update(pool);
   cg_wunlock(&pool->data_lock);
 
   if (old_diff != diff) {
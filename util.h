@@ -104,6 +104,7 @@ typedef struct timespec cgtimer_t;
 
 struct thr_info;
 struct pool;
+struct stratum_job;
 enum dev_reason;
 struct cgpu_info;
 int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg);
@@ -141,6 +142,8 @@ bool subscribe_extranonce(struct pool *pool);
 bool initiate_stratum(struct pool *pool);
 bool restart_stratum(struct pool *pool);
 void suspend_stratum(struct pool *pool);
+struct stratum_job *stratum_job_get(struct stratum_job *job);
+void stratum_job_put(struct stratum_job *job);
 void dev_error(struct cgpu_info *dev, enum dev_reason reason);
 void *realloc_strcat(char *ptr, char *s);
 void RenameThread(const char* name);